@@ -4,6 +4,7 @@
 #include <hal/nrf_clock.h>
 #include <hal/nrf_i2s.h>
 #include <nrfx_dppi.h>
+#include <math.h>
 #include <nrfx_egu.h>
 #include <zephyr/drivers/i2s.h>
 #include <zephyr/kernel.h>
@@ -14,7 +15,7 @@
 #include "fixed.h"
 #include "freq_ctlr.h"
 #include "freq_est.h"
-#include "record.h"
+#include "pcm.h"
 #include "sync_timer.h"
 #include "zeus/util.h"
 
@@ -29,19 +30,31 @@ struct audio_block_time {
     uint32_t ref_time;
 };
 
-// TODO: sample rate must currently be divisible by the number of samples
-#define AUDIO_BLOCK_SIZE 14400
-#if IS_ENABLED(CONFIG_I2S_NRFX)
-// Queue size limits the number of buffered blocks, so no point having more than
-// the queue size plus one for the block currently being used by the hardware.
-#define AUDIO_BLOCK_COUNT (CONFIG_I2S_NRFX_RX_BLOCK_COUNT + 1)
-#else
-#define AUDIO_BLOCK_COUNT 5
-#endif
-
-K_MEM_SLAB_DEFINE_STATIC(audio_slab, AUDIO_BLOCK_SIZE, AUDIO_BLOCK_COUNT, 4);
+/// Minimum number of blocks: one being filled by I2S, one queued for the next
+/// buffer and one being processed.
+#define AUDIO_BLOCK_COUNT_MIN 3
+#define AUDIO_BLOCK_DURATION_MS_MAX 1000
+/// Time to wait for consumers to return all blocks before reconfiguring
+#define AUDIO_RECONFIGURE_DRAIN_TIMEOUT_MS 2000
+/// Droppable consumers are skipped when fewer than this many blocks are free:
+/// one for I2S to fill next and one for the recorder to fall behind by.
+#define AUDIO_BLOCK_DROPPABLE_RESERVE 2
+
+/// Interval between checks of whether the ADC has settled after power on
+#define AUDIO_SETTLE_POLL_MS 10
+
+/// Period of the sync loop that the controller gains were tuned for
+#define AUDIO_SYNC_DESIGN_PERIOD_S 0.075f
+
+// The slab is carved from the pool with a different block size when the block
+// geometry changes, so it is not statically defined.
+static uint8_t __aligned(4) audio_pool[CONFIG_AUDIO_BLOCK_POOL_SIZE];
+static struct k_mem_slab audio_slab;
+/// Reference count of each block in the pool
+static atomic_t audio_block_refs[AUDIO_BLOCK_COUNT_MAX];
 
 static K_SEM_DEFINE(audio_started, 0, 1);
+static K_SEM_DEFINE(audio_reconfigured, 0, 1);
 static K_THREAD_STACK_DEFINE(audio_thread_stack, 2048);
 
 #define AUDIO_SYNC_ENABLED IS_ENABLED(CONFIG_I2S_NRFX)
@@ -62,36 +75,97 @@ static K_THREAD_STACK_DEFINE(audio_thread_stack, 2048);
 #define AUDIO_HFCLKAUDIO_FREQ_NOMINAL 12288000
 #endif
 
-#define AUDIO_HFCLKAUDIO_FREQ_REG_MIN 36834
-#define AUDIO_HFCLKAUDIO_FREQ_REG_MAX 42874
+/// HFCLKAUDIO settings for a family of sample rates
+struct audio_clock {
+    /// Nominal MCLK frequency (Hz)
+    uint32_t mclk_freq;
+    /// FREQ_VALUE register settings for the nominal, minimum and maximum
+    /// frequency
+    uint16_t freq_reg;
+    uint16_t freq_reg_min;
+    uint16_t freq_reg_max;
+};
+
+// The nRF I2S driver calculates the MCLK ratio assuming the devicetree
+// HFCLKAUDIO frequency. The two families are far enough apart that it still
+// picks the correct ratio for 44.1 kHz based rates.
+static const struct audio_clock audio_clocks[] = {
+    {
+        .mclk_freq = AUDIO_HFCLKAUDIO_FREQ_NOMINAL,
+        .freq_reg = 39846,
+        .freq_reg_min = 36834,
+        .freq_reg_max = 42874,
+    },
+    {
+        .mclk_freq = 11289600,
+        .freq_reg = 15309,
+        .freq_reg_min = 12518,
+        .freq_reg_max = 18071,
+    },
+};
+
+/// MCLK to LRCK ratios supported by the I2S peripheral
+static const uint16_t audio_i2s_ratios[] = {32,  48,  64,  96, 128,
+                                            192, 256, 384, 512};
 
 static K_MUTEX_DEFINE(audio_mutex);
 
 K_MSGQ_DEFINE(audio_block_time_queue, sizeof(struct audio_block_time),
-              AUDIO_BLOCK_COUNT, 1);
+              AUDIO_BLOCK_COUNT_MAX, 1);
+
+/// Parameters that can only be changed while I2S is stopped
+struct audio_params {
+    struct audio_format format;
+    /// Nominal block duration (ms). The actual duration is rounded to a whole
+    /// number of frames.
+    uint16_t block_ms;
+};
 
 static const struct audio_config {
     struct k_mutex *mutex;
+    uint8_t *pool;
+    size_t pool_size;
+    atomic_t *block_refs;
     const struct device *const codec;
     const struct device *const i2s;
     struct k_mem_slab *const slab;
     struct k_sem *const started;
+    struct k_sem *const reconfigured;
 
+    const struct audio_params default_params;
+    /// Estimator configuration. The input gain is calculated at runtime
+    /// because it depends on the MCLK frequency.
     const struct freq_est_config freq_est_cfg;
+    /// Controller gains for a period of AUDIO_SYNC_DESIGN_PERIOD_S at the
+    /// nominal HFCLKAUDIO frequency. These are scaled at runtime to match the
+    /// actual block duration and MCLK.
     const struct freq_ctlr freq_ctlr;
 
     struct k_msgq *const block_time_queue;
 } audio_config = {
     .mutex = &audio_mutex,
+    .pool = audio_pool,
+    .pool_size = sizeof(audio_pool),
+    .block_refs = audio_block_refs,
     .codec = DEVICE_DT_GET(DT_ALIAS(codec)),
     .i2s = DEVICE_DT_GET(DT_ALIAS(i2s)),
     .slab = &audio_slab,
     .started = &audio_started,
+    .reconfigured = &audio_reconfigured,
 
+    .default_params =
+        {
+            .format =
+                {
+                    .sample_rate = 48000,
+                    .channels = 2,
+                    .bits_per_sample = 16,
+                },
+            .block_ms = 75,
+        },
     .freq_est_cfg =
         {
             .nominal_freq = ZEUS_TIME_NOMINAL_FREQ,
-            .k_u = 32e6 / (12.0 * (1 << 16) * AUDIO_HFCLKAUDIO_FREQ_NOMINAL),
             .q_theta = 0.0,
             .q_f = 256.0,
             .r = 390625.0,
@@ -108,17 +182,57 @@ static const struct audio_config {
     .block_time_queue = &audio_block_time_queue,
 };
 
+enum audio_flag {
+    /// Audio thread should apply the pending format
+    AUDIO_FLAG_RECONFIGURE,
+    /// ADC has settled since it was last powered on
+    AUDIO_FLAG_SETTLED,
+};
+
 static struct audio_data {
     bool init;
+    /// ADC is powered on
+    bool input_running;
+    /// ADC had settled before the latest block started. Only used by the audio
+    /// thread.
+    bool input_settled;
+    /// Polls the codec until the ADC has settled
+    struct k_work_delayable settle_work;
+    /// Registered struct audio_consumer
+    sys_slist_t consumers;
     struct k_thread thread;
+    atomic_t flags;
+    /// Current parameters
+    struct audio_params params;
+    /// Clock family for the current format
+    const struct audio_clock *clock;
+    /// Current block geometry
+    struct audio_block_config block_config;
+    /// The slab kernel object has been initialized
+    bool slab_init;
+    /// Parameters to apply when AUDIO_FLAG_RECONFIGURE is set
+    struct audio_params pending_params;
+    /// Result of the last reconfiguration, valid after the reconfigured
+    /// semaphore is given.
+    int reconfigure_result;
     /// Audio sampling period (Q32.32)
     qu32_32 sample_period;
-    /// Time increment per buffer (Q32.32)
+    /// Time increment per buffer (Q32.32), rounded down
     qu32_32 block_duration;
+    /// Remainder of the block duration that doesn't fit in Q32.32, in units of
+    /// 2^-32 ticks divided by the sample rate.
+    uint32_t block_duration_rem;
+    struct freq_est_config freq_est_cfg;
     struct freq_est freq_est;
+    /// Controller gains scaled for the current block duration
+    struct freq_ctlr freq_ctlr;
     /// Number of timer ticks (as Q32.32) that should have elapsed from the time
     /// I2S was started to the start of the latest I2S buffer.
     qu32_32 i2s_time;
+    /// Accumulated block_duration_rem. Whenever this reaches the sample rate,
+    /// i2s_time is incremented by one LSB, so the block timestamps never drift
+    /// regardless of the sample rate.
+    uint32_t i2s_time_rem;
     /// Controller target phase difference between the elapsed ticks counter
     /// (`i2s_time` variable) and central time (recovered via state estimator).
     /// This is set once after both I2S has started and the state estimator is
@@ -126,6 +240,10 @@ static struct audio_data {
     qu32_32 target_theta;
     /// Last controller input
     int16_t hfclkaudio_increment;
+    atomic_t i2s_overruns;
+    atomic_t timestamp_errors;
+    atomic_t sync_outliers;
+    atomic_t sync_resets;
 } audio_data;
 
 /// Update the I2S frequency estimator and controller, and return the starting
@@ -148,11 +266,19 @@ static bool audio_sync_update(const struct audio_block_time *block_time,
         freq_est_update(&data->freq_est, block_time->i2s_time, ref_time,
                         data->hfclkaudio_increment);
 
+    if (result == FREQ_EST_RESULT_OUTLIER) {
+        atomic_inc(&data->sync_outliers);
+    } else if (result == FREQ_EST_RESULT_OUTLIER_RESET) {
+        atomic_inc(&data->sync_resets);
+    }
+
     struct freq_est_state state = freq_est_get_state(&data->freq_est);
     if (result == FREQ_EST_RESULT_INIT) {
         LOG_INF("phase target reset");
         // Round target phase to multiple of sample period. This will
-        // synchronize the sampling times of all devices.
+        // synchronize the sampling times of all devices. The sample period is
+        // truncated to Q32.32, but the resulting error is well under a
+        // nanosecond over the full range of the timer.
         data->target_theta =
             DIV_ROUND_CLOSEST(state.theta, data->sample_period) *
             data->sample_period;
@@ -166,13 +292,13 @@ static bool audio_sync_update(const struct audio_block_time *block_time,
         qu32_32_whole(block_time->i2s_time - data->target_theta);
 
     data->hfclkaudio_increment =
-        freq_ctlr_update(&config->freq_ctlr, data->target_theta, state);
+        freq_ctlr_update(&data->freq_ctlr, data->target_theta, state);
 
     uint16_t freq = nrf_clock_hfclkaudio_config_get(NRF_CLOCK);
 
     // Clamp frequency in bounds
-    int16_t max_inc = AUDIO_HFCLKAUDIO_FREQ_REG_MAX - freq;
-    int16_t min_inc = AUDIO_HFCLKAUDIO_FREQ_REG_MIN - freq;
+    int16_t max_inc = data->clock->freq_reg_max - freq;
+    int16_t min_inc = data->clock->freq_reg_min - freq;
     if (data->hfclkaudio_increment > max_inc) {
         data->hfclkaudio_increment = max_inc;
     } else if (data->hfclkaudio_increment < min_inc) {
@@ -187,17 +313,340 @@ static bool audio_sync_update(const struct audio_block_time *block_time,
     return true;
 }
 
-/// Convert a buffer of 32-bit LE integers to packed 24-bit in place by
-/// discarding the least significant byte. Return the new length of the buffer.
-static size_t audio_buffer_32_to_24(uint8_t *buf, size_t len) {
-    __ASSERT(len % 4 == 0, "Buffer size not a multiple of 32-bits");
+/// I2S word size used to capture the specified format
+static uint8_t audio_format_word_size(const struct audio_format *format) {
+    // 24-bit samples are captured as 32-bit words and packed afterwards
+    return format->bits_per_sample > 16 ? 32 : 16;
+}
+
+static uint8_t audio_format_bytes_per_frame(const struct audio_format *format) {
+    return format->channels * format->bits_per_sample / 8;
+}
+
+/// Find the clock family that can generate the specified format. Return NULL if
+/// the format is not supported.
+static const struct audio_clock *audio_format_clock(
+    const struct audio_format *format) {
+    if (format->bits_per_sample != 16 && format->bits_per_sample != 24) {
+        return NULL;
+    }
+    if (format->sample_rate == 0) return NULL;
+
+    for (size_t i = 0; i < ARRAY_SIZE(audio_clocks); i++) {
+        const struct audio_clock *clock = &audio_clocks[i];
+        if (clock->mclk_freq % format->sample_rate != 0) continue;
 
-    int i, j;
-    for (i = 1, j = 0; i < len; i += 4, j += 3) {
-        memmove(buf + j, buf + i, 3);
+        uint32_t ratio = clock->mclk_freq / format->sample_rate;
+        // Bit clock can't be faster than MCLK
+        if (ratio < format->channels * audio_format_word_size(format)) {
+            continue;
+        }
+        for (size_t j = 0; j < ARRAY_SIZE(audio_i2s_ratios); j++) {
+            if (ratio == audio_i2s_ratios[j]) return clock;
+        }
     }
 
-    return len / 4 * 3;
+    return NULL;
+}
+
+/// Calculate the block geometry for the specified parameters. Return -EINVAL if
+/// the parameters are invalid, or -ENOMEM if the pool is too small to hold
+/// enough blocks.
+static int audio_params_block_config(const struct audio_params *params,
+                                     struct audio_block_config *block_config,
+                                     uint32_t *block_frames) {
+    const struct audio_config *config = &audio_config;
+    const struct audio_format *format = &params->format;
+
+    if (!audio_format_clock(format)) return -EINVAL;
+    if (params->block_ms == 0 ||
+        params->block_ms > AUDIO_BLOCK_DURATION_MS_MAX) {
+        return -EINVAL;
+    }
+
+    // Multiple of four frames keeps the block a multiple of the 16 bytes
+    // processed by each iteration of the 24-bit packing kernel, and the slab
+    // block size a multiple of 4 bytes for any number of channels.
+    uint32_t frames =
+        ROUND_UP(DIV_ROUND_UP(format->sample_rate * params->block_ms, 1000), 4);
+    uint32_t size =
+        frames * format->channels * (audio_format_word_size(format) / 8);
+    uint32_t count = MIN(config->pool_size / size, AUDIO_BLOCK_COUNT_MAX);
+    if (count < AUDIO_BLOCK_COUNT_MIN) return -ENOMEM;
+
+    *block_config = (struct audio_block_config){
+        .duration_ms = params->block_ms,
+        .size = size,
+        .count = count,
+    };
+    if (block_frames) *block_frames = frames;
+    return 0;
+}
+
+/// Scale the controller gains and estimator parameters that depend on the
+/// update rate. The controller designed in model/freq_ctlr.ipynb is effectively
+/// deadbeat, so k_theta scales with 1 / (period * k_u) and k_f with 1 / k_u.
+/// The slew limit and outlier resync count are scaled to stay the same in
+/// seconds rather than iterations.
+static void audio_sync_scale(const struct audio_clock *clock) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+
+    float period_s =
+        qu32_32_to_float(data->block_duration) / ZEUS_TIME_NOMINAL_FREQ;
+    float period_scale = AUDIO_SYNC_DESIGN_PERIOD_S / period_s;
+    float mclk_scale = (float)clock->mclk_freq / AUDIO_HFCLKAUDIO_FREQ_NOMINAL;
+
+    data->freq_est_cfg = config->freq_est_cfg;
+    data->freq_est_cfg.k_u = 32e6 / (12.0 * (1 << 16) * clock->mclk_freq);
+    data->freq_est_cfg.outlier_resync_count = MAX(
+        1, (uint32_t)ceilf(config->freq_est_cfg.outlier_resync_count *
+                           period_scale));
+
+    data->freq_ctlr = (struct freq_ctlr){
+        .k_theta = config->freq_ctlr.k_theta * period_scale * mclk_scale,
+        .k_f = config->freq_ctlr.k_f * mclk_scale,
+        .max_step = CLAMP(lroundf(config->freq_ctlr.max_step / period_scale), 1,
+                          UINT16_MAX),
+    };
+}
+
+/// Divide the pool into blocks of the specified geometry. k_mem_slab_init()
+/// also registers the slab as a kernel object, so it must only be called once;
+/// after that, the free list is rebuilt in place. Every block must be free.
+static int audio_pool_carve(const struct audio_block_config *block_config) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    struct k_mem_slab *slab = config->slab;
+
+    if (!data->slab_init) {
+        int ret = k_mem_slab_init(slab, config->pool, block_config->size,
+                                  block_config->count);
+        if (ret) return ret;
+        data->slab_init = true;
+        return 0;
+    }
+
+    if (k_mem_slab_num_used_get(slab) > 0) return -EBUSY;
+
+    K_SPINLOCK(&slab->lock) {
+        slab->info.block_size = block_config->size;
+        slab->info.num_blocks = block_config->count;
+        slab->free_list = NULL;
+        for (uint32_t i = block_config->count; i-- > 0;) {
+            char *block = slab->buffer + i * block_config->size;
+            *(char **)block = slab->free_list;
+            slab->free_list = block;
+        }
+    }
+    return 0;
+}
+
+/// Configure the block pool, I2S and the codec for the specified parameters,
+/// and update the block timing to match. I2S must not be running and all
+/// blocks must have been freed.
+static int audio_configure(const struct audio_params *params) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    const struct audio_format *format = &params->format;
+    int ret;
+
+    const struct audio_clock *clock = audio_format_clock(format);
+    if (!clock) return -EINVAL;
+
+    struct audio_block_config block_config;
+    uint32_t frames_per_block;
+    ret = audio_params_block_config(params, &block_config, &frames_per_block);
+    if (ret) return ret;
+
+    ret = audio_pool_carve(&block_config);
+    if (ret) {
+        LOG_ERR("failed to initialize block pool (err %d)", ret);
+        return ret;
+    }
+
+    struct audio_codec_cfg cfg = {
+#if AUDIO_SYNC_ENABLED
+        .mclk_freq = clock->mclk_freq,
+#else
+        .mclk_freq = 0,
+#endif
+        .dai_type = AUDIO_DAI_TYPE_I2S,
+        .dai_cfg.i2s =
+            {
+                .word_size = audio_format_word_size(format),
+                .channels = format->channels,
+                .format = I2S_FMT_DATA_FORMAT_LEFT_JUSTIFIED,
+                .options = I2S_OPT_BIT_CLK_MASTER | I2S_OPT_FRAME_CLK_MASTER,
+                .frame_clk_freq = format->sample_rate,
+                .mem_slab = config->slab,
+                .block_size = block_config.size,
+                .timeout = 1000,
+            },
+    };
+
+    if (AUDIO_SYNC_ENABLED) {
+        nrf_clock_hfclkaudio_config_set(NRF_CLOCK, clock->freq_reg);
+    }
+
+    ret = i2s_configure(config->i2s, I2S_DIR_RX, &cfg.dai_cfg.i2s);
+    if (ret) {
+        LOG_ERR("failed to configure I2S (err %d)", ret);
+        return ret;
+    }
+
+    ret = input_codec_configure(config->codec, &cfg);
+    if (ret) {
+        LOG_ERR("failed to configure codec (err %d)", ret);
+        return ret;
+    }
+
+    uint32_t rate = format->sample_rate;
+    data->sample_period = qu32_32_from_int(ZEUS_TIME_NOMINAL_FREQ) / rate;
+
+    // Shifting the block duration in ticks directly into Q32.32 would overflow
+    // 64 bits, so divide in two steps: first the whole ticks, then the
+    // fractional part from the remainder. Whatever is left over after that is
+    // carried between blocks in i2s_time_rem.
+    uint64_t block_ticks_num =
+        (uint64_t)ZEUS_TIME_NOMINAL_FREQ * frames_per_block;
+    uint64_t frac_num = (block_ticks_num % rate) << 32;
+    data->block_duration = qu32_32_from_int(block_ticks_num / rate) |
+                           (frac_num / rate);
+    data->block_duration_rem = frac_num % rate;
+
+    audio_sync_scale(clock);
+
+    // Timing restarts from zero, so the estimator must resync
+    freq_est_init(&data->freq_est, &data->freq_est_cfg);
+    data->hfclkaudio_increment = 0;
+    data->i2s_time = 0;
+    data->i2s_time_rem = 0;
+
+    data->params = *params;
+    data->clock = clock;
+    data->block_config = block_config;
+    LOG_INF("%" PRIu32 " Hz, %u-bit, %" PRIu32 " blocks of %" PRIu32 " bytes",
+            format->sample_rate, format->bits_per_sample, block_config.count,
+            block_config.size);
+    return 0;
+}
+
+/// Stop I2S, apply the pending format and restart. Called from the audio thread
+/// so that no I2S reads are in progress.
+static int audio_reconfigure(void) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
+
+    ret = i2s_trigger(config->i2s, I2S_DIR_RX, I2S_TRIGGER_DROP);
+    if (ret) {
+        LOG_ERR("failed to stop I2S (err %d)", ret);
+        return ret;
+    }
+
+    // No more timestamps can arrive with I2S stopped, so the queue and elapsed
+    // time can be reset safely.
+    k_msgq_purge(config->block_time_queue);
+
+    // The pool can only be carved up again once every block has been returned,
+    // both by the I2S driver (which frees its buffers asynchronously after
+    // stopping) and by consumers that are still writing out the last blocks.
+    int64_t deadline = k_uptime_get() + AUDIO_RECONFIGURE_DRAIN_TIMEOUT_MS;
+    while (k_mem_slab_num_used_get(config->slab) > 0) {
+        if (k_uptime_get() >= deadline) {
+            LOG_ERR("timed out waiting for blocks to be freed");
+            ret = -EBUSY;
+            goto restart;
+        }
+        k_sleep(K_MSEC(10));
+    }
+
+    struct audio_params old_params = data->params;
+    ret = audio_configure(&data->pending_params);
+    if (ret) {
+        // Try to keep running with the old parameters
+        (void)audio_configure(&old_params);
+    }
+
+restart:;
+    int err = i2s_trigger(config->i2s, I2S_DIR_RX, I2S_TRIGGER_START);
+    if (err) {
+        LOG_ERR("failed to re-start I2S (err %d)", err);
+        return err;
+    }
+
+    return ret;
+}
+
+/// Restart I2S after an error. Blocks are lost while it is stopped and the
+/// frame clock restarts with a different phase, so the timestamp queue is
+/// resynchronized with the buffers and the phase estimate is reset. The next
+/// block is then timestamped from its own DPPI capture, which lets the
+/// recording module detect the gap. Pass I2S_TRIGGER_PREPARE if I2S is in the
+/// error state, or I2S_TRIGGER_DROP if it is still running.
+static int audio_restart(enum i2s_trigger_cmd stop_cmd) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int err;
+
+    err = i2s_trigger(config->i2s, I2S_DIR_RX, stop_cmd);
+    if (err) {
+        LOG_ERR("failed to stop I2S (err %d)", err);
+        return err;
+    }
+
+    // No timestamps can arrive with I2S stopped, and any left in the queue
+    // belong to buffers that were dropped.
+    k_msgq_purge(config->block_time_queue);
+    freq_est_reset(&data->freq_est);
+    data->hfclkaudio_increment = 0;
+
+    err = i2s_trigger(config->i2s, I2S_DIR_RX, I2S_TRIGGER_START);
+    if (err) {
+        LOG_ERR("failed to re-start I2S (err %d)", err);
+        return err;
+    }
+
+    return 0;
+}
+
+static atomic_t *audio_block_refs_get(const struct audio_block *block) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+
+    // 24-bit packing is done in place, so the buffer still starts at the slab
+    // block.
+    size_t idx = (block->buf - config->pool) / data->block_config.size;
+    __ASSERT(idx < data->block_config.count, "Block not from audio pool");
+    return &config->block_refs[idx];
+}
+
+/// Pass a block to every consumer, then release the audio thread's reference.
+static void audio_block_dispatch(const struct audio_block *block) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    struct audio_consumer *consumer;
+
+    bool pool_low = k_mem_slab_num_free_get(config->slab) <
+                    AUDIO_BLOCK_DROPPABLE_RESERVE;
+
+    // The audio thread holds a reference until every consumer has one, in
+    // case a consumer releases its reference before returning.
+    atomic_set(audio_block_refs_get(block), 1);
+
+    // The audio thread is cooperative and consumers never block, so the list
+    // can't change while it is being walked.
+    SYS_SLIST_FOR_EACH_CONTAINER(&data->consumers, consumer, node) {
+        if (consumer->droppable && pool_low) {
+            atomic_inc(&consumer->dropped);
+            continue;
+        }
+        audio_block_ref(block);
+        consumer->submit(block);
+    }
+
+    audio_block_free(block);
 }
 
 static void audio_thread_run(void *p1, void *p2, void *p3) {
@@ -215,20 +664,18 @@ static void audio_thread_run(void *p1, void *p2, void *p3) {
         void *block_buf = NULL;
         uint32_t block_size;
 
+        if (atomic_test_and_clear_bit(&data->flags, AUDIO_FLAG_RECONFIGURE)) {
+            data->reconfigure_result = audio_reconfigure();
+            k_sem_give(config->reconfigured);
+        }
+
         err = i2s_read(config->i2s, &block_buf, &block_size);
         if (err) {
             LOG_ERR("failed to read I2S (err %d)", err);
+            atomic_inc(&data->i2s_overruns);
 
-            err = i2s_trigger(config->i2s, I2S_DIR_RX, I2S_TRIGGER_PREPARE);
-            if (err) {
-                LOG_ERR("failed to clear I2S error (err %d)", err);
-                break;
-            }
-            err = i2s_trigger(config->i2s, I2S_DIR_RX, I2S_TRIGGER_START);
-            if (err) {
-                LOG_ERR("failed to re-start I2S (err %d)", err);
-                break;
-            }
+            err = audio_restart(I2S_TRIGGER_PREPARE);
+            if (err) break;
             continue;
         }
 
@@ -240,9 +687,15 @@ static void audio_thread_run(void *p1, void *p2, void *p3) {
             // should never have to wait for a timestamp to become available
             err = k_msgq_get(config->block_time_queue, &block_time, K_NO_WAIT);
             if (err) {
-                // If this happens, EGU interrupt never ran
+                // If this happens, EGU interrupt never ran, so the timestamps
+                // no longer line up with the buffers.
                 LOG_ERR("did not receive block timestamp (err %d)", err);
-                break;
+                atomic_inc(&data->timestamp_errors);
+                k_mem_slab_free(config->slab, block_buf);
+
+                err = audio_restart(I2S_TRIGGER_DROP);
+                if (err) break;
+                continue;
             }
             block_start_time_valid =
                 audio_sync_update(&block_time, &block_start_time);
@@ -255,20 +708,35 @@ static void audio_thread_run(void *p1, void *p2, void *p3) {
 
         // Don't pass buffer to recording module if we don't have a valid
         // timestamp for it
-        if (block_start_time_valid) {
-            const struct audio_block block = {
-                .buf = block_buf,
-                .len = block_size,
-                .start_time = block_start_time,
-                .duration = qu32_32_whole(data->block_duration),
-                // TODO: don't hardcode
-                .bytes_per_frame = 6,
-            };
-
-            record_buffer(&block);
+        if (!block_start_time_valid) {
+            k_mem_slab_free(config->slab, block_buf);
+            continue;
+        }
+
+        if (audio_format_word_size(&data->params.format) !=
+            data->params.format.bits_per_sample) {
+            block_size = pcm_pack_32_to_24(block_buf, block_size);
         }
 
-        k_mem_slab_free(config->slab, block_buf);
+        // The settled flag is set some time after the codec actually settled,
+        // so the block in progress when it is first seen may still contain
+        // invalid samples.
+        bool settling = !data->input_settled;
+        data->input_settled =
+            atomic_test_bit(&data->flags, AUDIO_FLAG_SETTLED);
+
+        const struct audio_block block = {
+            .buf = block_buf,
+            .len = block_size,
+            .start_time = block_start_time,
+            .duration = qu32_32_whole(data->block_duration + QU32_32_ONE / 2),
+            .format = data->params.format,
+            .bytes_per_frame =
+                audio_format_bytes_per_frame(&data->params.format),
+            .settling = settling,
+        };
+
+        audio_block_dispatch(&block);
     }
 }
 
@@ -280,6 +748,11 @@ static void audio_egu_handler(uint8_t event_idx, void *p_context) {
         .ref_time = sync_timer_get_i2s_time(),
     };
     data->i2s_time += data->block_duration;
+    data->i2s_time_rem += data->block_duration_rem;
+    if (data->i2s_time_rem >= data->params.format.sample_rate) {
+        data->i2s_time_rem -= data->params.format.sample_rate;
+        data->i2s_time++;
+    }
     int err = k_msgq_put(config->block_time_queue, &block_time, K_NO_WAIT);
     if (err < 0) {
         // I2S buffer should overrun before this happens
@@ -343,6 +816,7 @@ static int audio_settings_load_cb(const char *key, size_t len,
                                   settings_read_cb read_cb, void *cb_arg,
                                   void *param) {
     const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
     int ret;
     const char *next;
 
@@ -414,6 +888,30 @@ static int audio_settings_load_cb(const char *key, size_t len,
             LOG_WRN("unknown channel setting: %s", key);
             return 0;
         }
+    } else if (strcmp(key, "bits") == 0) {
+        uint8_t bits_per_sample;
+        ret = read_cb(cb_arg, &bits_per_sample, sizeof(bits_per_sample));
+        if (ret != sizeof(bits_per_sample)) {
+            LOG_WRN("failed to read setting: %s (read %d)", key, ret);
+            return 0;
+        }
+        data->params.format.bits_per_sample = bits_per_sample;
+    } else if (strcmp(key, "rate") == 0) {
+        uint32_t sample_rate;
+        ret = read_cb(cb_arg, &sample_rate, sizeof(sample_rate));
+        if (ret != sizeof(sample_rate)) {
+            LOG_WRN("failed to read setting: %s (read %d)", key, ret);
+            return 0;
+        }
+        data->params.format.sample_rate = sample_rate;
+    } else if (strcmp(key, "block_ms") == 0) {
+        uint16_t block_ms;
+        ret = read_cb(cb_arg, &block_ms, sizeof(block_ms));
+        if (ret != sizeof(block_ms)) {
+            LOG_WRN("failed to read setting: %s (read %d)", key, ret);
+            return 0;
+        }
+        data->params.block_ms = block_ms;
     } else {
         LOG_WRN("unknown audio setting: %s", key);
         return 0;
@@ -422,6 +920,27 @@ static int audio_settings_load_cb(const char *key, size_t len,
     return 0;
 }
 
+static void audio_settle_work_handler(struct k_work *work) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->input_running) return;
+
+    ret = input_codec_input_settled(config->codec);
+    if (ret == 0) {
+        k_work_schedule(&data->settle_work, K_MSEC(AUDIO_SETTLE_POLL_MS));
+        return;
+    } else if (ret < 0) {
+        // Don't hold off recording forever if the status can't be read
+        LOG_WRN("failed to get ADC status (err %d)", ret);
+    }
+
+    atomic_set_bit(&data->flags, AUDIO_FLAG_SETTLED);
+    LOG_DBG("ADC settled");
+}
+
 int audio_init() {
     int ret;
     const struct audio_config *config = &audio_config;
@@ -440,47 +959,6 @@ int audio_init() {
         return -ENODEV;
     }
 
-    struct audio_codec_cfg cfg = {
-#if AUDIO_SYNC_ENABLED
-        .mclk_freq = AUDIO_HFCLKAUDIO_FREQ_NOMINAL,
-#else
-        .mclk_freq = 0,
-#endif
-        .dai_type = AUDIO_DAI_TYPE_I2S,
-        .dai_cfg.i2s =
-            {
-                .word_size = 16,
-                .channels = 2,
-                .format = I2S_FMT_DATA_FORMAT_LEFT_JUSTIFIED,
-                .options = I2S_OPT_BIT_CLK_MASTER | I2S_OPT_FRAME_CLK_MASTER,
-                .frame_clk_freq = 48000,
-                .mem_slab = config->slab,
-                .block_size = config->slab->info.block_size,
-                .timeout = 1000,
-            },
-    };
-
-    data->sample_period = qu32_32_from_int(ZEUS_TIME_NOMINAL_FREQ) /
-                          cfg.dai_cfg.i2s.frame_clk_freq;
-
-    uint32_t frames_per_block = AUDIO_BLOCK_SIZE / cfg.dai_cfg.i2s.channels /
-                                (cfg.dai_cfg.i2s.word_size / 8);
-    __ASSERT(frames_per_block * cfg.dai_cfg.i2s.channels *
-                     cfg.dai_cfg.i2s.word_size ==
-                 AUDIO_BLOCK_SIZE * 8,
-             "Block size not a multiple of frame size");
-    // TODO: allow sample-rates that aren't a multiple of frame/block.
-    // Naive implementation overflows 64-bit integer with intermediate
-    // result.
-    data->block_duration =
-        qu32_32_from_int((uint64_t)ZEUS_TIME_NOMINAL_FREQ * frames_per_block /
-                         cfg.dai_cfg.i2s.frame_clk_freq);
-    __ASSERT(data->block_duration * cfg.dai_cfg.i2s.frame_clk_freq ==
-                 qu32_32_from_int(ZEUS_TIME_NOMINAL_FREQ * frames_per_block),
-             "Block duration not a whole number of timer ticks");
-
-    freq_est_init(&data->freq_est, &config->freq_est_cfg);
-
     nrfx_egu_t egu = NRFX_EGU_INSTANCE(AUDIO_EGU_IDX);
 
     IRQ_CONNECT(AUDIO_EGU_IRQ, AUDIO_EGU_IRQ_PRIO,
@@ -501,22 +979,20 @@ int audio_init() {
         nrfx_dppi_channel_enable(i2s_dppi);
     }
 
+    k_work_init_delayable(&data->settle_work, audio_settle_work_handler);
+
+    data->params = config->default_params;
     ret = settings_load_subtree_direct("audio", audio_settings_load_cb, NULL);
     if (ret) {
         LOG_WRN("failed to load settings (err %d)", ret);
     }
 
-    ret = i2s_configure(config->i2s, I2S_DIR_RX, &cfg.dai_cfg.i2s);
-    if (ret) {
-        LOG_ERR("failed to configure I2S (err %d)", ret);
-        return ret;
-    }
-
-    ret = input_codec_configure(config->codec, &cfg);
-    if (ret) {
-        LOG_ERR("failed to configure codec (err %d)", ret);
-        return ret;
+    ret = audio_configure(&data->params);
+    if (ret == -EINVAL || ret == -ENOMEM) {
+        LOG_WRN("invalid saved parameters, using defaults");
+        ret = audio_configure(&config->default_params);
     }
+    if (ret) return ret;
 
     k_thread_create(&data->thread, audio_thread_stack,
                     K_THREAD_STACK_SIZEOF(audio_thread_stack), audio_thread_run,
@@ -534,18 +1010,181 @@ int audio_init() {
     return 0;
 }
 
+int audio_add_consumer(struct audio_consumer *consumer) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    sys_slist_append(&data->consumers, &consumer->node);
+    return 0;
+}
+
+void audio_block_ref(const struct audio_block *block) {
+    atomic_inc(audio_block_refs_get(block));
+}
+
+void audio_block_free(const struct audio_block *block) {
+    const struct audio_config *config = &audio_config;
+
+    if (atomic_dec(audio_block_refs_get(block)) == 1) {
+        k_mem_slab_free(config->slab, block->buf);
+    }
+}
+
 int audio_start(void) {
     const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
 
     K_MUTEX_AUTO_LOCK(config->mutex);
-    return input_codec_start_input(config->codec);
+    ret = input_codec_start_input(config->codec);
+    if (ret == 0) {
+        atomic_clear_bit(&data->flags, AUDIO_FLAG_SETTLED);
+        k_work_schedule(&data->settle_work, K_NO_WAIT);
+    }
+    if (ret == 0 || ret == -EALREADY) data->input_running = true;
+    return ret;
 }
 
 int audio_stop(void) {
     const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    ret = input_codec_stop_input(config->codec);
+    if (ret == 0 || ret == -EALREADY) {
+        data->input_running = false;
+        atomic_clear_bit(&data->flags, AUDIO_FLAG_SETTLED);
+        k_work_cancel_delayable(&data->settle_work);
+    }
+    return ret;
+}
+
+int audio_get_stats(struct audio_stats *stats) {
+    struct audio_data *data = &audio_data;
+
+    *stats = (struct audio_stats){
+        .i2s_overruns = atomic_get(&data->i2s_overruns),
+        .timestamp_errors = atomic_get(&data->timestamp_errors),
+        .sync_outliers = atomic_get(&data->sync_outliers),
+        .sync_resets = atomic_get(&data->sync_resets),
+    };
+    return 0;
+}
+
+int audio_get_format(struct audio_format *format) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    *format = data->params.format;
+    return 0;
+}
+
+/// Ask the audio thread to switch to new parameters and wait for it to finish.
+/// Must be called with the mutex held.
+static int audio_reconfigure_wait(const struct audio_params *params) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
+
+    if (data->input_running) return -EBUSY;
+
+    data->pending_params = *params;
+    k_sem_reset(config->reconfigured);
+    atomic_set_bit(&data->flags, AUDIO_FLAG_RECONFIGURE);
+
+    // The audio thread checks the flag between blocks, so this can take up to
+    // the I2S read timeout, plus the time for consumers to return all blocks.
+    ret = k_sem_take(config->reconfigured,
+                     K_MSEC(2000 + AUDIO_RECONFIGURE_DRAIN_TIMEOUT_MS));
+    if (ret) {
+        LOG_ERR("audio thread did not reconfigure");
+        return ret;
+    }
+
+    return data->reconfigure_result;
+}
+
+int audio_set_bits_per_sample(uint8_t bits_per_sample) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    struct audio_params params = data->params;
+    params.format.bits_per_sample = bits_per_sample;
+    ret = audio_params_block_config(&params, &(struct audio_block_config){},
+                                    NULL);
+    if (ret) return ret;
+
+    if (bits_per_sample != data->params.format.bits_per_sample) {
+        ret = audio_reconfigure_wait(&params);
+        if (ret) return ret;
+    }
+
+    return settings_save_one("audio/bits", &bits_per_sample,
+                             sizeof(bits_per_sample));
+}
+
+int audio_set_sample_rate(uint32_t sample_rate) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
 
     K_MUTEX_AUTO_LOCK(config->mutex);
-    return input_codec_stop_input(config->codec);
+    if (!data->init) return -EINVAL;
+
+    struct audio_params params = data->params;
+    params.format.sample_rate = sample_rate;
+    ret = audio_params_block_config(&params, &(struct audio_block_config){},
+                                    NULL);
+    if (ret) return ret;
+
+    if (sample_rate != data->params.format.sample_rate) {
+        ret = audio_reconfigure_wait(&params);
+        if (ret) return ret;
+    }
+
+    return settings_save_one("audio/rate", &sample_rate, sizeof(sample_rate));
+}
+
+int audio_get_block_config(struct audio_block_config *block_config) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    *block_config = data->block_config;
+    return 0;
+}
+
+int audio_set_block_duration(uint16_t block_ms) {
+    const struct audio_config *config = &audio_config;
+    struct audio_data *data = &audio_data;
+    int ret;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    struct audio_params params = data->params;
+    params.block_ms = block_ms;
+    ret = audio_params_block_config(&params, &(struct audio_block_config){},
+                                    NULL);
+    if (ret) return ret;
+
+    if (block_ms != data->params.block_ms) {
+        ret = audio_reconfigure_wait(&params);
+        if (ret) return ret;
+    }
+
+    return settings_save_one("audio/block_ms", &block_ms, sizeof(block_ms));
 }
 
 int audio_channel_from_string(const char *str, audio_channel_t *channel) {
@@ -2,32 +2,133 @@
 #pragma once
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <zephyr/audio/codec.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/slist.h>
+#include <zephyr/sys/util.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/// Maximum number of blocks in the I2S memory pool. The actual number depends
+/// on the block size.
+#define AUDIO_BLOCK_COUNT_MAX CONFIG_AUDIO_BLOCK_COUNT_MAX
+
+/// Format of the recorded audio data
+struct audio_format {
+    uint32_t sample_rate;
+    uint8_t channels;
+    /// Bits per sample after packing. Samples are always captured as 16-bit or
+    /// 32-bit words; 24-bit samples are packed from 32-bit words.
+    uint8_t bits_per_sample;
+};
+
+/// Geometry of the I2S memory pool
+struct audio_block_config {
+    /// Nominal block duration (ms)
+    uint16_t duration_ms;
+    /// Block size in bytes, as captured by I2S (before 24-bit packing)
+    uint32_t size;
+    uint32_t count;
+};
+
 struct audio_block {
     uint8_t *buf;
     size_t len;
     uint32_t start_time;
     uint32_t duration;
+    struct audio_format format;
     uint8_t bytes_per_frame;
+    /// The ADC was powered off or had not settled when this block was
+    /// captured, so it does not contain valid samples.
+    bool settling;
+};
+
+/// Receives every block captured by the audio thread. Blocks are shared between
+/// consumers without copying, and each consumer holds its own reference.
+struct audio_consumer {
+    /// Called from the audio thread with a new reference to the block, which
+    /// must be released with audio_block_free() exactly once, either before or
+    /// after returning. Must never block.
+    int (*submit)(const struct audio_block *block);
+    /// Skip this consumer while the I2S memory pool is running low, so that it
+    /// can never starve I2S or the recorder. Use for live streaming or
+    /// metering, where losing blocks is acceptable.
+    bool droppable;
+    /// Number of blocks skipped because the pool was running low
+    atomic_t dropped;
+    sys_snode_t node;
+};
+
+struct audio_stats {
+    /// Number of times I2S was restarted because no buffer was available
+    uint32_t i2s_overruns;
+    /// Number of times I2S was restarted because the block timestamps did not
+    /// match the buffers
+    uint32_t timestamp_errors;
+    /// Number of central time measurements ignored as outliers
+    uint32_t sync_outliers;
+    /// Number of times synchronization was restarted after consecutive
+    /// outliers, which can shift the block timestamps
+    uint32_t sync_resets;
 };
 
 int audio_init(void);
 
+/// Register a consumer to receive blocks from the audio thread. Consumers can't
+/// be removed, and the struct must stay valid forever.
+int audio_add_consumer(struct audio_consumer *consumer);
+
+/// Take an additional reference to a block, which must also be released with
+/// audio_block_free().
+void audio_block_ref(const struct audio_block *block);
+
+/// Release a reference to a block received from the audio thread. The block is
+/// returned to the I2S memory pool once every reference has been released.
+void audio_block_free(const struct audio_block *block);
+
 /// Power on the ADC. The I2S peripheral is always running to allow
-/// synchronization. Return -EALREADY if ADC is already running.
+/// synchronization. Return -EALREADY if ADC is already running. Blocks are
+/// marked as settling until the codec reports that its output is valid.
 int audio_start(void);
 
 /// Shutdown the ADC to save power. The I2S peripheral is remaings running to
 /// allow synchronization. Return -EALREADY if ADC is already powered off.
 int audio_stop(void);
 
+/// Get statistics about I2S errors. Samples are lost each time I2S is
+/// restarted, which the recording module fills with silence.
+int audio_get_stats(struct audio_stats *stats);
+
+/// Get the current recording format.
+int audio_get_format(struct audio_format *format);
+
+/// Set and save the number of bits per sample (16 or 24). This restarts I2S, so
+/// it cannot be changed while the ADC is running. Return -EBUSY if the ADC is
+/// running.
+int audio_set_bits_per_sample(uint8_t bits_per_sample);
+
+/// Set and save the sample rate. Any rate that can be derived from a 12.288 MHz
+/// or 11.2896 MHz MCLK is supported (e.g. 32, 44.1, 48, 88.2 or 96 kHz). Like
+/// audio_set_bits_per_sample(), this restarts I2S and returns -EBUSY if the ADC
+/// is running.
+int audio_set_sample_rate(uint32_t sample_rate);
+
+/// Get the current block size and count.
+int audio_get_block_config(struct audio_block_config *block_config);
+
+/// Set and save the block duration in ms. Short blocks (1-2 ms) give low
+/// latency for live streaming, while long blocks (up to 1000 ms) reduce the
+/// per-block overhead when recording. The number of blocks is limited by
+/// CONFIG_AUDIO_BLOCK_POOL_SIZE, and -ENOMEM is returned if too few blocks
+/// would fit. Like audio_set_bits_per_sample(), this restarts I2S and returns
+/// -EBUSY if the ADC is running.
+int audio_set_block_duration(uint16_t block_ms);
+
 /// Convert the name of a channel into its channel enum value. Return 0 if
 /// successful, or -1 if the name does not match any supported channel.
 int audio_channel_from_string(const char *str, audio_channel_t *channel);
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "block_ring.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+/// Header value marking that the rest of the buffer was skipped
+#define BLOCK_RING_WRAP UINT32_MAX
+
+#define BLOCK_RING_HDR_SIZE sizeof(uint32_t)
+
+size_t block_ring_record_size(size_t len) {
+    return BLOCK_RING_HDR_SIZE + ROUND_UP(len, 4);
+}
+
+void block_ring_init(struct block_ring *r, uint8_t *buf, size_t size) {
+    __ASSERT(IS_ALIGNED(buf, 4), "Buffer not aligned");
+
+    *r = (struct block_ring){
+        .buf = buf,
+        // Keep everything aligned to the header size, so there is always room
+        // for a wrap marker at the end.
+        .size = ROUND_DOWN(size, 4),
+    };
+}
+
+void *block_ring_reserve(struct block_ring *r, size_t len) {
+    size_t record_size = block_ring_record_size(len);
+    void *ret = NULL;
+
+    K_SPINLOCK(&r->lock) {
+        size_t free = r->size - r->used;
+        size_t pos = r->head;
+        size_t skip = 0;
+
+        if (pos + record_size > r->size) {
+            // Doesn't fit at the end, wrap around to the start
+            skip = r->size - pos;
+            pos = 0;
+        }
+        if (skip + record_size > free) {
+            K_SPINLOCK_BREAK;
+        }
+
+        r->reserve_pos = pos;
+        r->reserve_len = len;
+        ret = r->buf + pos + BLOCK_RING_HDR_SIZE;
+    }
+
+    return ret;
+}
+
+void block_ring_commit(struct block_ring *r) {
+    size_t record_size = block_ring_record_size(r->reserve_len);
+    uint32_t hdr;
+
+    // Only the producer touches the region after head, so the headers can be
+    // written without holding the lock
+    if (r->reserve_pos != r->head) {
+        hdr = BLOCK_RING_WRAP;
+        memcpy(r->buf + r->head, &hdr, sizeof(hdr));
+    }
+    hdr = r->reserve_len;
+    memcpy(r->buf + r->reserve_pos, &hdr, sizeof(hdr));
+
+    K_SPINLOCK(&r->lock) {
+        size_t skip = r->reserve_pos != r->head ? r->size - r->head : 0;
+        r->used += skip + record_size;
+        r->max_used = MAX(r->max_used, r->used);
+        r->head = (r->reserve_pos + record_size) % r->size;
+    }
+}
+
+/// Find the position of the oldest record, skipping any wrap marker. Return the
+/// number of skipped bytes. Must be called with the lock held.
+static size_t block_ring_tail_pos(struct block_ring *r, size_t *pos) {
+    uint32_t hdr;
+    memcpy(&hdr, r->buf + r->tail, sizeof(hdr));
+    if (hdr == BLOCK_RING_WRAP) {
+        *pos = 0;
+        return r->size - r->tail;
+    }
+    *pos = r->tail;
+    return 0;
+}
+
+void *block_ring_peek(struct block_ring *r, size_t *len) {
+    void *ret = NULL;
+
+    K_SPINLOCK(&r->lock) {
+        if (r->used == 0) {
+            K_SPINLOCK_BREAK;
+        }
+
+        size_t pos;
+        block_ring_tail_pos(r, &pos);
+
+        uint32_t hdr;
+        memcpy(&hdr, r->buf + pos, sizeof(hdr));
+        *len = hdr;
+        ret = r->buf + pos + BLOCK_RING_HDR_SIZE;
+    }
+
+    return ret;
+}
+
+void block_ring_release(struct block_ring *r) {
+    K_SPINLOCK(&r->lock) {
+        __ASSERT(r->used > 0, "Release from empty ring");
+
+        size_t pos;
+        size_t skip = block_ring_tail_pos(r, &pos);
+
+        uint32_t hdr;
+        memcpy(&hdr, r->buf + pos, sizeof(hdr));
+        size_t record_size = block_ring_record_size(hdr);
+
+        r->used -= skip + record_size;
+        r->tail = (pos + record_size) % r->size;
+    }
+}
+
+size_t block_ring_used(struct block_ring *r) {
+    size_t used;
+    K_SPINLOCK(&r->lock) { used = r->used; }
+    return used;
+}
+
+size_t block_ring_max_used(struct block_ring *r) {
+    size_t max_used;
+    K_SPINLOCK(&r->lock) { max_used = r->max_used; }
+    return max_used;
+}
+
+void block_ring_reset_max_used(struct block_ring *r) {
+    K_SPINLOCK(&r->lock) { r->max_used = r->used; }
+}
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+/// Single producer, single consumer ring buffer of variable length records.
+/// Every record is stored contiguously, so it can be used in place without
+/// copying it out of the ring. If a record doesn't fit in the space left at the
+/// end of the buffer, the remaining space is skipped and the record is placed
+/// at the start.
+struct block_ring {
+    uint8_t *buf;
+    /// Total buffer size in bytes
+    size_t size;
+
+    struct k_spinlock lock;
+    /// Offset where the next record will be written
+    size_t head;
+    /// Offset of the oldest record
+    size_t tail;
+    /// Number of bytes in use, including headers and skipped space
+    size_t used;
+    /// Maximum value of used since initialization
+    size_t max_used;
+
+    // Reservation that has not been committed yet
+    size_t reserve_pos;
+    size_t reserve_len;
+};
+
+/// Initialize a ring buffer using the specified memory, which must be 4-byte
+/// aligned.
+void block_ring_init(struct block_ring *r, uint8_t *buf, size_t size);
+
+/// Reserve space for a record of len bytes. Return a pointer to the record
+/// data, or NULL if there is not enough space. The record does not become
+/// visible to the consumer until block_ring_commit() is called. Must only be
+/// called by the producer.
+void *block_ring_reserve(struct block_ring *r, size_t len);
+
+/// Make the last reserved record visible to the consumer. Must only be called
+/// by the producer.
+void block_ring_commit(struct block_ring *r);
+
+/// Get the oldest record in the ring, without removing it. Return NULL if the
+/// ring is empty. Must only be called by the consumer.
+void *block_ring_peek(struct block_ring *r, size_t *len);
+
+/// Remove the oldest record from the ring. Must only be called by the consumer,
+/// after a successful call to block_ring_peek().
+void block_ring_release(struct block_ring *r);
+
+/// Get the number of bytes occupied by a record of len bytes, including its
+/// header and padding.
+size_t block_ring_record_size(size_t len);
+
+/// Get the number of bytes currently in use.
+size_t block_ring_used(struct block_ring *r);
+
+/// Get the maximum number of bytes that have been in use at once.
+size_t block_ring_max_used(struct block_ring *r);
+
+/// Reset the maximum number of bytes in use to the current number.
+void block_ring_reset_max_used(struct block_ring *r);
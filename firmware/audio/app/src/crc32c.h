@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Build the lookup tables. Must be called before crc32c_update(), and does
+/// nothing if the tables were already built.
+void crc32c_init(void);
+
+/// Continue a CRC-32C (Castagnoli) over more data, starting from 0 for the
+/// first call. The result after the last call is the standard CRC-32C of all
+/// the data, as computed by e.g. iSCSI, ext4 or the crc32c Python package.
+uint32_t crc32c_update(uint32_t crc, const uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
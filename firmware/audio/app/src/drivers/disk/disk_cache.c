@@ -13,23 +13,167 @@
 #include <zephyr/init.h>
 #include <zephyr/device.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/slist.h>
+#include <zephyr/sys/util.h>
+#include <zeus/drivers/disk.h>
 
 LOG_MODULE_REGISTER(disk_cache, CONFIG_DISK_CACHE_LOG_LEVEL);
 
+/// Number of consecutive reads that start a sequential stream
+#define DISK_CACHE_READ_AHEAD_MIN_READS 2
+/// Time to wait before retrying a prefetch that was deferred for a write
+#define DISK_CACHE_READ_AHEAD_BACKOFF K_MSEC(10)
+/// Upper bound of the first write latency bucket (us). Each following bucket is twice as wide.
+#define DISK_CACHE_WRITE_HIST_MIN_US 64
+#define DISK_CACHE_WRITE_HIST_BUCKETS 16
+
+#ifdef CONFIG_DISK_CACHE_READ_AHEAD
+static K_THREAD_STACK_DEFINE(disk_cache_read_ahead_stack, CONFIG_DISK_CACHE_READ_AHEAD_STACK_SIZE);
+static struct k_work_q disk_cache_read_ahead_queue;
+#endif
+
 struct disk_cache_entry {
+	/// Position in the LRU list
 	sys_dnode_t node;
+	/// Position in the hash bucket
+	sys_snode_t hash_node;
+	/// First sector in the entry, which is aligned to the entry size
 	uint32_t sector;
+	/// Bitmap of sectors that have been written to the cache but not to the underlying disk
+	uint32_t dirty;
 	uint8_t data[];
 };
 
+struct disk_cache_stats {
+	/// Number of entries found in the cache
+	uint32_t hits;
+	/// Number of entries that had to be read from the underlying disk
+	uint32_t misses;
+	/// Number of entries replaced to make room for others
+	uint32_t evictions;
+	/// Number of sectors written to the cache without writing to the underlying disk
+	uint32_t dirty_writes;
+	/// Number of writes of dirty sectors to the underlying disk
+	uint32_t write_backs;
+	/// Number of sectors read from a read-ahead window
+	uint32_t read_ahead_hits;
+	/// Number of read-ahead windows filled from the underlying disk
+	uint32_t read_ahead_fills;
+	/// Bytes read by the current or last sequential stream
+	uint64_t stream_bytes;
+	/// Duration of the current or last sequential stream (ms)
+	uint32_t stream_ms;
+	/// Latency histogram of writes to the underlying disk, with power of two buckets
+	uint32_t write_hist[DISK_CACHE_WRITE_HIST_BUCKETS];
+	uint32_t writes;
+	uint64_t write_bytes;
+	/// Total time spent writing to the underlying disk (us)
+	uint64_t write_us;
+	/// Worst case write latency (us), and the uptime when it occurred (ms)
+	uint32_t write_max_us;
+	int64_t write_max_uptime_ms;
+};
+
+struct disk_cache_read_ahead_window {
+	uint32_t sector;
+	/// The window contains valid data
+	bool ready;
+	/// The window has been requested, but not filled yet
+	bool pending;
+};
+
+struct disk_cache_read_ahead {
+	/// Two windows, so that one can be filled while the other is being read
+	struct disk_cache_read_ahead_window windows[2];
+	struct k_work_delayable work;
+	/// Number of writers waiting for the mutex, which prefetching yields to
+	atomic_t writers;
+	/// Sector following the last read that wasn't served entirely by cache entries
+	uint32_t next_sector;
+	uint32_t sequential_reads;
+	int64_t stream_start;
+};
+
 struct disk_cache_config {
 	const char *const disk_name;
 	const size_t sector_size;
+	/// Number of consecutive sectors in each entry
+	const uint32_t entry_sectors;
+	const uint32_t entry_count;
 	struct k_mem_slab *const entries;
 	sys_dlist_t *const lru_list;
+	/// Hash index of entries by sector, with one bucket per entry
+	sys_slist_t *const buckets;
+	/// Keep writes to cached sectors in the cache until the deadline, a sync or an eviction
+	const bool write_back;
+	/// Maximum time that a sector stays dirty before it is written back
+	const k_timeout_t write_back_delay;
+	/// Buffer for coalescing dirty sectors from separate entries into one write
+	uint8_t *const write_back_buf;
+	const uint32_t write_back_buf_sectors;
+	/// Number of sectors in each read-ahead window, or 0 if read-ahead is disabled
+	const uint32_t read_ahead_sectors;
+	uint8_t *const read_ahead_buf;
+};
+
+struct disk_cache_data {
+	struct disk_info info;
+	const struct device *dev;
+	struct k_mutex mutex;
+	struct k_work_delayable write_back_work;
+	struct disk_cache_read_ahead read_ahead;
+	struct disk_cache_stats stats;
 };
 
 #define NODE_TO_ENTRY(node) CONTAINER_OF(node, struct disk_cache_entry, node)
+#define HASH_NODE_TO_ENTRY(node) CONTAINER_OF(node, struct disk_cache_entry, hash_node)
+
+static inline size_t disk_cache_entry_size(const struct disk_cache_config *config)
+{
+	return config->entry_sectors * config->sector_size;
+}
+
+/// First sector of the entry containing the specified sector.
+static inline uint32_t disk_cache_entry_start(const struct disk_cache_config *config,
+					      uint32_t sector)
+{
+	return sector - sector % config->entry_sectors;
+}
+
+static sys_slist_t *disk_cache_bucket(const struct disk_cache_config *config, uint32_t sector)
+{
+	// Consecutive entries go in different buckets
+	return &config->buckets[(sector / config->entry_sectors) % config->entry_count];
+}
+
+/// Write to the underlying disk, recording the latency.
+static int disk_cache_disk_write(const struct device *dev, const uint8_t *buf,
+				 uint32_t start_sector, uint32_t num_sector)
+{
+	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_stats *stats = &((struct disk_cache_data *)dev->data)->stats;
+	int ret;
+
+	uint32_t start = k_cycle_get_32();
+	ret = disk_access_write(config->disk_name, buf, start_sector, num_sector);
+	uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+	size_t bucket = 0;
+	while (bucket < DISK_CACHE_WRITE_HIST_BUCKETS - 1 &&
+	       us >= (DISK_CACHE_WRITE_HIST_MIN_US << bucket)) {
+		bucket++;
+	}
+	stats->write_hist[bucket]++;
+	stats->writes++;
+	stats->write_bytes += num_sector * config->sector_size;
+	stats->write_us += us;
+	if (us >= stats->write_max_us) {
+		stats->write_max_us = us;
+		stats->write_max_uptime_ms = k_uptime_get();
+	}
+	return ret;
+}
 
 /// Check that the cache config is compatible with the underlying disk.
 static int disk_cache_check_config(const struct device *dev)
@@ -51,27 +195,82 @@ static int disk_cache_check_config(const struct device *dev)
 	return 0;
 }
 
-/// Flush all entries from the cache.
-static void disk_cache_flush(const struct device *dev)
+static inline bool disk_cache_read_ahead_enabled(const struct disk_cache_config *config)
+{
+	return IS_ENABLED(CONFIG_DISK_CACHE_READ_AHEAD) && config->read_ahead_sectors > 0;
+}
+
+static uint8_t *disk_cache_read_ahead_window_buf(const struct disk_cache_config *config,
+						 size_t index)
+{
+	return config->read_ahead_buf + index * config->read_ahead_sectors * config->sector_size;
+}
+
+/// Find the read-ahead window that contains or will contain the specified sector.
+static int disk_cache_read_ahead_find(const struct device *dev, uint32_t sector)
 {
 	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+
+	for (size_t i = 0; i < ARRAY_SIZE(data->read_ahead.windows); ++i) {
+		const struct disk_cache_read_ahead_window *window = &data->read_ahead.windows[i];
+		if ((window->ready || window->pending) && sector >= window->sector &&
+		    sector - window->sector < config->read_ahead_sectors) {
+			return i;
+		}
+	}
+	return -ENOENT;
+}
+
+/// Discard read-ahead windows that overlap the specified sectors.
+static void disk_cache_read_ahead_invalidate(const struct device *dev, uint32_t start_sector,
+					     uint32_t num_sector)
+{
+	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+
+	for (size_t i = 0; i < ARRAY_SIZE(data->read_ahead.windows); ++i) {
+		struct disk_cache_read_ahead_window *window = &data->read_ahead.windows[i];
+		if (window->sector < start_sector + num_sector &&
+		    start_sector < window->sector + config->read_ahead_sectors) {
+			window->ready = false;
+			window->pending = false;
+		}
+	}
+}
+
+/// Remove all entries from the cache, discarding any dirty sectors.
+static void disk_cache_invalidate(const struct device *dev)
+{
+	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+
+	memset(data->read_ahead.windows, 0, sizeof(data->read_ahead.windows));
+	data->read_ahead.next_sector = 0;
+	data->read_ahead.sequential_reads = 0;
 
 	sys_dnode_t *node;
 	while ((node = sys_dlist_get(config->lru_list))) {
 		struct disk_cache_entry *entry = NODE_TO_ENTRY(node);
 		entry->sector = 0;
+		entry->dirty = 0;
 		k_mem_slab_free(config->entries, entry);
 	}
+
+	for (uint32_t i = 0; i < config->entry_count; ++i) {
+		sys_slist_init(&config->buckets[i]);
+	}
 }
 
-/// Lookup the cache entry for the specified sector. Return NULL if the sector is not cached.
+/// Lookup the cache entry for the entry starting at the specified sector. Return NULL if the
+/// entry is not cached.
 static struct disk_cache_entry *disk_cache_lookup(const struct device *dev, uint32_t sector)
 {
 	const struct disk_cache_config *config = dev->config;
 
-	sys_dnode_t *node;
-	SYS_DLIST_FOR_EACH_NODE(config->lru_list, node) {
-		struct disk_cache_entry *entry = NODE_TO_ENTRY(node);
+	sys_snode_t *node;
+	SYS_SLIST_FOR_EACH_NODE(disk_cache_bucket(config, sector), node) {
+		struct disk_cache_entry *entry = HASH_NODE_TO_ENTRY(node);
 		if (entry->sector == sector) {
 			return entry;
 		}
@@ -80,35 +279,205 @@ static struct disk_cache_entry *disk_cache_lookup(const struct device *dev, uint
 	return NULL;
 }
 
-/// Add a sector to the cache. The sector must not be already present in the cache.
-static void disk_cache_add(const struct device *dev, uint32_t sector, uint8_t *data)
+/// Check whether a sector is dirty, and return its entry if it is.
+static struct disk_cache_entry *disk_cache_lookup_dirty(const struct device *dev, uint32_t sector)
+{
+	const struct disk_cache_config *config = dev->config;
+
+	uint32_t entry_sector = disk_cache_entry_start(config, sector);
+	struct disk_cache_entry *entry = disk_cache_lookup(dev, entry_sector);
+	if (entry && (entry->dirty & BIT(sector - entry_sector))) {
+		return entry;
+	}
+	return NULL;
+}
+
+/// Get the bits of an entry's sector bitmap that fall within [start_sector, end_sector).
+static uint32_t disk_cache_entry_mask(const struct disk_cache_config *config,
+				      const struct disk_cache_entry *entry, uint32_t start_sector,
+				      uint32_t end_sector)
+{
+	uint32_t first = MAX(entry->sector, start_sector);
+	uint32_t last = MIN(entry->sector + config->entry_sectors, end_sector);
+	if (first >= last) {
+		return 0;
+	}
+	return GENMASK(last - entry->sector - 1, first - entry->sector);
+}
+
+/// Write the dirty sectors in [start_sector, end_sector) to the underlying disk, in ascending
+/// order. Runs of consecutive dirty sectors are coalesced into a single write, even if they are in
+/// different entries.
+static int disk_cache_write_back_range(const struct device *dev, uint32_t start_sector,
+				       uint32_t end_sector)
 {
 	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
 	int ret;
 
-	__ASSERT(NULL == disk_cache_lookup(dev, sector), "Sector is already cached");
+	if (!config->write_back) {
+		return 0;
+	}
 
-	void *entry_ptr;
-	ret = k_mem_slab_alloc(config->entries, &entry_ptr, K_NO_WAIT);
+	for (;;) {
+		// Find the first dirty sector in the range
+		bool found = false;
+		uint32_t run_sector = UINT32_MAX;
+		struct disk_cache_entry *entry;
+		SYS_DLIST_FOR_EACH_CONTAINER(config->lru_list, entry, node) {
+			uint32_t dirty =
+				entry->dirty &
+				disk_cache_entry_mask(config, entry, start_sector, end_sector);
+			if (dirty) {
+				uint32_t sector = entry->sector + find_lsb_set(dirty) - 1;
+				run_sector = MIN(run_sector, sector);
+				found = true;
+			}
+		}
+		if (!found) {
+			break;
+		}
+
+		// Gather the run of dirty sectors following it
+		uint32_t num_sector = 0;
+		while (num_sector < config->write_back_buf_sectors &&
+		       run_sector + num_sector < end_sector) {
+			uint32_t sector = run_sector + num_sector;
+			entry = disk_cache_lookup_dirty(dev, sector);
+			if (!entry) {
+				break;
+			}
+			memcpy(config->write_back_buf + num_sector * config->sector_size,
+			       entry->data + (sector - entry->sector) * config->sector_size,
+			       config->sector_size);
+			num_sector++;
+		}
+
+		LOG_DBG("write back: sector %u, count %u", run_sector, num_sector);
+		ret = disk_cache_disk_write(dev, config->write_back_buf, run_sector, num_sector);
+		if (ret < 0) {
+			LOG_ERR("Failed to write back sectors %u-%u (err %d)", run_sector,
+				run_sector + num_sector - 1, ret);
+			return ret;
+		}
+		data->stats.write_backs++;
+		// Windows may have been filled before these sectors were written
+		disk_cache_read_ahead_invalidate(dev, run_sector, num_sector);
+
+		for (uint32_t sector = run_sector; sector < run_sector + num_sector; ++sector) {
+			entry = disk_cache_lookup(dev, disk_cache_entry_start(config, sector));
+			entry->dirty &= ~BIT(sector - entry->sector);
+		}
+	}
+
+	return 0;
+}
+
+/// Write all dirty sectors to the underlying disk.
+static int disk_cache_write_back(const struct device *dev)
+{
+	return disk_cache_write_back_range(dev, 0, UINT32_MAX);
+}
+
+/// Remove the entries overlapping the specified sectors, writing back their dirty sectors first.
+/// Dirty sectors elsewhere are left for the next write-back.
+static int disk_cache_discard(const struct device *dev, uint32_t start_sector,
+			      uint32_t num_sector)
+{
+	const struct disk_cache_config *config = dev->config;
+	int ret;
+
+	// Whole entries are removed, so include the sectors they share with the range
+	uint32_t first = disk_cache_entry_start(config, start_sector);
+	uint32_t end = disk_cache_entry_start(config, start_sector + num_sector - 1) +
+		       config->entry_sectors;
+	ret = disk_cache_write_back_range(dev, first, end);
 	if (ret < 0) {
-		entry_ptr = NULL;
+		return ret;
 	}
-	struct disk_cache_entry *entry;
-	if (entry_ptr) {
+	disk_cache_read_ahead_invalidate(dev, start_sector, num_sector);
+
+	struct disk_cache_entry *entry, *next;
+	SYS_DLIST_FOR_EACH_CONTAINER_SAFE(config->lru_list, entry, next, node) {
+		if (entry->sector < start_sector + num_sector &&
+		    start_sector < entry->sector + config->entry_sectors) {
+			LOG_DBG("discard: sector %u", entry->sector);
+			sys_dlist_remove(&entry->node);
+			sys_slist_find_and_remove(disk_cache_bucket(config, entry->sector),
+						  &entry->hash_node);
+			k_mem_slab_free(config->entries, entry);
+		}
+	}
+	return 0;
+}
+
+/// Get an unused entry, replacing the oldest entry if the cache is full. The entry is not in
+/// the LRU list or the index.
+static int disk_cache_alloc(const struct device *dev, struct disk_cache_entry **entry)
+{
+	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+	int ret;
+
+	void *entry_ptr;
+	ret = k_mem_slab_alloc(config->entries, &entry_ptr, K_NO_WAIT);
+	if (ret == 0) {
 		// Allocated new entry
-		entry = entry_ptr;
-		LOG_DBG("allocate: sector %u", sector);
-	} else {
-		// Cache full, replace oldest entry
-		sys_dnode_t *node = sys_dlist_get(config->lru_list);
-		__ASSERT(node, "No free entries and no allocated entries");
-		entry = NODE_TO_ENTRY(node);
-		LOG_DBG("replace: sector %u->%u", entry->sector, sector);
+		*entry = entry_ptr;
+		(*entry)->dirty = 0;
+		return 0;
+	}
+
+	// Cache full, replace oldest entry
+	sys_dnode_t *node = sys_dlist_peek_head(config->lru_list);
+	__ASSERT(node, "No free entries and no allocated entries");
+	*entry = NODE_TO_ENTRY(node);
+	if ((*entry)->dirty) {
+		// Write back everything rather than just this entry, so that its sectors can be
+		// coalesced with their neighbours
+		ret = disk_cache_write_back(dev);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 
+	sys_dlist_remove(node);
+	sys_slist_find_and_remove(disk_cache_bucket(config, (*entry)->sector),
+				  &(*entry)->hash_node);
+	data->stats.evictions++;
+	LOG_DBG("evict: sector %u", (*entry)->sector);
+	return 0;
+}
+
+/// Insert an entry into the LRU list and the index.
+static void disk_cache_insert(const struct device *dev, struct disk_cache_entry *entry,
+			      uint32_t sector)
+{
+	const struct disk_cache_config *config = dev->config;
+
+	__ASSERT(NULL == disk_cache_lookup(dev, sector), "Sector is already cached");
+
 	entry->sector = sector;
-	memcpy(entry->data, data, config->sector_size);
 	sys_dlist_append(config->lru_list, &entry->node);
+	sys_slist_prepend(disk_cache_bucket(config, sector), &entry->hash_node);
+}
+
+/// Add an entry to the cache. The entry must not be already present in the cache.
+static int disk_cache_add(const struct device *dev, uint32_t sector, uint8_t *data)
+{
+	const struct disk_cache_config *config = dev->config;
+	int ret;
+
+	struct disk_cache_entry *entry;
+	ret = disk_cache_alloc(dev, &entry);
+	if (ret < 0) {
+		return ret;
+	}
+
+	LOG_DBG("add: sector %u", sector);
+	memcpy(entry->data, data, disk_cache_entry_size(config));
+	disk_cache_insert(dev, entry, sector);
+	return 0;
 }
 
 /// Bump a cache entry to the most recent position in the LRU list.
@@ -121,23 +490,54 @@ static void disk_cache_bump(const struct device *dev, struct disk_cache_entry *e
 	LOG_DBG("bump: sector %u", entry->sector);
 }
 
+/// Read whole entries directly into the caller's buffer, and then add them to the cache.
 static int disk_cache_populate(const struct device *dev, uint8_t *buf, uint32_t start_sector,
 			       uint32_t num_sector)
 {
 	const struct disk_cache_config *config = dev->config;
 	int ret;
 
+	if (num_sector == 0) {
+		return 0;
+	}
+
 	ret = disk_access_read(config->disk_name, buf, start_sector, num_sector);
 	if (ret < 0) {
 		return ret;
 	}
 
-	for (uint32_t i = 0; i < num_sector; ++i) {
-		disk_cache_add(dev, start_sector + i, buf + i * config->sector_size);
+	for (uint32_t i = 0; i < num_sector; i += config->entry_sectors) {
+		ret = disk_cache_add(dev, start_sector + i, buf + i * config->sector_size);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 	return 0;
 }
 
+/// Read a whole entry into the cache, for reads that only cover part of it.
+static struct disk_cache_entry *disk_cache_load(const struct device *dev, uint32_t sector,
+						int *err)
+{
+	const struct disk_cache_config *config = dev->config;
+
+	struct disk_cache_entry *entry;
+	*err = disk_cache_alloc(dev, &entry);
+	if (*err < 0) {
+		return NULL;
+	}
+
+	*err = disk_access_read(config->disk_name, entry->data, sector, config->entry_sectors);
+	if (*err < 0) {
+		k_mem_slab_free(config->entries, entry);
+		return NULL;
+	}
+
+	LOG_DBG("load: sector %u", sector);
+	disk_cache_insert(dev, entry, sector);
+	return entry;
+}
+
 static int disk_cache_access_status(struct disk_info *disk)
 {
 	const struct device *dev = disk->dev;
@@ -146,79 +546,412 @@ static int disk_cache_access_status(struct disk_info *disk)
 	return disk_access_status(config->disk_name);
 }
 
-static int disk_cache_access_read(struct disk_info *disk, uint8_t *buff, uint32_t start_sector,
-				  uint32_t num_sector)
+/// Read a pending window from the underlying disk.
+static int disk_cache_read_ahead_fill(const struct device *dev, size_t index)
 {
-	const struct device *dev = disk->dev;
 	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+	struct disk_cache_read_ahead_window *window = &data->read_ahead.windows[index];
 	int ret;
 
+	LOG_DBG("read ahead: sector %u, count %u", window->sector, config->read_ahead_sectors);
+	window->pending = false;
+	ret = disk_access_read(config->disk_name, disk_cache_read_ahead_window_buf(config, index),
+			       window->sector, config->read_ahead_sectors);
+	if (ret < 0) {
+		// Probably past the end of the disk; the reader will get the real error
+		return ret;
+	}
+
+	window->ready = true;
+	data->stats.read_ahead_fills++;
+	return 0;
+}
+
+/// Request that a window be filled in the background.
+static void disk_cache_read_ahead_request(const struct device *dev, size_t index,
+					  uint32_t sector)
+{
+	struct disk_cache_data *data = dev->data;
+	struct disk_cache_read_ahead_window *window = &data->read_ahead.windows[index];
+
+	window->sector = sector;
+	window->ready = false;
+	window->pending = true;
+#ifdef CONFIG_DISK_CACHE_READ_AHEAD
+	k_work_schedule_for_queue(&disk_cache_read_ahead_queue, &data->read_ahead.work,
+				  K_NO_WAIT);
+#endif
+}
+
+/// Copy sectors from the read-ahead windows, filling a pending window immediately if the reader
+/// has caught up with it. Return false if any of the sectors aren't in a window.
+static bool disk_cache_read_ahead_copy(const struct device *dev, uint8_t *buf,
+				       uint32_t start_sector, uint32_t num_sector)
+{
+	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+
+	if (!disk_cache_read_ahead_enabled(config)) {
+		return false;
+	}
+
+	uint32_t last_sector = start_sector + num_sector;
+	uint32_t sector = start_sector;
+	while (sector < last_sector) {
+		int index = disk_cache_read_ahead_find(dev, sector);
+		if (index < 0) {
+			return false;
+		}
+
+		const struct disk_cache_read_ahead_window *window =
+			&data->read_ahead.windows[index];
+		if (window->pending && disk_cache_read_ahead_fill(dev, index) < 0) {
+			return false;
+		}
+
+		uint32_t end = MIN(window->sector + config->read_ahead_sectors, last_sector);
+		memcpy(buf + (sector - start_sector) * config->sector_size,
+		       disk_cache_read_ahead_window_buf(config, index) +
+			       (sector - window->sector) * config->sector_size,
+		       (end - sector) * config->sector_size);
+		sector = end;
+	}
+
+	data->stats.read_ahead_hits += num_sector;
+	return true;
+}
+
+/// Track sequential reads, and keep the windows ahead of the reader once a stream is detected.
+/// Reads served entirely by cache entries (e.g. FAT sectors) don't interrupt a stream.
+static void disk_cache_read_ahead_update(const struct device *dev, uint32_t start_sector,
+					 uint32_t num_sector, bool cached)
+{
+	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+	struct disk_cache_read_ahead *read_ahead = &data->read_ahead;
+
+	if (!disk_cache_read_ahead_enabled(config)) {
+		return;
+	}
+
+	if (start_sector != read_ahead->next_sector) {
+		if (cached) {
+			return;
+		}
+		read_ahead->sequential_reads = 0;
+	}
+
+	read_ahead->next_sector = start_sector + num_sector;
+	read_ahead->sequential_reads++;
+	if (read_ahead->sequential_reads < DISK_CACHE_READ_AHEAD_MIN_READS) {
+		return;
+	}
+
+	int64_t now = k_uptime_get();
+	if (read_ahead->sequential_reads == DISK_CACHE_READ_AHEAD_MIN_READS) {
+		LOG_DBG("sequential stream: sector %u", start_sector);
+		read_ahead->stream_start = now;
+		data->stats.stream_bytes = 0;
+	}
+	data->stats.stream_bytes += num_sector * config->sector_size;
+	data->stats.stream_ms = now - read_ahead->stream_start;
+
+	int index = disk_cache_read_ahead_find(dev, read_ahead->next_sector);
+	if (index < 0) {
+		// Reader is past both windows, start again from where it is
+		disk_cache_read_ahead_request(dev, 0, read_ahead->next_sector);
+		disk_cache_read_ahead_request(dev, 1,
+					      read_ahead->next_sector + config->read_ahead_sectors);
+		return;
+	}
+
+	// Reuse the other window for the sectors following this one
+	uint32_t next_window_sector =
+		read_ahead->windows[index].sector + config->read_ahead_sectors;
+	if (disk_cache_read_ahead_find(dev, next_window_sector) < 0) {
+		disk_cache_read_ahead_request(dev, !index, next_window_sector);
+	}
+}
+
+static void disk_cache_read_ahead_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct disk_cache_read_ahead *read_ahead =
+		CONTAINER_OF(dwork, struct disk_cache_read_ahead, work);
+	struct disk_cache_data *data = CONTAINER_OF(read_ahead, struct disk_cache_data, read_ahead);
+	const struct device *dev = data->dev;
+
+	// Writes (i.e. recording) take priority over prefetching
+	if (atomic_get(&read_ahead->writers) > 0) {
+#ifdef CONFIG_DISK_CACHE_READ_AHEAD
+		k_work_schedule_for_queue(&disk_cache_read_ahead_queue, dwork,
+					  DISK_CACHE_READ_AHEAD_BACKOFF);
+#endif
+		return;
+	}
+
+	k_mutex_lock(&data->mutex, K_FOREVER);
+	// Fill the window the reader will reach first. The other window is filled by another
+	// submission, so that waiting writers can get the mutex in between.
+	int index = -1;
+	for (size_t i = 0; i < ARRAY_SIZE(read_ahead->windows); ++i) {
+		if (read_ahead->windows[i].pending &&
+		    (index < 0 || read_ahead->windows[i].sector < read_ahead->windows[index].sector)) {
+			index = i;
+		}
+	}
+	if (index >= 0) {
+		disk_cache_read_ahead_fill(dev, index);
+#ifdef CONFIG_DISK_CACHE_READ_AHEAD
+		k_work_schedule_for_queue(&disk_cache_read_ahead_queue, dwork, K_NO_WAIT);
+#endif
+	}
+	k_mutex_unlock(&data->mutex);
+}
+
+static int disk_cache_read(const struct device *dev, uint8_t *buff, uint32_t start_sector,
+			   uint32_t num_sector)
+{
+	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
+	int ret;
+
+	uint32_t last_sector = start_sector + num_sector;
+	// Whole entries that missed, which are read together straight into the buffer
 	uint32_t cache_miss_start_sector = start_sector;
-	for (uint32_t i = 0; i < num_sector; ++i) {
-		uint32_t sector = start_sector + i;
-		struct disk_cache_entry *entry = disk_cache_lookup(dev, sector);
+	bool cached = true;
+	uint32_t sector = start_sector;
+	while (sector < last_sector) {
+		uint32_t entry_sector = disk_cache_entry_start(config, sector);
+		uint32_t entry_end = entry_sector + config->entry_sectors;
+		uint32_t end = MIN(entry_end, last_sector);
+
+		struct disk_cache_entry *entry = disk_cache_lookup(dev, entry_sector);
 		if (entry) {
-			if (cache_miss_start_sector != sector) {
-				ret = disk_cache_populate(
-					dev,
-					buff + (cache_miss_start_sector - start_sector) *
-							config->sector_size,
-					cache_miss_start_sector, sector - cache_miss_start_sector);
-				if (ret < 0) {
-					return ret;
-				}
+			data->stats.hits++;
+			LOG_DBG("hit: sector %u", entry_sector);
+		} else if (disk_cache_read_ahead_copy(
+				   dev, buff + (sector - start_sector) * config->sector_size, sector,
+				   end - sector)) {
+			// Streamed data doesn't go into the cache, so it doesn't push out metadata
+			cached = false;
+			ret = disk_cache_populate(
+				dev,
+				buff + (cache_miss_start_sector - start_sector) * config->sector_size,
+				cache_miss_start_sector, sector - cache_miss_start_sector);
+			if (ret < 0) {
+				return ret;
+			}
+			sector = end;
+			cache_miss_start_sector = end;
+			continue;
+		} else {
+			cached = false;
+			data->stats.misses++;
+			if (sector == entry_sector && end == entry_end) {
+				// Whole entry, read it with the rest of the missed run
+				sector = end;
+				continue;
 			}
-			cache_miss_start_sector = sector + 1;
+		}
 
-			LOG_DBG("hit: sector %u", sector);
-			memcpy(buff + i * config->sector_size, entry->data, config->sector_size);
+		if (entry) {
+			// Copy before populating, which could replace this entry
+			memcpy(buff + (sector - start_sector) * config->sector_size,
+			       entry->data + (sector - entry_sector) * config->sector_size,
+			       (end - sector) * config->sector_size);
 			disk_cache_bump(dev, entry);
 		}
-	}
 
-	uint32_t last_sector = start_sector + num_sector;
-	if (cache_miss_start_sector != last_sector) {
 		ret = disk_cache_populate(
 			dev, buff + (cache_miss_start_sector - start_sector) * config->sector_size,
-			cache_miss_start_sector, last_sector - cache_miss_start_sector);
+			cache_miss_start_sector, sector - cache_miss_start_sector);
 		if (ret < 0) {
 			return ret;
 		}
+
+		if (!entry) {
+			entry = disk_cache_load(dev, entry_sector, &ret);
+			if (!entry) {
+				return ret;
+			}
+			memcpy(buff + (sector - start_sector) * config->sector_size,
+			       entry->data + (sector - entry_sector) * config->sector_size,
+			       (end - sector) * config->sector_size);
+		}
+		sector = end;
+		cache_miss_start_sector = end;
+	}
+
+	ret = disk_cache_populate(
+		dev, buff + (cache_miss_start_sector - start_sector) * config->sector_size,
+		cache_miss_start_sector, last_sector - cache_miss_start_sector);
+	if (ret < 0) {
+		return ret;
 	}
 
+	disk_cache_read_ahead_update(dev, start_sector, num_sector, cached);
 	return 0;
 }
 
-static int disk_cache_access_write(struct disk_info *disk, const uint8_t *data_buf,
-				   uint32_t start_sector, uint32_t num_sector)
+static int disk_cache_access_read(struct disk_info *disk, uint8_t *buff, uint32_t start_sector,
+				  uint32_t num_sector)
 {
 	const struct device *dev = disk->dev;
+	struct disk_cache_data *data = dev->data;
+	int ret;
+
+	k_mutex_lock(&data->mutex, K_FOREVER);
+	ret = disk_cache_read(dev, buff, start_sector, num_sector);
+	k_mutex_unlock(&data->mutex);
+	return ret;
+}
+
+/// Write a run of sectors that are not in the cache to the underlying disk.
+static int disk_cache_write_through(const struct device *dev, const uint8_t *buf,
+				    uint32_t start_sector, uint32_t num_sector)
+{
+	if (num_sector == 0) {
+		return 0;
+	}
+
+	return disk_cache_disk_write(dev, buf, start_sector, num_sector);
+}
+
+static int disk_cache_write(const struct device *dev, const uint8_t *data_buf,
+			    uint32_t start_sector, uint32_t num_sector)
+{
 	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
 	int ret;
 
 	LOG_DBG("write: sector %u, count %u", start_sector, num_sector);
-	ret = disk_access_write(config->disk_name, data_buf, start_sector, num_sector);
-	if (ret < 0) {
-		return ret;
+	disk_cache_read_ahead_invalidate(dev, start_sector, num_sector);
+	if (!config->write_back) {
+		ret = disk_cache_disk_write(dev, data_buf, start_sector, num_sector);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 
-	for (uint32_t i = 0; i < num_sector; ++i) {
-		struct disk_cache_entry *entry = disk_cache_lookup(dev, start_sector + i);
+	uint32_t last_sector = start_sector + num_sector;
+	// Sectors that aren't cached, which are written together straight from the buffer
+	uint32_t write_through_start_sector = start_sector;
+	uint32_t sector = start_sector;
+	while (sector < last_sector) {
+		uint32_t entry_sector = disk_cache_entry_start(config, sector);
+		uint32_t end = MIN(entry_sector + config->entry_sectors, last_sector);
+
+		struct disk_cache_entry *entry = disk_cache_lookup(dev, entry_sector);
 		if (entry) {
-			memcpy(entry->data, data_buf + i * config->sector_size,
-			       config->sector_size);
+			memcpy(entry->data + (sector - entry_sector) * config->sector_size,
+			       data_buf + (sector - start_sector) * config->sector_size,
+			       (end - sector) * config->sector_size);
 		}
+
+		if (entry && config->write_back) {
+			ret = disk_cache_write_through(
+				dev,
+				data_buf +
+					(write_through_start_sector - start_sector) *
+						config->sector_size,
+				write_through_start_sector, sector - write_through_start_sector);
+			if (ret < 0) {
+				return ret;
+			}
+			write_through_start_sector = end;
+
+			entry->dirty |= GENMASK(end - entry_sector - 1, sector - entry_sector);
+			data->stats.dirty_writes += end - sector;
+			// Does nothing if already scheduled, so the deadline is measured from the
+			// first write after the cache was clean
+			k_work_schedule(&data->write_back_work, config->write_back_delay);
+		}
+		sector = end;
 	}
 
-	return 0;
+	if (!config->write_back) {
+		return 0;
+	}
+	return disk_cache_write_through(
+		dev, data_buf + (write_through_start_sector - start_sector) * config->sector_size,
+		write_through_start_sector, last_sector - write_through_start_sector);
 }
 
-static int disk_cache_access_ioctl(struct disk_info *disk, uint8_t cmd, void *buff)
+static int disk_cache_access_write(struct disk_info *disk, const uint8_t *data_buf,
+				   uint32_t start_sector, uint32_t num_sector)
 {
 	const struct device *dev = disk->dev;
+	struct disk_cache_data *data = dev->data;
+	int ret;
+
+	atomic_inc(&data->read_ahead.writers);
+	k_mutex_lock(&data->mutex, K_FOREVER);
+	ret = disk_cache_write(dev, data_buf, start_sector, num_sector);
+	k_mutex_unlock(&data->mutex);
+	atomic_dec(&data->read_ahead.writers);
+	return ret;
+}
+
+static void disk_cache_write_back_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct disk_cache_data *data = CONTAINER_OF(dwork, struct disk_cache_data, write_back_work);
+	const struct device *dev = data->dev;
+	const struct disk_cache_config *config = dev->config;
+	int ret;
+
+	k_mutex_lock(&data->mutex, K_FOREVER);
+	ret = disk_cache_write_back(dev);
+	if (ret < 0) {
+		// Try again later, rather than leaving the sectors dirty indefinitely
+		k_work_schedule(&data->write_back_work, config->write_back_delay);
+	}
+	k_mutex_unlock(&data->mutex);
+}
+
+static int disk_cache_ioctl(const struct device *dev, uint8_t cmd, void *buff)
+{
 	const struct disk_cache_config *config = dev->config;
+	struct disk_cache_data *data = dev->data;
 	int ret;
 
+	switch (cmd) {
+	case DISK_IOCTL_CTRL_SYNC:
+		// Dirty sectors must reach the disk before it is synced
+		ret = disk_cache_write_back(dev);
+		if (ret < 0) {
+			return ret;
+		}
+		k_work_cancel_delayable(&data->write_back_work);
+		break;
+	case DISK_IOCTL_CTRL_DEINIT:
+		// The card may have already been removed, so dirty sectors are discarded if they
+		// can't be written
+		ret = disk_cache_write_back(dev);
+		if (ret < 0) {
+			LOG_WRN("Discarding dirty sectors (err %d)", ret);
+		}
+		k_work_cancel_delayable(&data->write_back_work);
+		k_work_cancel_delayable(&data->read_ahead.work);
+		disk_cache_invalidate(dev);
+		break;
+	case DISK_IOCTL_STREAM_HINT: {
+		// Stream writes to cached sectors would be held back by write-back, which breaks up
+		// the sequential writes, and prefetching the region is wasted
+		// An empty hint only ends the stream, so there is nothing to discard
+		const struct disk_stream_hint *hint = buff;
+		if (hint->num_sector > 0) {
+			ret = disk_cache_discard(dev, hint->start_sector, hint->num_sector);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		break;
+	}
+	}
+
 	ret = disk_access_ioctl(config->disk_name, cmd, buff);
 	if (ret < 0) {
 		return ret;
@@ -230,29 +963,59 @@ static int disk_cache_access_ioctl(struct disk_info *disk, uint8_t cmd, void *bu
 		if (ret < 0) {
 			return ret;
 		}
-		disk_cache_flush(dev);
-		break;
-	case DISK_IOCTL_CTRL_DEINIT:
-		disk_cache_flush(dev);
+		disk_cache_invalidate(dev);
 		break;
 	}
 
 	return 0;
 }
 
+static int disk_cache_access_ioctl(struct disk_info *disk, uint8_t cmd, void *buff)
+{
+	const struct device *dev = disk->dev;
+	struct disk_cache_data *data = dev->data;
+	int ret;
+
+	k_mutex_lock(&data->mutex, K_FOREVER);
+	ret = disk_cache_ioctl(dev, cmd, buff);
+	k_mutex_unlock(&data->mutex);
+	return ret;
+}
+
 static int disk_cache_access_init(struct disk_info *disk)
 {
 	const struct disk_cache_config *config = disk->dev->config;
 	return disk_access_init(config->disk_name);
 }
 
+#ifdef CONFIG_DISK_CACHE_READ_AHEAD
+static int disk_cache_read_ahead_queue_init(void)
+{
+	const struct k_work_queue_config queue_config = {
+		.name = "disk_cache_read_ahead",
+	};
+
+	// Lowest priority, so that prefetching never delays other threads
+	k_work_queue_start(&disk_cache_read_ahead_queue, disk_cache_read_ahead_stack,
+			   K_THREAD_STACK_SIZEOF(disk_cache_read_ahead_stack),
+			   K_LOWEST_APPLICATION_THREAD_PRIO, &queue_config);
+	return 0;
+}
+
+SYS_INIT(disk_cache_read_ahead_queue_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+#endif
+
 static int disk_cache_init(const struct device *dev)
 {
-	struct disk_info *info = dev->data;
+	struct disk_cache_data *data = dev->data;
 
-	info->dev = dev;
+	data->info.dev = dev;
+	data->dev = dev;
+	k_mutex_init(&data->mutex);
+	k_work_init_delayable(&data->write_back_work, disk_cache_write_back_work_handler);
+	k_work_init_delayable(&data->read_ahead.work, disk_cache_read_ahead_work_handler);
 
-	return disk_access_register(info);
+	return disk_access_register(&data->info);
 }
 
 static const struct disk_operations disk_cache_ops = {
@@ -265,26 +1028,143 @@ static const struct disk_operations disk_cache_ops = {
 
 #define DT_DRV_COMPAT zephyr_disk_cache
 
+#define DISK_CACHE_ENTRY_SECTORS(n) DT_INST_PROP(n, sectors_per_entry)
+#define DISK_CACHE_ENTRY_COUNT(n)   (DT_INST_PROP(n, sector_count) / DISK_CACHE_ENTRY_SECTORS(n))
+#define DISK_CACHE_WRITE_BACK_BUF_SECTORS(n)                                                       \
+	COND_CODE_1(DT_INST_PROP(n, write_back), (CONFIG_DISK_CACHE_WRITE_BACK_COALESCE_SECTORS), (1))
+
+#define DISK_CACHE_READ_AHEAD_SECTORS(n)                                                           \
+	COND_CODE_1(CONFIG_DISK_CACHE_READ_AHEAD, (DT_INST_PROP(n, read_ahead_sectors)), (0))
+
 #define DISK_CACHE_DEVICE_DEFINE(n)                                                                \
-	K_MEM_SLAB_DEFINE_STATIC(                                                                  \
-		disk_entries_##n, sizeof(struct disk_cache_entry) + DT_INST_PROP(n, sector_size),  \
-		DT_INST_PROP(n, sector_count), _Alignof(struct disk_cache_entry));                 \
+	BUILD_ASSERT(DT_INST_PROP(n, sector_count) % DISK_CACHE_ENTRY_SECTORS(n) == 0,             \
+		     "Sector count must be a multiple of sectors per entry");                      \
+	BUILD_ASSERT(DISK_CACHE_ENTRY_SECTORS(n) <= 32,                                            \
+		     "Dirty bitmap only supports 32 sectors per entry");                           \
+                                                                                                   \
+	K_MEM_SLAB_DEFINE_STATIC(disk_entries_##n,                                                 \
+				 sizeof(struct disk_cache_entry) +                                 \
+					 DT_INST_PROP(n, sector_size) * DISK_CACHE_ENTRY_SECTORS(n), \
+				 DISK_CACHE_ENTRY_COUNT(n), _Alignof(struct disk_cache_entry));    \
                                                                                                    \
 	static sys_dlist_t disk_lru_list_##n = SYS_DLIST_STATIC_INIT(&disk_lru_list_##n);          \
+	static sys_slist_t disk_buckets_##n[DISK_CACHE_ENTRY_COUNT(n)];                            \
+	static uint8_t disk_write_back_buf_##n[COND_CODE_1(DT_INST_PROP(n, write_back),            \
+		(DT_INST_PROP(n, sector_size) * DISK_CACHE_WRITE_BACK_BUF_SECTORS(n)), (1))];      \
+	static uint8_t disk_read_ahead_buf_##n[MAX(                                                \
+		2 * DT_INST_PROP(n, sector_size) * DISK_CACHE_READ_AHEAD_SECTORS(n), 1)];          \
                                                                                                    \
-	static struct disk_info disk_info_##n = {                                                  \
-		.name = DT_INST_PROP(n, disk_name),                                                \
-		.ops = &disk_cache_ops,                                                            \
+	static struct disk_cache_data disk_data_##n = {                                            \
+		.info =                                                                            \
+			{                                                                          \
+				.name = DT_INST_PROP(n, disk_name),                                \
+				.ops = &disk_cache_ops,                                            \
+			},                                                                         \
 	};                                                                                         \
                                                                                                    \
 	static const struct disk_cache_config disk_config_##n = {                                  \
 		.disk_name = DT_INST_PROP(n, backing_disk_name),                                   \
 		.sector_size = DT_INST_PROP(n, sector_size),                                       \
+		.entry_sectors = DISK_CACHE_ENTRY_SECTORS(n),                                      \
+		.entry_count = DISK_CACHE_ENTRY_COUNT(n),                                          \
 		.entries = &disk_entries_##n,                                                      \
 		.lru_list = &disk_lru_list_##n,                                                    \
+		.buckets = disk_buckets_##n,                                                       \
+		.write_back = DT_INST_PROP(n, write_back),                                         \
+		.write_back_delay = K_MSEC(DT_INST_PROP(n, write_back_delay_ms)),                  \
+		.write_back_buf = disk_write_back_buf_##n,                                         \
+		.write_back_buf_sectors = DISK_CACHE_WRITE_BACK_BUF_SECTORS(n),                    \
+		.read_ahead_sectors = DISK_CACHE_READ_AHEAD_SECTORS(n),                            \
+		.read_ahead_buf = disk_read_ahead_buf_##n,                                         \
 	};                                                                                         \
                                                                                                    \
-	DEVICE_DT_INST_DEFINE(n, disk_cache_init, NULL, &disk_info_##n, &disk_config_##n,          \
+	DEVICE_DT_INST_DEFINE(n, disk_cache_init, NULL, &disk_data_##n, &disk_config_##n,          \
 			      POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEVICE, &disk_cache_ops);
 
-DT_INST_FOREACH_STATUS_OKAY(DISK_CACHE_DEVICE_DEFINE)
\ No newline at end of file
+DT_INST_FOREACH_STATUS_OKAY(DISK_CACHE_DEVICE_DEFINE)
+
+#ifdef CONFIG_DISK_CACHE_SHELL
+#define DISK_CACHE_DEVICE_GET(n) DEVICE_DT_INST_GET(n),
+
+static const struct device *const disk_cache_devs[] = {
+	DT_INST_FOREACH_STATUS_OKAY(DISK_CACHE_DEVICE_GET)};
+
+static int cmd_disk_cache_stats(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (size_t i = 0; i < ARRAY_SIZE(disk_cache_devs); ++i) {
+		const struct device *dev = disk_cache_devs[i];
+		const struct disk_cache_config *config = dev->config;
+		const struct disk_cache_data *data = dev->data;
+		const struct disk_cache_stats *stats = &data->stats;
+		uint32_t accesses = stats->hits + stats->misses;
+
+		shell_print(sh, "%s", data->info.name);
+		shell_print(sh, "    Entries: %u/%u x %u sectors",
+			    k_mem_slab_num_used_get(config->entries), config->entry_count,
+			    config->entry_sectors);
+		shell_print(sh, "       Hits: %u (%u%%)", stats->hits,
+			    accesses ? (uint32_t)((uint64_t)stats->hits * 100 / accesses) : 0);
+		shell_print(sh, "     Misses: %u", stats->misses);
+		shell_print(sh, "  Evictions: %u", stats->evictions);
+		if (config->write_back) {
+			shell_print(sh, "      Dirty: %u sectors written to cache",
+				    stats->dirty_writes);
+			shell_print(sh, "Write backs: %u", stats->write_backs);
+		}
+		if (config->read_ahead_sectors) {
+			shell_print(sh, " Read ahead: %u sectors from %u fills of %u",
+				    stats->read_ahead_hits, stats->read_ahead_fills,
+				    config->read_ahead_sectors);
+			shell_print(sh, "     Stream: %llu KiB in %u ms (%llu KiB/s)",
+				    stats->stream_bytes / 1024, stats->stream_ms,
+				    stats->stream_ms ? stats->stream_bytes * 1000 / 1024 / stats->stream_ms
+						     : 0);
+		}
+		shell_print(sh, "     Writes: %u, %llu KiB, %llu KiB/s", stats->writes,
+			    stats->write_bytes / 1024,
+			    stats->write_us ? stats->write_bytes * USEC_PER_SEC / 1024 / stats->write_us
+					    : 0);
+		shell_print(sh, "  Max write: %u us at %lld ms", stats->write_max_us,
+			    stats->write_max_uptime_ms);
+		for (size_t j = 0; j < DISK_CACHE_WRITE_HIST_BUCKETS; ++j) {
+			if (stats->write_hist[j] == 0) {
+				continue;
+			}
+			if (j == DISK_CACHE_WRITE_HIST_BUCKETS - 1) {
+				shell_print(sh, "   >=%6u us: %u",
+					    DISK_CACHE_WRITE_HIST_MIN_US << (j - 1), stats->write_hist[j]);
+			} else {
+				shell_print(sh, "    <%6u us: %u", DISK_CACHE_WRITE_HIST_MIN_US << j,
+					    stats->write_hist[j]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int cmd_disk_cache_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(sh);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (size_t i = 0; i < ARRAY_SIZE(disk_cache_devs); ++i) {
+		struct disk_cache_data *data = disk_cache_devs[i]->data;
+
+		data->stats = (struct disk_cache_stats){0};
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_disk_cache,
+			       SHELL_CMD(stats, NULL, "Show cache statistics", cmd_disk_cache_stats),
+			       SHELL_CMD(reset, NULL, "Reset cache statistics", cmd_disk_cache_reset),
+			       SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(disk_cache, &sub_disk_cache, "Disk cache commands", NULL);
+#endif /* CONFIG_DISK_CACHE_SHELL */
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2024 Ben Wolsieffer
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/types.h>
+#include <zephyr/drivers/disk.h>
+#include <zephyr/storage/disk_access.h>
+#include <errno.h>
+#include <zephyr/init.h>
+#include <zephyr/device.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/util.h>
+#include <zeus/drivers/disk.h>
+
+LOG_MODULE_REGISTER(disk_latency, CONFIG_DISK_LATENCY_LOG_LEVEL);
+
+/// Latency injected into writes. Can be changed at runtime from the shell.
+struct disk_latency_params {
+	/// Fixed latency of every write (us)
+	uint32_t write_latency_us;
+	/// Maximum random latency added to every write (us)
+	uint32_t write_jitter_us;
+	/// Time between long stalls, like card garbage collection (ms)
+	uint32_t stall_period_ms;
+	/// Duration of each long stall (ms)
+	uint32_t stall_ms;
+	/// Maximum sustained write throughput (KiB/s), or 0 for unlimited
+	uint32_t max_write_kib_s;
+};
+
+struct disk_latency_config {
+	const char *const disk_name;
+	const struct disk_latency_params params;
+};
+
+struct disk_latency_data {
+	struct disk_info info;
+	struct disk_latency_params params;
+	uint32_t sector_size;
+	/// Uptime of the next long stall (ms)
+	int64_t next_stall_ms;
+	/// Uptime when the writes so far would have finished at the maximum throughput (us)
+	int64_t busy_until_us;
+	/// Random number generator state. A fixed seed makes runs reproducible.
+	uint32_t rand_state;
+	/// Sequential region declared with DISK_IOCTL_STREAM_HINT
+	struct disk_stream_hint stream;
+	/// The last write was in the stream, so the multi-block write is still open
+	bool stream_open;
+	/// Sector following the last write, which continues the open multi-block write
+	uint32_t stream_next_sector;
+	uint32_t stalls;
+	/// Writes that continued a stream, and so had no command latency
+	uint32_t stream_writes;
+	uint64_t injected_us;
+};
+
+/// xorshift32, which is good enough for jitter and doesn't need an entropy source
+static uint32_t disk_latency_rand(struct disk_latency_data *data)
+{
+	uint32_t x = data->rand_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	data->rand_state = x;
+	return x;
+}
+
+/// Check whether a write continues the current stream, like a card that was sent an open-ended
+/// multi-block write for the region and is still waiting for more data.
+static bool disk_latency_stream_continues(const struct device *dev, uint32_t start_sector,
+					  uint32_t num_sector)
+{
+	struct disk_latency_data *data = dev->data;
+	const struct disk_stream_hint *stream = &data->stream;
+
+	bool in_stream = start_sector >= stream->start_sector &&
+			 start_sector - stream->start_sector + num_sector <= stream->num_sector;
+	bool continues = in_stream && data->stream_open && start_sector == data->stream_next_sector;
+	// Any other write interrupts the multi-block write, so it has to be started again
+	data->stream_open = in_stream;
+	data->stream_next_sector = start_sector + num_sector;
+	return continues;
+}
+
+/// Calculate the latency to inject into a write of the specified size. Writes that continue a
+/// stream only pay for the transfer itself and stalls.
+static uint32_t disk_latency_write_delay(const struct device *dev, size_t len, bool stream)
+{
+	struct disk_latency_data *data = dev->data;
+	const struct disk_latency_params *params = &data->params;
+
+	uint32_t delay_us = 0;
+	if (!stream) {
+		delay_us += params->write_latency_us;
+		if (params->write_jitter_us > 0) {
+			delay_us += disk_latency_rand(data) % (params->write_jitter_us + 1);
+		}
+	}
+
+	int64_t now_ms = k_uptime_get();
+	if (params->stall_period_ms > 0 && params->stall_ms > 0) {
+		if (data->next_stall_ms == 0) {
+			data->next_stall_ms = now_ms + params->stall_period_ms;
+		} else if (now_ms >= data->next_stall_ms) {
+			LOG_DBG("stall: %u ms", params->stall_ms);
+			delay_us += params->stall_ms * USEC_PER_MSEC;
+			data->next_stall_ms = now_ms + params->stall_period_ms;
+			data->stalls++;
+		}
+	}
+
+	if (params->max_write_kib_s > 0) {
+		int64_t now_us = k_ticks_to_us_floor64(k_uptime_ticks());
+		uint64_t transfer_us =
+			(uint64_t)len * USEC_PER_SEC / ((uint64_t)params->max_write_kib_s * 1024);
+		data->busy_until_us = MAX(data->busy_until_us, now_us) + transfer_us;
+		delay_us += data->busy_until_us - now_us;
+	}
+
+	return delay_us;
+}
+
+static int disk_latency_access_status(struct disk_info *disk)
+{
+	const struct disk_latency_config *config = disk->dev->config;
+
+	return disk_access_status(config->disk_name);
+}
+
+static int disk_latency_access_read(struct disk_info *disk, uint8_t *buff, uint32_t start_sector,
+				    uint32_t num_sector)
+{
+	const struct disk_latency_config *config = disk->dev->config;
+
+	return disk_access_read(config->disk_name, buff, start_sector, num_sector);
+}
+
+static int disk_latency_access_write(struct disk_info *disk, const uint8_t *data_buf,
+				     uint32_t start_sector, uint32_t num_sector)
+{
+	const struct device *dev = disk->dev;
+	const struct disk_latency_config *config = dev->config;
+	struct disk_latency_data *data = dev->data;
+	int ret;
+
+	ret = disk_access_write(config->disk_name, data_buf, start_sector, num_sector);
+	if (ret < 0) {
+		return ret;
+	}
+
+	bool stream = disk_latency_stream_continues(dev, start_sector, num_sector);
+	if (stream) {
+		data->stream_writes++;
+	}
+	uint32_t delay_us = disk_latency_write_delay(dev, num_sector * data->sector_size, stream);
+	if (delay_us > 0) {
+		data->injected_us += delay_us;
+		k_usleep(delay_us);
+	}
+	return 0;
+}
+
+static int disk_latency_access_ioctl(struct disk_info *disk, uint8_t cmd, void *buff)
+{
+	const struct device *dev = disk->dev;
+	const struct disk_latency_config *config = dev->config;
+	struct disk_latency_data *data = dev->data;
+	int ret;
+
+	if (cmd == DISK_IOCTL_STREAM_HINT) {
+		// Simulated here, since the backing disk has no command overhead to avoid
+		const struct disk_stream_hint *hint = buff;
+
+		LOG_DBG("stream: sector %u, count %u", hint->start_sector, hint->num_sector);
+		data->stream = *hint;
+		data->stream_open = false;
+		return 0;
+	}
+
+	ret = disk_access_ioctl(config->disk_name, cmd, buff);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (cmd == DISK_IOCTL_CTRL_INIT) {
+		ret = disk_access_ioctl(config->disk_name, DISK_IOCTL_GET_SECTOR_SIZE,
+					&data->sector_size);
+		if (ret < 0) {
+			return ret;
+		}
+		data->next_stall_ms = 0;
+		data->busy_until_us = 0;
+		data->stream = (struct disk_stream_hint){0};
+		data->stream_open = false;
+	}
+
+	return 0;
+}
+
+static int disk_latency_access_init(struct disk_info *disk)
+{
+	const struct disk_latency_config *config = disk->dev->config;
+
+	return disk_access_init(config->disk_name);
+}
+
+static int disk_latency_init(const struct device *dev)
+{
+	const struct disk_latency_config *config = dev->config;
+	struct disk_latency_data *data = dev->data;
+
+	data->info.dev = dev;
+	data->params = config->params;
+	data->rand_state = 0x9e3779b9;
+
+	return disk_access_register(&data->info);
+}
+
+static const struct disk_operations disk_latency_ops = {
+	.init = disk_latency_access_init,
+	.status = disk_latency_access_status,
+	.read = disk_latency_access_read,
+	.write = disk_latency_access_write,
+	.ioctl = disk_latency_access_ioctl,
+};
+
+#define DT_DRV_COMPAT zephyr_disk_latency
+
+#define DISK_LATENCY_DEVICE_DEFINE(n)                                                              \
+	static struct disk_latency_data disk_latency_data_##n = {                                  \
+		.info =                                                                            \
+			{                                                                          \
+				.name = DT_INST_PROP(n, disk_name),                                \
+				.ops = &disk_latency_ops,                                          \
+			},                                                                         \
+	};                                                                                         \
+                                                                                                   \
+	static const struct disk_latency_config disk_latency_config_##n = {                        \
+		.disk_name = DT_INST_PROP(n, backing_disk_name),                                   \
+		.params =                                                                          \
+			{                                                                          \
+				.write_latency_us = DT_INST_PROP(n, write_latency_us),             \
+				.write_jitter_us = DT_INST_PROP(n, write_jitter_us),               \
+				.stall_period_ms = DT_INST_PROP(n, stall_period_ms),               \
+				.stall_ms = DT_INST_PROP(n, stall_duration_ms),                    \
+				.max_write_kib_s = DT_INST_PROP(n, max_write_kib_per_s),           \
+			},                                                                         \
+	};                                                                                         \
+                                                                                                   \
+	DEVICE_DT_INST_DEFINE(n, disk_latency_init, NULL, &disk_latency_data_##n,                  \
+			      &disk_latency_config_##n, POST_KERNEL,                               \
+			      CONFIG_KERNEL_INIT_PRIORITY_DEVICE, &disk_latency_ops);
+
+DT_INST_FOREACH_STATUS_OKAY(DISK_LATENCY_DEVICE_DEFINE)
+
+#if CONFIG_DISK_LATENCY_SHELL
+#define DISK_LATENCY_DEVICE_GET(n) DEVICE_DT_INST_GET(n),
+
+static const struct device *const disk_latency_devs[] = {
+	DT_INST_FOREACH_STATUS_OKAY(DISK_LATENCY_DEVICE_GET)};
+
+static int cmd_disk_latency_show(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (size_t i = 0; i < ARRAY_SIZE(disk_latency_devs); ++i) {
+		const struct disk_latency_data *data = disk_latency_devs[i]->data;
+		const struct disk_latency_params *params = &data->params;
+
+		shell_print(sh, "%s", data->info.name);
+		shell_print(sh, "     latency_us: %u", params->write_latency_us);
+		shell_print(sh, "      jitter_us: %u", params->write_jitter_us);
+		shell_print(sh, "stall_period_ms: %u", params->stall_period_ms);
+		shell_print(sh, "       stall_ms: %u", params->stall_ms);
+		shell_print(sh, "      max_kib_s: %u", params->max_write_kib_s);
+		shell_print(sh, "         Stalls: %u", data->stalls);
+		shell_print(sh, "  Stream writes: %u", data->stream_writes);
+		shell_print(sh, "       Injected: %llu ms", data->injected_us / USEC_PER_MSEC);
+	}
+
+	return 0;
+}
+
+static int cmd_disk_latency_set(const struct shell *sh, size_t argc, char **argv)
+{
+	const char *name = argv[1];
+	const char *param = argv[2];
+	char *end;
+
+	const struct device *dev = NULL;
+	for (size_t i = 0; i < ARRAY_SIZE(disk_latency_devs); ++i) {
+		const struct disk_latency_data *data = disk_latency_devs[i]->data;
+		if (strcmp(data->info.name, name) == 0) {
+			dev = disk_latency_devs[i];
+		}
+	}
+	if (!dev) {
+		shell_error(sh, "unknown disk: %s", name);
+		return -ENODEV;
+	}
+
+	uint32_t value = strtoul(argv[3], &end, 10);
+	if (*argv[3] == '\0' || *end != '\0') {
+		shell_error(sh, "invalid value: %s", argv[3]);
+		return -EINVAL;
+	}
+
+	struct disk_latency_data *data = dev->data;
+	struct disk_latency_params *params = &data->params;
+	if (strcmp(param, "latency_us") == 0) {
+		params->write_latency_us = value;
+	} else if (strcmp(param, "jitter_us") == 0) {
+		params->write_jitter_us = value;
+	} else if (strcmp(param, "stall_period_ms") == 0) {
+		params->stall_period_ms = value;
+		data->next_stall_ms = 0;
+	} else if (strcmp(param, "stall_ms") == 0) {
+		params->stall_ms = value;
+	} else if (strcmp(param, "max_kib_s") == 0) {
+		params->max_write_kib_s = value;
+		data->busy_until_us = 0;
+	} else {
+		shell_error(sh, "unknown parameter: %s", param);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	sub_disk_latency,
+	SHELL_CMD_ARG(show, NULL, "Show injected latency parameters", cmd_disk_latency_show, 1, 0),
+	SHELL_CMD_ARG(set, NULL,
+		      "Set a latency parameter: <disk> <latency_us|jitter_us|stall_period_ms|"
+		      "stall_ms|max_kib_s> <value>",
+		      cmd_disk_latency_set, 4, 0),
+	SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(disk_latency, &sub_disk_latency, "Disk latency injection commands", NULL);
+#endif /* CONFIG_DISK_LATENCY_SHELL */
@@ -154,6 +154,8 @@ static int i2s_alsa_trigger(const struct device *dev, enum i2s_dir dir,
     switch (cmd) {
         case I2S_TRIGGER_START:
             return snd_pcm_start(data->handle);
+        case I2S_TRIGGER_DROP:
+            return snd_pcm_drop(data->handle);
         default:
             return -ENOSYS;
     }
@@ -88,12 +88,16 @@ static int i2s_tone_read(const struct device *dev, void **mem_block,
     __ASSERT(*size % frame_bytes == 0, "Frames don't fit neatly in buffer");
     uint32_t buffer_frames = *size / frame_bytes;
 
-    int32_t amplitude = ((1 << data->cfg.word_size) - 1) / 2;
+    // 64-bit arithmetic so 32-bit words don't overflow
+    int32_t amplitude =
+        (int32_t)(((UINT64_C(1) << data->cfg.word_size) - 1) / 2);
 
     for (uint32_t i = 0; i < buffer_frames; ++i) {
         float phase =
             data->phase + (float)i / cycle_samples * (2 * (float)M_PI);
-        int32_t val = sinf(phase) * amplitude;
+        // Double precision so full scale 32-bit samples don't round up past
+        // INT32_MAX
+        int32_t val = (double)sinf(phase) * amplitude;
         val = sys_cpu_to_le32(val);
         for (uint8_t ch = 0; ch < data->cfg.channels; ++ch) {
             memcpy(buffer + i * frame_bytes + ch * sample_bytes, &val,
@@ -125,6 +129,7 @@ static int i2s_tone_trigger(const struct device *dev, enum i2s_dir dir,
 
     switch (cmd) {
         case I2S_TRIGGER_START:
+        case I2S_TRIGGER_DROP:
             return 0;
         default:
             return -ENOSYS;
@@ -39,6 +39,7 @@ struct input_codec_api {
 	int (*configure)(const struct device *dev, struct audio_codec_cfg *cfg);
 	int (*start_input)(const struct device *dev);
 	int (*stop_input)(const struct device *dev);
+	int (*input_settled)(const struct device *dev);
 	int (*get_property)(const struct device *dev, enum input_codec_property property,
 			    audio_channel_t channel, union input_codec_property_value *val);
 	int (*set_property)(const struct device *dev, enum input_codec_property property,
@@ -96,6 +97,29 @@ static inline int input_codec_stop_input(const struct device *dev)
 	return api->stop_input(dev);
 }
 
+/**
+ * @brief Check whether the codec input has settled
+ *
+ * After the input is started, the codec may output invalid samples while its
+ * analog and digital paths power up. This reports whether the samples are now
+ * valid. Drivers that don't implement this are always considered settled.
+ *
+ * @param dev Pointer to the device structure for codec driver instance.
+ *
+ * @return 1 if settled, 0 if still settling or stopped, negative error code
+ * on failure
+ */
+static inline int input_codec_input_settled(const struct device *dev)
+{
+	const struct input_codec_api *api = (const struct input_codec_api *)dev->api;
+
+	if (api->input_settled == NULL) {
+		return 1;
+	}
+
+	return api->input_settled(dev);
+}
+
 /**
  * @brief Get a codec property defined by input_codec_property
  *
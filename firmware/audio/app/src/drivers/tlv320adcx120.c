@@ -31,6 +31,13 @@ LOG_MODULE_REGISTER(tlv320adcx120, CONFIG_AUDIO_CODEC_LOG_LEVEL);
  */
 #define CODEC_MIN_SUSPEND_MSEC 10
 
+/*
+ * Time to wait after the channels report that they are powered up before the
+ * input is considered settled. This covers the decimation filter group delay
+ * and the high-pass filter transient from the input coupling capacitors.
+ */
+#define CODEC_INPUT_SETTLE_MSEC 50
+
 #define CODEC_NUM_CHANNELS        4
 #define CODEC_NUM_ANALOG_CHANNELS 2
 
@@ -63,6 +70,8 @@ struct codec_driver_data {
 	struct codec_channel_data channels[CODEC_NUM_CHANNELS];
 	/* Time the codec last entered suspend; used to enforce minimum suspend time. */
 	int64_t suspend_time_msec;
+	/* Time the ADC was last powered on; used to determine when it has settled. */
+	int64_t start_time_msec;
 	bool started;
 };
 
@@ -657,6 +666,7 @@ static int codec_start_input(const struct device *dev)
 		goto error_i2c;
 	}
 
+	data->start_time_msec = k_uptime_get();
 	data->started = true;
 
 	CODEC_DUMP_REGS(dev);
@@ -693,6 +703,44 @@ static int codec_stop_input(const struct device *dev)
 	return 0;
 }
 
+static int codec_input_settled(const struct device *dev)
+{
+	const struct codec_driver_config *const cfg = dev->config;
+	struct codec_driver_data *data = dev->data;
+	uint8_t in_ch_status = 0;
+	uint8_t val;
+	int ret;
+
+	if (!data->started) {
+		return 0;
+	}
+
+	ret = codec_read_reg(dev, DEV_STS1_ADDR, &val);
+	if (ret < 0) {
+		return ret;
+	}
+	if (FIELD_GET(DEV_STS1_MODE_STS, val) != DEV_STS1_MODE_STS_ACTIVE_ON) {
+		/* Still powering up, restart the settling time */
+		data->start_time_msec = k_uptime_get();
+		return 0;
+	}
+
+	for (uint8_t i = 0; i < cfg->num_channels; ++i) {
+		in_ch_status |= DEV_STS0_IN_CH_STATUS(cfg->channels[i].channel);
+	}
+
+	ret = codec_read_reg(dev, DEV_STS0_ADDR, &val);
+	if (ret < 0) {
+		return ret;
+	}
+	if ((val & in_ch_status) != in_ch_status) {
+		data->start_time_msec = k_uptime_get();
+		return 0;
+	}
+
+	return k_uptime_get() - data->start_time_msec >= CODEC_INPUT_SETTLE_MSEC;
+}
+
 static int codec_get_property(const struct device *dev, enum input_codec_property property,
 			      audio_channel_t channel, union input_codec_property_value *val)
 {
@@ -836,6 +884,7 @@ static const struct input_codec_api codec_driver_api = {
 	.configure = codec_configure,
 	.start_input = codec_start_input,
 	.stop_input = codec_stop_input,
+	.input_settled = codec_input_settled,
 	.get_property = codec_get_property,
 	.set_property = codec_set_property,
 	.apply_properties = codec_apply_properties,
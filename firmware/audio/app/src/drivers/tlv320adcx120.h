@@ -116,6 +116,15 @@ extern "C" {
 #define PWR_CFG_DYN_MAXCH_SEL_4		1
 #define PWR_CFG_VAD_EN			BIT(0)
 
+#define DEV_STS0_ADDR			(struct reg_addr){0, 0x76}
+#define DEV_STS0_IN_CH_STATUS(ch)	BIT(7 - ((ch) - 1))
+
+#define DEV_STS1_ADDR			(struct reg_addr){0, 0x77}
+#define DEV_STS1_MODE_STS		GENMASK(7, 5)
+#define DEV_STS1_MODE_STS_SLEEP		4
+#define DEV_STS1_MODE_STS_ACTIVE_OFF	6
+#define DEV_STS1_MODE_STS_ACTIVE_ON	7
+
 struct reg_addr {
 	uint8_t page;     /* page number */
 	uint8_t reg_addr; /* register address */
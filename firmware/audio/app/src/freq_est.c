@@ -47,6 +47,10 @@ void freq_est_init(struct freq_est *e, const struct freq_est_config *cfg) {
     };
 }
 
+void freq_est_reset(struct freq_est *e) {
+    e->status = FREQ_EST_STATUS_RESET;
+}
+
 qu32_32 freq_est_predict(const struct freq_est *e, qu32_32 time) {
     float dt = q32_32_to_float(phase_diff_signed(time, e->last_time));
     return phase_add_float(e->theta, dt * e->f);
@@ -82,6 +82,11 @@ struct freq_est {
 /// lifetime of the estimator.
 void freq_est_init(struct freq_est *e, const struct freq_est_config *cfg);
 
+/// Reset the phase estimate, for example after a discontinuity in the local
+/// time. The frequency estimate is kept, since it likely stays the same. The
+/// next update re-initializes the phase.
+void freq_est_reset(struct freq_est *e);
+
 /// Predict the phase offset at the specified time
 qu32_32 freq_est_predict(const struct freq_est *e, qu32_32 time);
 
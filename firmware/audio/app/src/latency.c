@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "latency.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+void latency_hist_add(struct latency_hist *h, uint32_t us, size_t len) {
+    size_t bucket = 0;
+    while (bucket < LATENCY_HIST_BUCKETS - 1 &&
+           us >= latency_hist_bucket_max_us(bucket)) {
+        bucket++;
+    }
+
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_us += us;
+    h->bytes += len;
+    if (us >= h->max_us) {
+        h->max_us = us;
+        h->max_uptime_ms = k_uptime_get();
+    }
+}
+
+uint32_t latency_hist_bucket_max_us(size_t bucket) {
+    if (bucket >= LATENCY_HIST_BUCKETS - 1) return UINT32_MAX;
+    return LATENCY_HIST_MIN_US << bucket;
+}
+
+uint32_t latency_hist_kib_per_s(const struct latency_hist *h) {
+    if (h->total_us == 0) return 0;
+    return h->bytes * USEC_PER_SEC / 1024 / h->total_us;
+}
+
+int latency_hist_format(const struct latency_hist *h, char *buf, size_t len) {
+    int total = 0;
+
+    if (len > 0) buf[0] = '\0';
+    for (size_t i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        if (h->buckets[i] == 0) continue;
+
+        size_t offset = MIN(total, len);
+        int ret;
+        if (i == LATENCY_HIST_BUCKETS - 1) {
+            ret = snprintk(buf + offset, len - offset,
+                           "%s>=%" PRIu32 "us:%" PRIu32, total ? " " : "",
+                           latency_hist_bucket_max_us(i - 1), h->buckets[i]);
+        } else {
+            ret = snprintk(buf + offset, len - offset,
+                           "%s<%" PRIu32 "us:%" PRIu32, total ? " " : "",
+                           latency_hist_bucket_max_us(i), h->buckets[i]);
+        }
+        if (ret < 0) return ret;
+        total += ret;
+    }
+    return total;
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Upper bound of the first histogram bucket (us). Each following bucket is
+/// twice as wide as the previous one.
+#define LATENCY_HIST_MIN_US 64
+/// The last bucket holds everything over about 1 s
+#define LATENCY_HIST_BUCKETS 16
+
+/// Latency histogram of a storage operation, with power of two buckets
+struct latency_hist {
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    uint32_t count;
+    /// Total time spent in the operation (us)
+    uint64_t total_us;
+    /// Total bytes passed to the operation
+    uint64_t bytes;
+    /// Worst case latency (us)
+    uint32_t max_us;
+    /// Uptime when the worst case latency occurred (ms)
+    int64_t max_uptime_ms;
+};
+
+/// Record one operation that took us microseconds and transferred len bytes.
+void latency_hist_add(struct latency_hist *h, uint32_t us, size_t len);
+
+/// Upper bound of a bucket (us), or UINT32_MAX for the last bucket.
+uint32_t latency_hist_bucket_max_us(size_t bucket);
+
+/// Throughput while the operation was in progress, in KiB/s.
+uint32_t latency_hist_kib_per_s(const struct latency_hist *h);
+
+/// Format the non-empty buckets as "<64us:12 <128us:3 ...". Return the length
+/// of the string, like snprintf().
+int latency_hist_format(const struct latency_hist *h, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
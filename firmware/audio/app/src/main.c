@@ -68,6 +68,7 @@ int main(void) {
     sync_timer_init();
     record_init();
     audio_init();
+    record_audio_ready();
     mgr_init();
 
     LOG_INF("Booted");
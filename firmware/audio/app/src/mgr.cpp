@@ -547,12 +547,14 @@ bool mgr_parse_adv_data(const struct bt_data& adv, struct zeus_adv_data& data) {
     size_t cmd_len = body_len - sizeof(data.cmd.id);
     switch (data.cmd.id) {
         case ZEUS_ADV_CMD_NONE:
-        case ZEUS_ADV_CMD_STOP:
             if (cmd_len != 0) return false;
             break;
         case ZEUS_ADV_CMD_START:
             if (cmd_len != sizeof(data.cmd.start)) return false;
             break;
+        case ZEUS_ADV_CMD_STOP:
+            if (cmd_len != sizeof(data.cmd.stop)) return false;
+            break;
         default:
             // Unknown command
             return false;
@@ -583,7 +585,7 @@ void mgr_handle_adv_data(const struct zeus_adv_data& data) {
             record_start(data.cmd.start.time);
             break;
         case ZEUS_ADV_CMD_STOP:
-            record_stop();
+            record_stop_at(data.cmd.stop.time);
             break;
     }
 }
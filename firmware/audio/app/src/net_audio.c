@@ -7,22 +7,64 @@
 
 LOG_MODULE_REGISTER(net_audio);
 
-static K_FIFO_DEFINE(net_audio_fifo);
+// Blocks waiting to be sent hold memory from the I2S pool, so only queue a
+// couple. The stream is dropped rather than delaying the recorder.
+#define NET_AUDIO_QUEUE_LEN 2
+
+static K_MSGQ_DEFINE(net_audio_queue, sizeof(struct audio_block),
+                     NET_AUDIO_QUEUE_LEN, 4);
+static K_THREAD_STACK_DEFINE(net_audio_thread_stack, 1024);
+
+static int net_audio_submit(const struct audio_block *block);
 
 static struct net_audio {
     int socket;
-    struct k_fifo *const fifo;
+    struct k_msgq *const queue;
+    struct audio_consumer consumer;
+    struct k_thread thread;
 
     bool init;
     const char *addr_str;
     uint16_t mtu;
+    /// Number of blocks dropped because the queue was full
+    atomic_t overruns;
 } net_audio = {
     .socket = -1,
-    .fifo = &net_audio_fifo,
+    .queue = &net_audio_queue,
+    .consumer =
+        {
+            .submit = net_audio_submit,
+            .droppable = true,
+        },
 
     .addr_str = "fe80::8854:88ff:fea9:23a6",
 };
 
+/// Called from the audio thread, so this must never block.
+static int net_audio_submit(const struct audio_block *block) {
+    struct net_audio *n = &net_audio;
+    int ret;
+
+    ret = k_msgq_put(n->queue, block, K_NO_WAIT);
+    if (ret < 0) {
+        atomic_inc(&n->overruns);
+        audio_block_free(block);
+        return -ENOBUFS;
+    }
+    return 0;
+}
+
+static void net_audio_thread_run(void *p1, void *p2, void *p3) {
+    struct net_audio *n = &net_audio;
+
+    while (true) {
+        struct audio_block block;
+        k_msgq_get(n->queue, &block, K_FOREVER);
+        net_audio_send(block.buf, block.len);
+        audio_block_free(&block);
+    }
+}
+
 int net_audio_init(void) {
     int ret;
     struct net_audio *n = &net_audio;
@@ -71,7 +113,17 @@ int net_audio_init(void) {
 
     n->mtu = net_if_get_mtu(iface) - 48;
 
+    k_thread_create(&n->thread, net_audio_thread_stack,
+                    K_THREAD_STACK_SIZEOF(net_audio_thread_stack),
+                    net_audio_thread_run, NULL, NULL, NULL, K_PRIO_PREEMPT(5),
+                    0, K_NO_WAIT);
+    k_thread_name_set(&n->thread, "net_audio");
+
     n->init = true;
+
+    ret = audio_add_consumer(&n->consumer);
+    if (ret) return ret;
+
     return 0;
 }
 
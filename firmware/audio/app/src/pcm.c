@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "pcm.h"
+
+#include <string.h>
+#include <zephyr/sys/__assert.h>
+#include <zephyr/toolchain.h>
+
+BUILD_ASSERT(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+             "PCM packing assumes a little-endian CPU");
+
+size_t pcm_pack_32_to_24(uint8_t *buf, size_t len) {
+    __ASSERT(len % 4 == 0, "Buffer size not a multiple of 32-bits");
+    __ASSERT((uintptr_t)buf % 4 == 0, "Buffer not 32-bit aligned");
+
+    const uint32_t *in = (const uint32_t *)buf;
+    uint32_t *out = (uint32_t *)buf;
+    size_t groups = len / 16;
+
+    // Pack four samples (16 bytes) into three words (12 bytes) per iteration.
+    // Each output word only overlaps input words that have already been read,
+    // so this is safe to do in place. On Cortex-M, each shift and OR pair
+    // compiles to a single instruction with a shifted operand.
+    for (size_t i = 0; i < groups; i++) {
+        uint32_t s0 = in[0];
+        uint32_t s1 = in[1];
+        uint32_t s2 = in[2];
+        uint32_t s3 = in[3];
+        in += 4;
+
+        out[0] = (s0 >> 8) | ((s1 >> 8) << 24);
+        out[1] = (s1 >> 16) | ((s2 >> 8) << 16);
+        out[2] = (s2 >> 24) | (s3 & 0xffffff00);
+        out += 3;
+    }
+
+    // Up to three leftover samples
+    uint8_t *tail_in = (uint8_t *)in;
+    uint8_t *tail_out = (uint8_t *)out;
+    for (size_t i = groups * 16; i < len; i += 4) {
+        memmove(tail_out, tail_in + 1, 3);
+        tail_in += 4;
+        tail_out += 3;
+    }
+
+    return len / 4 * 3;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Convert a buffer of 32-bit LE samples to packed 24-bit LE samples in place
+/// by discarding the least significant byte of each sample. The length must be
+/// a multiple of 4 bytes. Return the new length of the buffer.
+size_t pcm_pack_32_to_24(uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,5 +2,8 @@
 #include "zeus/power.h"
 
 #include "record.h"
+#include "sd_card.h"
 
 POWER_SHUTDOWN_HOOK_DEFINE(record_shutdown, 1);
+// After recording has stopped and closed its files
+POWER_SHUTDOWN_HOOK_DEFINE(sd_card_shutdown, 2);
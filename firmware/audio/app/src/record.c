@@ -3,54 +3,332 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <zephyr/fs/fs.h>
 #include <zephyr/kernel.h>
+#include <zephyr/linker/devicetree_regions.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/settings/settings.h>
 
+#include "block_ring.h"
+#include "crc32c.h"
+#include "fixed.h"
+#include "latency.h"
+#include "sd_card.h"
+#include "sync_timer.h"
 #include "wav.h"
+#include "zeus/protocol.h"
 #include "zeus/led.h"
 #include "zeus/util.h"
 
 LOG_MODULE_REGISTER(record, LOG_LEVEL_DBG);
 
 #define RECORD_FILE_DIR "/SD:"
+// Each recording session gets its own directory, named after the prefix and
+// the index of its first file, so that the root doesn't accumulate thousands of
+// files.
+#define RECORD_SESSION_DIR_LEN                       \
+    ((sizeof(RECORD_FILE_DIR) - 1) + 1 /* / */ +     \
+     (RECORD_FILE_NAME_PREFIX_LEN - 1) + 1 /* _ */ + \
+     10 /* max digits */ + 1 /* terminator */)
+#define RECORD_FILE_NAME_LEN                         \
+    (RECORD_SESSION_DIR_LEN + 1 /* / */ +            \
+     (RECORD_FILE_NAME_PREFIX_LEN - 1) + 1 /* _ */ + \
+     10 /* max digits */ + 4 /* .wav */)
+#if IS_ENABLED(CONFIG_RECORD_LARGE_FILES)
+// Limited only by the filesystem. On exFAT, each session is a single RF64 file.
+#define RECORD_FILE_MAX_SIZE UINT64_MAX
+#else
 // 2 GiB, because some programs use a signed 32-bit integer
 #define RECORD_FILE_MAX_SIZE INT32_MAX
+#endif
+// Open the next file in the background once the current file has less than
+// this much space left, so that it is ready when the size limit is reached.
+// This is about a minute of 96 kHz 24-bit stereo audio.
+#define RECORD_NEXT_FILE_MARGIN (32 * 1024 * 1024)
+// Number of files that can be open at once: the current file, the next file
+// and files still being closed in the background.
+#define RECORD_FILE_POOL_SIZE 4
+// Maximum time to wait for a file to finish closing before opening a new one
+#define RECORD_FILE_ALLOC_TIMEOUT_MS 1000
 
 #define RECORD_SYNC_INTERVAL_MS 5000
 
+// Gaps longer than this are assumed to be caused by a timestamp error rather
+// than lost audio, so they are not filled with silence.
+#define RECORD_GAP_MAX_MS 10000
+
+// Start times further in the future than this are assumed to be bogus (e.g.
+// the central time is not yet known), so the ADC is powered on immediately.
+#define RECORD_PREWARM_MAX_DELAY_MS 60000
+
+// Maximum time to wait for buffered audio to be written when shutting down
+#define RECORD_SHUTDOWN_TIMEOUT_MS 5000
+/// Storage summary written to each session directory when the session ends
+#define RECORD_SUMMARY_FILE_NAME "health.txt"
+#define RECORD_SUMMARY_PATH_LEN \
+    (RECORD_SESSION_DIR_LEN + sizeof("/" RECORD_SUMMARY_FILE_NAME) - 1)
+
+/// Written to each session directory, with a line for each file once it is
+/// closed, so that the host can plan downloads without opening every file
+#define RECORD_MANIFEST_FILE_NAME "manifest.csv"
+#define RECORD_MANIFEST_PATH_LEN \
+    (RECORD_SESSION_DIR_LEN + sizeof("/" RECORD_MANIFEST_FILE_NAME) - 1)
+#define RECORD_MANIFEST_HEADER                                             \
+    "index,start_time,time_reference,sample_rate,channels,bits_per_sample," \
+    "frames,gaps,gap_frames,overruns,i2s_overruns,timestamp_errors,"       \
+    "sync_outliers,sync_resets,crc32c\n"
+
+/// Sidecar written next to each file, holding the hash of its audio data
+#define RECORD_HASH_SUFFIX ".hash"
+#define RECORD_HASH_PATH_LEN \
+    (RECORD_FILE_NAME_LEN + sizeof(RECORD_HASH_SUFFIX) - 1)
+
+// Every block in the audio memory pool can be waiting in the queue at once, so
+// the queue itself should never be the cause of an overrun.
+#define RECORD_BLOCK_QUEUE_LEN AUDIO_BLOCK_COUNT_MAX
+
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+#define RECORD_BUFFER_NODE DT_CHOSEN(zeus_record_buffer)
+#if DT_NODE_HAS_PROP(RECORD_BUFFER_NODE, zephyr_memory_region)
+#define RECORD_BUFFER_SIZE DT_REG_SIZE(RECORD_BUFFER_NODE)
+static uint8_t record_buffer_mem[RECORD_BUFFER_SIZE] __aligned(4)
+    Z_GENERIC_SECTION(LINKER_DT_NODE_REGION_NAME(RECORD_BUFFER_NODE));
+#else
+#define RECORD_BUFFER_SIZE DT_PROP(RECORD_BUFFER_NODE, size)
+static uint8_t record_buffer_mem[RECORD_BUFFER_SIZE] __aligned(4) __noinit;
+#endif
+BUILD_ASSERT(CONFIG_RECORD_WRITE_BEHIND_BURST_SIZE < RECORD_BUFFER_SIZE,
+             "Write-behind burst size must be smaller than the buffer");
+#endif
+
+#if IS_ENABLED(CONFIG_RECORD_CALIBRATION)
+#define RECORD_CALIBRATION_FILE RECORD_FILE_DIR "/calib.tmp"
+#define RECORD_CALIBRATION_CHUNK_SIZE 8192
+/// Maximum share of the measured throughput that recording may use (%), since
+/// the card slows down as it fills and the FAT also has to be written
+#define RECORD_CALIBRATION_MAX_LOAD_PCT 75
+/// Calibrated bursts take about this long to write, which amortizes the per
+/// command overhead without holding the card for too long
+#define RECORD_CALIBRATION_BURST_MS 100
+#define RECORD_CALIBRATION_BURST_MIN (32 * 1024)
+/// The buffer must be able to absorb stalls this many times longer than the
+/// worst one measured, since the calibration is short
+#define RECORD_CALIBRATION_STALL_FACTOR 4
+
+static uint8_t record_calibration_buf[RECORD_CALIBRATION_CHUNK_SIZE]
+    __aligned(4);
+#endif
+
+/// Saved with each new file, so that the next file index can be found without
+/// scanning the card.
+struct record_saved_index {
+    /// FAT volume serial number of the card the index applies to
+    uint32_t volume_id;
+    uint32_t next_index;
+    uint32_t session_index;
+    bool has_session;
+};
+
+/// Counters reported for each file in the session manifest
+struct record_file_counters {
+    uint32_t gaps;
+    uint32_t gap_frames;
+    uint32_t overruns;
+    uint32_t i2s_overruns;
+    uint32_t timestamp_errors;
+    uint32_t sync_outliers;
+    uint32_t sync_resets;
+};
+
+/// Open file, allocated from the file pool so that switching files is just a
+/// pointer swap and closing can happen in the background.
+struct record_file {
+    struct wav wav;
+    char name[RECORD_FILE_NAME_LEN];
+    struct wav_format format;
+    uint32_t index;
+    /// Central time of the first sample
+    uint32_t start_time;
+    /// Counter values when the file became the current file, replaced by the
+    /// change over the file when it is closed
+    struct record_file_counters counters;
+};
+
+enum record_file_op_type {
+    /// Close the file and return it to the pool
+    RECORD_FILE_CLOSE,
+    /// Open the file, and make it the next file once it is ready
+    RECORD_FILE_OPEN_NEXT,
+    /// Close and delete the next file, which is no longer needed
+    RECORD_FILE_DISCARD_NEXT,
+    /// Measure the speed of the inserted card
+    RECORD_FILE_CALIBRATE,
+    /// Signal that all earlier requests have finished
+    RECORD_FILE_FLUSH,
+};
+
+/// Request for the file thread
+struct record_file_op {
+    enum record_file_op_type type;
+    struct record_file *file;
+};
+
 enum record_state {
     RECORD_STOPPED,
     RECORD_WAITING_START,
     RECORD_WAITING_NEW_FILE,
     RECORD_RUNNING,
+    /// Recording until the stop time, then the file is closed at the exact
+    /// frame.
+    RECORD_WAITING_STOP,
+    /// Stop requested, but there is still buffered audio to write before the
+    /// file can be closed.
+    RECORD_STOPPING,
 };
 
 K_MUTEX_DEFINE(record_mutex);
 
-K_THREAD_STACK_DEFINE(record_close_thread_stack, 1024);
-K_MSGQ_DEFINE(record_close_queue, sizeof(struct wav), 1, 1);
+K_THREAD_STACK_DEFINE(record_write_thread_stack, 2048);
+K_MSGQ_DEFINE(record_block_queue, sizeof(struct audio_block),
+              RECORD_BLOCK_QUEUE_LEN, 4);
+K_SEM_DEFINE(record_write_sem, 0, 1);
+K_SEM_DEFINE(record_stopped_sem, 0, 1);
+
+K_THREAD_STACK_DEFINE(record_file_thread_stack, 1024);
+K_SEM_DEFINE(record_file_flushed_sem, 0, 1);
+K_MEM_SLAB_DEFINE_STATIC(record_file_slab, sizeof(struct record_file),
+                         RECORD_FILE_POOL_SIZE, 4);
+// Each file can have at most one close and one open request pending, along
+// with one calibration and one flush
+K_MSGQ_DEFINE(record_file_queue, sizeof(struct record_file_op),
+              RECORD_FILE_POOL_SIZE * 2 + 2, 4);
+
+/// Written in place of audio that was lost
+static const uint8_t record_silence[1024];
+
+static int record_submit(const struct audio_block *block);
+
+static struct audio_consumer record_consumer = {
+    .submit = record_submit,
+};
 
 static const struct record_config {
     struct k_mutex *mutex;
-    struct k_msgq *close_queue;
+    struct k_msgq *block_queue;
+    /// Signalled when the writer thread should start a burst of writes
+    struct k_sem *write_sem;
+    /// Signalled when a stopping recording has been completely written
+    struct k_sem *stopped_sem;
+    struct k_mem_slab *file_slab;
+    /// Requests for the file thread
+    struct k_msgq *file_queue;
+    /// Signalled when the file thread reaches a flush request
+    struct k_sem *file_flushed_sem;
 } record_config = {
     .mutex = &record_mutex,
-    .close_queue = &record_close_queue,
+    .block_queue = &record_block_queue,
+    .write_sem = &record_write_sem,
+    .stopped_sem = &record_stopped_sem,
+    .file_slab = &record_file_slab,
+    .file_queue = &record_file_queue,
+    .file_flushed_sem = &record_file_flushed_sem,
 };
 
 static struct record_data {
-    struct k_thread close_thread;
+    struct k_thread write_thread;
+    /// Opens and closes files in the background
+    struct k_thread file_thread;
+
+    /// Maximum number of blocks waiting in the block queue. Only written by the
+    /// audio thread.
+    atomic_t queue_high_water;
+    /// Central time at the end of the newest block handed to the writer
+    /// thread. Only written by the audio thread.
+    atomic_t newest_block_end;
+    /// Number of blocks dropped because the block queue was full
+    atomic_t queue_overruns;
+    /// Number of blocks recorded as silence because the ADC had not settled
+    uint32_t settling_blocks;
+    /// Number of gaps in the block timestamps
+    uint32_t gaps;
+    /// Number of frames of silence written to fill gaps
+    uint32_t gap_frames;
+    /// Number of times the file size limit was reached
+    uint32_t rollovers;
+    /// Number of rollovers where the next file was not ready in time
+    uint32_t rollover_sync_opens;
+    /// Longest time taken to switch files at the size limit (us)
+    uint32_t rollover_max_us;
+    /// Latency of wav_write() calls in the current or last session
+    struct latency_hist write_latency;
+    /// Latency of wav_sync() calls in the current or last session
+    struct latency_hist sync_latency;
+    /// Uptime when the current or last session started (ms)
+    int64_t session_start_ms;
+    /// Value of queue_overruns when the session started
+    uint32_t session_start_overruns;
+    /// Value of gaps when the session started
+    uint32_t session_start_gaps;
+    /// Position of the first sample of the session on the shared timeline, in
+    /// samples since the central time was zero. Every recorder in the session
+    /// starts from the same central time, so their files line up.
+    uint64_t session_time_reference;
+    /// Frames of the session timeline covered by files that have already been
+    /// closed, along with silence that was lost when a file filled up
+    uint64_t session_frames;
+    /// Measured speed of the inserted card
+    struct record_calibration calibration;
+    /// The file thread is calibrating the card, so recording can't start
+    bool calibrating;
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    /// Write-behind buffer. Each record holds a struct audio_block followed by
+    /// the block data.
+    struct block_ring ring;
+    /// Amount of buffered data that wakes up the writer thread, either from
+    /// the configuration or chosen by calibration
+    uint32_t burst_size;
+#endif
 
     bool init;
+    /// Audio module is initialized, so the ADC can be powered on
+    bool audio_ready;
+    /// Amount of audio to keep buffered while stopped (ms), so that a start
+    /// time in the past can still begin at the exact sample. Zero disables
+    /// pre-roll.
+    uint32_t preroll_ms;
     char file_name_prefix[RECORD_FILE_NAME_PREFIX_LEN];
-    /// Current open file
-    struct wav file;
+    /// Powers on the ADC ahead of the start time
+    struct k_work_delayable prewarm_work;
+    /// Current open file, or NULL. Only used by the writer thread.
+    struct record_file *file;
+    /// File opened in the background to continue the recording once the
+    /// current file is full. Set by the file thread once it is ready.
+    atomic_ptr_t next_file;
+    /// A next file has been requested and not yet used or discarded
+    bool next_file_requested;
     /// Next unused file index
     uint32_t file_index;
+    /// Index of the first file in the current session, which names the session
+    /// directory
+    uint32_t session_index;
+    bool has_session;
+    /// FAT volume serial number of the inserted card
+    uint32_t volume_id;
+    bool volume_id_valid;
+    /// Next file index saved for the last card that was used
+    struct record_saved_index saved_index;
+    bool saved_index_valid;
     enum record_state state;
     uint32_t start_time;
+    uint32_t stop_time;
+    /// Central time at the end of the last block processed by record_buffer(),
+    /// used to detect lost blocks.
+    uint32_t next_block_time;
+    bool next_block_time_valid;
+    /// A start command arrived while waiting to stop. The next recording begins
+    /// at start_time once the current one has stopped.
+    bool start_pending;
     // Last time the WAV file size was updated (ms)
     int64_t last_sync_time_ms;
 } record_data = {
@@ -59,101 +337,1097 @@ static struct record_data {
     .state = RECORD_STOPPED,
 };
 
-static void record_close_thread_run(void *p1, void *p2, void *p3) {
+static void record_file_op_open_next(struct record_file *file) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    LOG_INF("creating next file: %s", file->name);
+    int err = wav_open(&file->wav, file->name, &file->format);
+    if (err < 0) {
+        LOG_ERR("failed to create file: %s (err %d)", file->name, err);
+        k_mem_slab_free(config->file_slab, file);
+        return;
+    }
+    atomic_ptr_set(&data->next_file, file);
+}
+
+static void record_file_op_discard_next(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    struct record_file *file = atomic_ptr_clear(&data->next_file);
+    // Opening might have failed
+    if (!file) return;
+
+    LOG_INF("discarding unused file: %s", file->name);
+    int err = wav_close_no_update(&file->wav);
+    if (err < 0) {
+        LOG_WRN("failed to close file (err %d)", err);
+    }
+    err = fs_unlink(file->name);
+    if (err < 0) {
+        LOG_WRN("failed to delete file: %s (err %d)", file->name, err);
+    }
+    k_mem_slab_free(config->file_slab, file);
+}
+
+/// Write the CRC of a closed file's audio data to its sidecar, so that the host
+/// can verify a download without reading the file again. The line has the same
+/// form as an FTP HASH reply: algorithm, inclusive byte range and hash.
+static void record_write_hash(const struct record_file *file) {
+    char path[RECORD_HASH_PATH_LEN];
+    int ret = snprintf(path, sizeof(path), "%s" RECORD_HASH_SUFFIX, file->name);
+    if (ret < 0 || ret >= sizeof(path)) return;
+
+    char line[64];
+    uint64_t data_size = file->wav.data_size;
+    int len = snprintf(line, sizeof(line),
+                       "CRC32C %" PRIu32 "-%" PRIu64 " %08" PRIx32 "\n",
+                       (uint32_t)WAV_DATA_OFFSET,
+                       WAV_DATA_OFFSET + data_size - 1, file->wav.crc);
+    if (len < 0 || len >= sizeof(line)) return;
+
+    struct fs_file_t fp;
+    fs_file_t_init(&fp);
+    ret = fs_open(&fp, path, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+    if (ret < 0) {
+        LOG_WRN("failed to create hash file: %s (err %d)", path, ret);
+        return;
+    }
+    ret = fs_write(&fp, line, len);
+    int ret_close = fs_close(&fp);
+    if (ret >= 0) ret = ret_close;
+    if (ret < 0) {
+        LOG_WRN("failed to write hash file (err %d)", ret);
+    }
+}
+
+/// Append a line for a closed file to the manifest in its session directory,
+/// creating the manifest with a header line if needed.
+static void record_append_manifest(const struct record_file *file) {
+    char path[RECORD_MANIFEST_PATH_LEN];
+    const char *dir_end = strrchr(file->name, '/');
+    int dir_len = dir_end ? dir_end - file->name : 0;
+    int ret = snprintf(path, sizeof(path), "%.*s/" RECORD_MANIFEST_FILE_NAME,
+                       dir_len, file->name);
+    if (ret < 0 || ret >= sizeof(path)) return;
+
+    char crc[9] = "";
+    if (file->format.crc) {
+        snprintf(crc, sizeof(crc), "%08" PRIx32, file->wav.crc);
+    }
+    const struct record_file_counters *c = &file->counters;
+    char line[192];
+    int len = snprintf(
+        line, sizeof(line),
+        "%" PRIu32 ",%" PRIu32 ",%" PRIu64 ",%" PRIu32 ",%" PRIu16 ",%" PRIu16
+        ",%" PRIu64 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32
+        ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%s\n",
+        file->index, file->start_time, file->format.time_reference,
+        file->format.sample_rate, file->format.channels,
+        file->format.bits_per_sample,
+        file->wav.data_size / file->wav.bytes_per_frame, c->gaps,
+        c->gap_frames, c->overruns, c->i2s_overruns, c->timestamp_errors,
+        c->sync_outliers, c->sync_resets, crc);
+    if (len < 0 || len >= sizeof(line)) return;
+
+    struct fs_file_t fp;
+    fs_file_t_init(&fp);
+    ret = fs_open(&fp, path, FS_O_WRITE | FS_O_CREATE | FS_O_APPEND);
+    if (ret < 0) {
+        LOG_WRN("failed to open manifest: %s (err %d)", path, ret);
+        return;
+    }
+    ret = fs_seek(&fp, 0, FS_SEEK_END);
+    if (ret >= 0 && fs_tell(&fp) == 0) {
+        ret = fs_write(&fp, RECORD_MANIFEST_HEADER,
+                       sizeof(RECORD_MANIFEST_HEADER) - 1);
+    }
+    if (ret >= 0) ret = fs_write(&fp, line, len);
+    int ret_close = fs_close(&fp);
+    if (ret >= 0) ret = ret_close;
+    if (ret < 0) {
+        LOG_WRN("failed to append to manifest (err %d)", ret);
+    }
+}
+
+#if IS_ENABLED(CONFIG_RECORD_CALIBRATION)
+static void record_file_op_calibrate(void);
+#endif
+
+/// Close a file, write its hash and add it to the manifest, then free it. Runs
+/// on the file thread, or on the writer thread if the file queue is full.
+static void record_finish_file(struct record_file *file) {
+    const struct record_config *config = &record_config;
+
+    int err = wav_close(&file->wav);
+    if (err < 0) {
+        LOG_WRN("failed to close file (err %d)", err);
+    } else if (file->format.crc) {
+        record_write_hash(file);
+    }
+    record_append_manifest(file);
+    k_mem_slab_free(config->file_slab, file);
+}
+
+static void record_file_thread_run(void *p1, void *p2, void *p3) {
     const struct record_config *config = &record_config;
     int err;
 
     while (true) {
-        struct wav file;
-        err = k_msgq_get(config->close_queue, &file, K_FOREVER);
+        struct record_file_op op;
+        err = k_msgq_get(config->file_queue, &op, K_FOREVER);
         if (err < 0) {
             LOG_WRN("failed to get queue item  (err %d)", err);
             continue;
         }
 
-        err = wav_close(&file);
+        switch (op.type) {
+            case RECORD_FILE_CLOSE:
+                record_finish_file(op.file);
+                break;
+            case RECORD_FILE_OPEN_NEXT:
+                record_file_op_open_next(op.file);
+                break;
+            case RECORD_FILE_DISCARD_NEXT:
+                record_file_op_discard_next();
+                break;
+            case RECORD_FILE_CALIBRATE:
+#if IS_ENABLED(CONFIG_RECORD_CALIBRATION)
+                record_file_op_calibrate();
+#endif
+                break;
+            case RECORD_FILE_FLUSH:
+                k_sem_give(config->file_flushed_sem);
+                break;
+        }
+    }
+}
+
+static int record_buffer(const struct audio_block *block);
+static void record_close_file(void);
+static void record_discard_next_file(void);
+static void record_write_session_summary(void);
+static void record_update_idle_power(void);
+static void record_prewarm_work_handler(struct k_work *work);
+
+/// Wake up the writer thread to write any buffered audio immediately
+static void record_write_kick(void) {
+    const struct record_config *config = &record_config;
+
+    k_sem_give(config->write_sem);
+}
+
+/// Enter the stopped state. The ADC may be powered off or reconfigured before
+/// the next recording, so the end of the last block says nothing about audio
+/// lost before the next one.
+static void record_set_stopped(void) {
+    struct record_data *data = &record_data;
+
+    data->state = RECORD_STOPPED;
+    data->next_block_time_valid = false;
+}
+
+/// Called by the writer thread each time it has written all queued blocks.
+static void record_write_drained(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (data->state == RECORD_STOPPING) {
+        record_close_file();
+        record_discard_next_file();
+        record_write_session_summary();
+        record_set_stopped();
+        // Pre-roll might have been disabled while stopping
+        record_update_idle_power();
+        k_sem_give(config->stopped_sem);
+    }
+}
+
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+/// Check whether a block should stay in the write-behind buffer as pre-roll.
+/// While stopped, the most recent pre-roll period of audio is kept instead of
+/// being discarded.
+static bool record_preroll_keep(const struct audio_block *block) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (data->state != RECORD_STOPPED || data->preroll_ms == 0) return false;
+
+    uint32_t newest_end = atomic_get(&data->newest_block_end);
+    uint32_t age = newest_end - (block->start_time + block->duration);
+    return age < (uint64_t)data->preroll_ms * ZEUS_TIME_NOMINAL_FREQ / 1000;
+}
+
+static void record_write_thread_run(void *p1, void *p2, void *p3) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    while (true) {
+        // Wait for a full burst to accumulate so that the card can idle between
+        // bursts, but don't let data sit in the buffer forever.
+        k_sem_take(config->write_sem,
+                   K_MSEC(CONFIG_RECORD_WRITE_BEHIND_MAX_DELAY_MS));
+
+        struct audio_block *block;
+        size_t len;
+        while ((block = block_ring_peek(&data->ring, &len))) {
+            // Blocks are kept in order, so all newer blocks are also pre-roll
+            if (record_preroll_keep(block)) break;
+
+            // Errors are logged and cause the recording to stop, so there is
+            // nothing else to do with them here.
+            record_buffer(block);
+            block_ring_release(&data->ring);
+        }
+
+        record_write_drained();
+    }
+}
+#else
+static void record_write_thread_run(void *p1, void *p2, void *p3) {
+    const struct record_config *config = &record_config;
+    int err;
+
+    while (true) {
+        struct audio_block block;
+        err = k_msgq_get(config->block_queue, &block, K_FOREVER);
         if (err < 0) {
-            LOG_WRN("failed to close file (err %d)", err);
+            LOG_WRN("failed to get queue item (err %d)", err);
+            continue;
+        }
+
+        // Errors are logged and cause the recording to stop, so there is
+        // nothing else to do with them here.
+        record_buffer(&block);
+        audio_block_free(&block);
+
+        if (k_msgq_num_used_get(config->block_queue) == 0) {
+            record_write_drained();
         }
     }
 }
+#endif
 
-static int record_find_next_file_index(void) {
+/// Format the path of the session directory whose first file has the specified
+/// index.
+static int record_session_dir(char *path, size_t len, uint32_t index) {
     struct record_data *data = &record_data;
+
+    int ret = snprintf(path, len, RECORD_FILE_DIR "/%s_%04" PRIu32,
+                       data->file_name_prefix, index);
+    if (ret < 0) {
+        return ret;
+    } else if (ret >= len) {
+        return -EOVERFLOW;
+    }
+    return 0;
+}
+
+/// Parse a file or directory name of the form <prefix>_<index><suffix>. Return
+/// -EINVAL if the name doesn't match.
+static int record_parse_file_index(const char *name, const char *suffix,
+                                   uint32_t *index) {
+    struct record_data *data = &record_data;
+
+    const size_t name_len = strlen(name);
+    const size_t name_prefix_len = strlen(data->file_name_prefix);
+    // Prefix + underscore
+    if (name_len < name_prefix_len + 1) {
+        // Too short
+        return -EINVAL;
+    }
+    if (memcmp(name, data->file_name_prefix, name_prefix_len) != 0) {
+        // Prefix didn't match
+        return -EINVAL;
+    }
+    if (name[name_prefix_len] != '_') {
+        // No underscore after prefix
+        return -EINVAL;
+    }
+
+    const char *index_start = name + name_prefix_len + 1 /* underscore */;
+    char *suffix_start;
+    BUILD_ASSERT(sizeof(unsigned long) == sizeof(uint32_t),
+                 "Cannot use strtoul() to parse uint32_t");
+    *index = strtoul(index_start, &suffix_start, 10);
+    if (suffix_start == index_start) {
+        // Did not parse any number
+        return -EINVAL;
+    }
+    if (strcmp(suffix_start, suffix) != 0) {
+        // Suffix didn't match
+        return -EINVAL;
+    }
+    if (*index == ULONG_MAX) {
+        // Index out of range, no available next index
+        return -ERANGE;
+    }
+
+    return 0;
+}
+
+/// Scan a directory for recordings and session directories, updating the next
+/// unused file index and the index of the last session. session may be NULL to
+/// ignore session directories.
+static int record_scan_dir(const char *path, uint32_t *next_index,
+                           uint32_t *session, bool *has_session) {
     struct fs_dir_t dir;
     int ret;
     fs_dir_t_init(&dir);
-    ret = fs_opendir(&dir, RECORD_FILE_DIR);
+    ret = fs_opendir(&dir, path);
     if (ret) return ret;
 
-    data->file_index = 0;
-
     while (true) {
         struct fs_dirent entry;
         ret = fs_readdir(&dir, &entry);
         if (ret < 0) goto exit;
 
-        size_t name_len = strlen(entry.name);
-        if (name_len == 0) break;
+        if (entry.name[0] == '\0') break;
 
-        const size_t name_prefix_len = strlen(data->file_name_prefix);
-        // Prefix + underscore
-        if (name_len < name_prefix_len + 1) {
-            // Too short
-            continue;
-        }
-        if (memcmp(entry.name, data->file_name_prefix, name_prefix_len) != 0) {
-            // Prefix didn't match
-            continue;
-        }
-        if (entry.name[name_prefix_len] != '_') {
-            // No underscore after prefix
-            continue;
+        uint32_t index;
+        if (entry.type == FS_DIR_ENTRY_DIR) {
+            if (!session) continue;
+            ret = record_parse_file_index(entry.name, "", &index);
+            if (ret == -EINVAL) continue;
+            if (ret < 0) goto exit;
+
+            if (!*has_session || index > *session) {
+                *session = index;
+                *has_session = true;
+            }
+            index++;
+        } else {
+            ret = record_parse_file_index(entry.name, ".wav", &index);
+            if (ret == -EINVAL) continue;
+            if (ret < 0) goto exit;
+
+            // +1 to record the next free index
+            index++;
         }
 
-        const char *index_start =
-            entry.name + name_prefix_len + 1 /* underscore */;
-        char *suffix_start;
-        BUILD_ASSERT(sizeof(unsigned long) == sizeof(uint32_t),
-                     "Cannot use strtoul() to parse uint32_t");
-        uint32_t file_index = strtoul(index_start, &suffix_start, 10);
-        if (suffix_start == index_start) {
-            // Did not parse any number
-            continue;
+        if (index > *next_index) {
+            *next_index = index;
         }
-        if (file_index == ULONG_MAX) {
-            // Index out of range, no available next index
-            ret = -ERANGE;
-            goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    fs_closedir(&dir);
+    return ret;
+}
+
+/// Find the next file index by scanning the card. Only the root and the last
+/// session directory are scanned, because file indices always increase.
+static int record_scan_file_index(void) {
+    struct record_data *data = &record_data;
+    int ret;
+
+    uint32_t next_index = 0;
+    uint32_t session = 0;
+    bool has_session = false;
+    ret = record_scan_dir(RECORD_FILE_DIR, &next_index, &session, &has_session);
+    if (ret) return ret;
+
+    if (has_session) {
+        char path[RECORD_SESSION_DIR_LEN];
+        ret = record_session_dir(path, sizeof(path), session);
+        if (ret) return ret;
+        ret = record_scan_dir(path, &next_index, NULL, NULL);
+        if (ret) return ret;
+    }
+
+    data->file_index = next_index;
+    data->session_index = session;
+    data->has_session = has_session;
+    return 0;
+}
+
+/// Check whether the saved index can be used without scanning the card. It
+/// must have been saved for this card, and the next session directory must not
+/// already exist.
+static bool record_saved_index_valid(void) {
+    struct record_data *data = &record_data;
+    int ret;
+
+    if (!data->saved_index_valid || !data->volume_id_valid) return false;
+    if (data->saved_index.volume_id != data->volume_id) return false;
+
+    char path[RECORD_SESSION_DIR_LEN];
+    ret = record_session_dir(path, sizeof(path), data->saved_index.next_index);
+    if (ret) return false;
+    struct fs_dirent entry;
+    ret = fs_stat(path, &entry);
+    if (ret != -ENOENT) return false;
+
+    return true;
+}
+
+/// Save the next file index, so that the card doesn't need to be scanned the
+/// next time it is inserted.
+static void record_save_file_index(void) {
+    struct record_data *data = &record_data;
+    int ret;
+
+    // Without a volume ID the saved index can't be trusted anyway
+    if (!data->volume_id_valid) return;
+
+    data->saved_index = (struct record_saved_index){
+        .volume_id = data->volume_id,
+        .next_index = data->file_index,
+        .session_index = data->session_index,
+        .has_session = data->has_session,
+    };
+    data->saved_index_valid = true;
+
+    ret = settings_save_one("rec/index", &data->saved_index,
+                            sizeof(data->saved_index));
+    if (ret) {
+        LOG_WRN("failed to save file index (err %d)", ret);
+    }
+}
+
+/// Find the next unused file index, using the saved index if it is valid for
+/// this card, and scanning the card otherwise.
+static int record_find_next_file_index(void) {
+    struct record_data *data = &record_data;
+    int ret;
+
+    uint32_t volume_id;
+    ret = sd_card_get_volume_id(&volume_id);
+    data->volume_id = volume_id;
+    data->volume_id_valid = ret == 0;
+
+    if (record_saved_index_valid()) {
+        data->file_index = data->saved_index.next_index;
+        data->session_index = data->saved_index.session_index;
+        data->has_session = data->saved_index.has_session;
+        return 0;
+    }
+
+    LOG_INF("scanning card for next file index");
+    ret = record_scan_file_index();
+    if (ret) return ret;
+
+    record_save_file_index();
+    return 0;
+}
+
+/// Format the path of a file in the current session.
+static int record_file_name(char *name, size_t len, uint32_t index) {
+    struct record_data *data = &record_data;
+
+    char session_dir[RECORD_SESSION_DIR_LEN];
+    int ret = record_session_dir(session_dir, sizeof(session_dir),
+                                 data->session_index);
+    if (ret) return ret;
+
+    ret = snprintf(name, len, "%s/%s_%04" PRIu32 ".wav", session_dir,
+                   data->file_name_prefix, index);
+    if (ret < 0) {
+        return ret;
+    } else if (ret >= len) {
+        return -EOVERFLOW;
+    }
+    return 0;
+}
+
+/// Central time of the sample at offset in a block.
+static uint32_t record_split_time(const struct audio_block *block,
+                                  size_t offset) {
+    return block->start_time + (uint64_t)offset * block->duration / block->len;
+}
+
+/// Read the current values of the counters reported in the manifest.
+static void record_get_file_counters(struct record_file_counters *c) {
+    struct record_data *data = &record_data;
+
+    struct audio_stats audio_stats = {0};
+    (void)audio_get_stats(&audio_stats);
+    *c = (struct record_file_counters){
+        .gaps = data->gaps,
+        .gap_frames = data->gap_frames,
+        .overruns = atomic_get(&data->queue_overruns),
+        .i2s_overruns = audio_stats.i2s_overruns,
+        .timestamp_errors = audio_stats.timestamp_errors,
+        .sync_outliers = audio_stats.sync_outliers,
+        .sync_resets = audio_stats.sync_resets,
+    };
+}
+
+/// Note where the current file starts, once its first block is known.
+static void record_file_started(const struct audio_block *block,
+                                size_t split_offset) {
+    struct record_data *data = &record_data;
+
+    data->file->start_time = record_split_time(block, split_offset);
+    record_get_file_counters(&data->file->counters);
+}
+
+/// Fill in the format of a file whose first sample is session_frames into the
+/// session.
+static void record_file_format(struct wav_format *format,
+                               const struct audio_block *block,
+                               uint64_t session_frames) {
+    struct record_data *data = &record_data;
+
+    *format = (struct wav_format){
+        .channels = block->format.channels,
+        .sample_rate = block->format.sample_rate,
+        .bits_per_sample = block->format.bits_per_sample,
+        .max_file_size = RECORD_FILE_MAX_SIZE,
+        .prealloc_size = CONFIG_RECORD_PREALLOC_SIZE_MB * 1024 * 1024,
+        .crc = IS_ENABLED(CONFIG_RECORD_HASH),
+        .time_reference = data->session_time_reference + session_frames,
+    };
+    // Named like the session directory
+    snprintf(format->tape, sizeof(format->tape), "%s_%04" PRIu32,
+             data->file_name_prefix, data->session_index);
+}
+
+/// Tell the disk where the data of the current file will be written, so that
+/// it can be written as one sequential stream.
+static void record_stream_hint(void) {
+    struct record_data *data = &record_data;
+
+    uint32_t start_sector, num_sector;
+    int ret =
+        wav_get_data_sectors(&data->file->wav, &start_sector, &num_sector);
+    if (ret) return;
+    ret = sd_card_stream_hint(start_sector, num_sector);
+    if (ret && ret != -ENOTSUP) {
+        LOG_WRN("failed to send stream hint (err %d)", ret);
+    }
+}
+
+/// Open a new file synchronously and make it the current file, optionally
+/// starting a new session directory. The file starts at split_offset in the
+/// block.
+static int record_open_file(const struct audio_block *block,
+                            size_t split_offset, bool new_session) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+    struct record_file *file;
+    int ret;
+
+    if (new_session) {
+        data->session_index = data->file_index;
+        data->has_session = true;
+        data->write_latency = (struct latency_hist){0};
+        data->sync_latency = (struct latency_hist){0};
+        data->session_start_ms = k_uptime_get();
+        data->session_start_overruns = atomic_get(&data->queue_overruns);
+        data->session_start_gaps = data->gaps;
+        uint32_t first_sample_time = record_split_time(block, split_offset);
+        data->session_time_reference = (uint64_t)first_sample_time *
+                                       block->format.sample_rate /
+                                       ZEUS_TIME_NOMINAL_FREQ;
+        data->session_frames = 0;
+
+        char session_dir[RECORD_SESSION_DIR_LEN];
+        ret = record_session_dir(session_dir, sizeof(session_dir),
+                                 data->session_index);
+        if (ret) return ret;
+        ret = fs_mkdir(session_dir);
+        if (ret && ret != -EEXIST) {
+            LOG_ERR("failed to create directory: %s (err %d)", session_dir,
+                    ret);
+            return ret;
         }
+    }
+
+    // Only blocks if several files are still being closed
+    ret = k_mem_slab_alloc(config->file_slab, (void **)&file,
+                           K_MSEC(RECORD_FILE_ALLOC_TIMEOUT_MS));
+    if (ret) {
+        LOG_ERR("no file available (err %d)", ret);
+        return ret;
+    }
+
+    file->index = data->file_index;
+    ret = record_file_name(file->name, sizeof(file->name), data->file_index);
+    if (ret) goto error;
+
+    LOG_INF("creating new file: %s", file->name);
+
+    record_file_format(&file->format, block, data->session_frames);
+    ret = wav_open(&file->wav, file->name, &file->format);
+    if (ret) {
+        LOG_ERR("failed to create file: %s (err %d)", file->name, ret);
+        goto error;
+    }
+    data->file_index++;
+    record_save_file_index();
+
+    data->file = file;
+    record_stream_hint();
+    return 0;
+
+error:
+    k_mem_slab_free(config->file_slab, file);
+    return ret;
+}
+
+/// Ask the file thread to open the next file in the background once the
+/// current file is nearly full.
+static void record_request_next_file(const struct audio_block *block) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+    struct record_file *file;
+    int ret;
+
+    if (data->next_file_requested || !data->file) return;
+    const struct wav *w = &data->file->wav;
+    if (w->max_data_size - w->data_size > RECORD_NEXT_FILE_MARGIN) return;
+
+    // Try again with the next block if the pool is busy
+    ret = k_mem_slab_alloc(config->file_slab, (void **)&file, K_NO_WAIT);
+    if (ret) return;
+
+    file->index = data->file_index;
+    ret = record_file_name(file->name, sizeof(file->name), data->file_index);
+    if (ret) goto error;
+    // The current file will be split exactly when it is full
+    record_file_format(&file->format, block,
+                       data->session_frames +
+                           w->max_data_size / w->bytes_per_frame);
+
+    ret = k_msgq_put(config->file_queue,
+                     &(struct record_file_op){
+                         .type = RECORD_FILE_OPEN_NEXT,
+                         .file = file,
+                     },
+                     K_NO_WAIT);
+    if (ret) goto error;
+
+    // The index is used even if opening fails
+    data->file_index++;
+    record_save_file_index();
+    data->next_file_requested = true;
+    return;
+
+error:
+    LOG_WRN("failed to request next file (err %d)", ret);
+    k_mem_slab_free(config->file_slab, file);
+}
+
+/// Discard the next file if one was requested, because the session ended.
+static void record_discard_next_file(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    if (!data->next_file_requested) return;
+    data->next_file_requested = false;
+
+    int err = k_msgq_put(config->file_queue,
+                         &(struct record_file_op){
+                             .type = RECORD_FILE_DISCARD_NEXT,
+                         },
+                         K_NO_WAIT);
+    if (err < 0) {
+        LOG_WRN("failed to discard next file (err %d)", err);
+    }
+}
+
+static void record_close_file(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    struct record_file *file = data->file;
+    if (!file) return;
+    data->file = NULL;
+    (void)sd_card_stream_hint(0, 0);
+    data->session_frames += file->wav.data_size / file->wav.bytes_per_frame;
+
+    struct record_file_counters end;
+    record_get_file_counters(&end);
+    struct record_file_counters *c = &file->counters;
+    c->gaps = end.gaps - c->gaps;
+    c->gap_frames = end.gap_frames - c->gap_frames;
+    c->overruns = end.overruns - c->overruns;
+    c->i2s_overruns = end.i2s_overruns - c->i2s_overruns;
+    c->timestamp_errors = end.timestamp_errors - c->timestamp_errors;
+    c->sync_outliers = end.sync_outliers - c->sync_outliers;
+    c->sync_resets = end.sync_resets - c->sync_resets;
+
+    int err = k_msgq_put(config->file_queue,
+                         &(struct record_file_op){
+                             .type = RECORD_FILE_CLOSE,
+                             .file = file,
+                         },
+                         K_NO_WAIT);
+    if (err < 0) {
+        LOG_WRN("Could not close file in background (err %d)", err);
+        record_finish_file(file);
+    }
+}
+
+/// Append one latency histogram to the session summary.
+static int record_format_latency(char *buf, size_t len, const char *name,
+                                 const struct latency_hist *h) {
+    int ret = snprintf(
+        buf, len,
+        "%s: %" PRIu32 " ops, %" PRIu64 " KiB, avg %" PRIu64 " us, max %" PRIu32
+        " us at %" PRId64 " ms, %" PRIu32 " KiB/s\n%s_hist:",
+        name, h->count, h->bytes / 1024, h->count ? h->total_us / h->count : 0,
+        h->max_us, h->max_uptime_ms, latency_hist_kib_per_s(h), name);
+    if (ret < 0 || ret >= len) return ret;
+
+    int hist_len = latency_hist_format(h, buf + ret, len - ret);
+    if (hist_len < 0) return hist_len;
+    ret += hist_len;
+    if (ret >= len) return ret;
+
+    return ret + snprintf(buf + ret, len - ret, "\n");
+}
+
+/// Save a summary of storage performance in the session directory when a
+/// session ends, so that slow cards can be identified from the recordings
+/// they made.
+static void record_write_session_summary(void) {
+    struct record_data *data = &record_data;
+    static char summary[768];
+    int ret;
+
+    if (!data->has_session) return;
+
+    char path[RECORD_SUMMARY_PATH_LEN];
+    ret = record_session_dir(path, sizeof(path), data->session_index);
+    if (ret) return;
+    strcat(path, "/" RECORD_SUMMARY_FILE_NAME);
+
+    int len = snprintf(
+        summary, sizeof(summary),
+        "volume_id: %08" PRIx32 "\nduration: %" PRId64
+        " ms\noverruns: %" PRIu32 "\ngaps: %" PRIu32 "\n",
+        data->volume_id_valid ? data->volume_id : 0,
+        k_uptime_get() - data->session_start_ms,
+        (uint32_t)atomic_get(&data->queue_overruns) -
+            data->session_start_overruns,
+        data->gaps - data->session_start_gaps);
+    if (len >= 0 && len < sizeof(summary)) {
+        ret = record_format_latency(summary + len, sizeof(summary) - len,
+                                    "write", &data->write_latency);
+        len = ret < 0 ? ret : len + ret;
+    }
+    if (len >= 0 && len < sizeof(summary)) {
+        ret = record_format_latency(summary + len, sizeof(summary) - len,
+                                    "sync", &data->sync_latency);
+        len = ret < 0 ? ret : len + ret;
+    }
+    if (len < 0 || len >= sizeof(summary)) {
+        LOG_WRN("session summary too long");
+        return;
+    }
+
+    struct fs_file_t fp;
+    fs_file_t_init(&fp);
+    ret = fs_open(&fp, path, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+    if (ret < 0) {
+        LOG_WRN("failed to create session summary: %s (err %d)", path, ret);
+        return;
+    }
+    ret = fs_write(&fp, summary, len);
+    int ret_close = fs_close(&fp);
+    if (ret >= 0) ret = ret_close;
+    if (ret < 0) {
+        LOG_WRN("failed to write session summary (err %d)", ret);
+    }
+}
+
+/// Repair any recordings in a directory that were not closed because of a power
+/// loss, so that they can be played. Only the WAV headers are read, so this is
+/// fast even for long recordings.
+static int record_recover_files(const char *path) {
+    struct fs_dir_t dir;
+    int ret;
+    fs_dir_t_init(&dir);
+    ret = fs_opendir(&dir, path);
+    if (ret) return ret;
+
+    while (true) {
+        struct fs_dirent entry;
+        ret = fs_readdir(&dir, &entry);
+        if (ret < 0) goto exit;
+
+        size_t name_len = strlen(entry.name);
+        if (name_len == 0) break;
 
-        if (strcmp(suffix_start, ".wav") != 0) {
+        if (entry.type != FS_DIR_ENTRY_FILE) continue;
+        if (name_len < 4 || strcmp(entry.name + name_len - 4, ".wav") != 0) {
             // Suffix didn't match
             continue;
         }
 
-        // +1 to record the next free index
-        if ((file_index + 1) > data->file_index) {
-            data->file_index = file_index + 1;
+        char file_name[RECORD_SESSION_DIR_LEN + sizeof(entry.name)];
+        snprintf(file_name, sizeof(file_name), "%s/%s", path, entry.name);
+
+        bool recovered;
+        int err = wav_recover(file_name, &recovered);
+        if (err < 0) {
+            // Not fatal, the file might not have been written by us
+            LOG_WRN("failed to check %s (err %d)", file_name, err);
+        } else if (recovered) {
+            LOG_INF("recovered unclosed file: %s", file_name);
+        }
+    }
+
+    ret = 0;
+
+exit:
+    fs_closedir(&dir);
+    return ret;
+}
+
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+/// Get the size of a pre-roll in the write-behind buffer with the current
+/// format, including the block headers stored with each block. No pre-roll is
+/// always known to be empty, even before the audio module is initialized.
+static int record_preroll_bytes(uint32_t preroll_ms, uint64_t *bytes) {
+    *bytes = 0;
+    if (preroll_ms == 0) return 0;
+
+    struct audio_format format;
+    int ret = audio_get_format(&format);
+    if (ret) return ret;
+    struct audio_block_config block_config;
+    ret = audio_get_block_config(&block_config);
+    if (ret) return ret;
+
+    // Whole blocks are kept while their end is within the pre-roll (see
+    // record_preroll_keep())
+    uint32_t block_frames = DIV_ROUND_UP(
+        (uint64_t)format.sample_rate * block_config.duration_ms, MSEC_PER_SEC);
+    size_t block_len =
+        block_frames * format.channels * format.bits_per_sample / 8;
+    uint32_t blocks = DIV_ROUND_UP(preroll_ms, block_config.duration_ms);
+    *bytes = (uint64_t)blocks *
+             block_ring_record_size(sizeof(struct audio_block) + block_len);
+    return 0;
+}
+
+/// Check that a pre-roll fits in the write-behind buffer alongside a full
+/// burst, otherwise the writer would never be woken before the buffer
+/// overflows. Return -ENOMEM if it doesn't fit.
+static int record_check_preroll(uint32_t preroll_ms, uint32_t burst_size) {
+    struct record_data *data = &record_data;
+
+    uint64_t preroll_bytes;
+    int ret = record_preroll_bytes(preroll_ms, &preroll_bytes);
+    if (ret) return ret;
+    if (preroll_bytes + burst_size > data->ring.size) return -ENOMEM;
+    return 0;
+}
+#endif
+
+#if IS_ENABLED(CONFIG_RECORD_CALIBRATION)
+/// Measure the sequential write throughput and worst case write latency of the
+/// card with a scratch file. This takes seconds, so it runs on the file thread
+/// without holding the mutex.
+static int record_calibrate_measure(uint32_t *throughput,
+                                    uint32_t *max_latency_us) {
+    const uint32_t size = CONFIG_RECORD_CALIBRATION_SIZE_KB * 1024;
+    int ret;
+
+    struct fs_file_t fp;
+    fs_file_t_init(&fp);
+    ret = fs_open(&fp, RECORD_CALIBRATION_FILE,
+                  FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+    if (ret < 0) return ret;
+
+    for (size_t i = 0; i < sizeof(record_calibration_buf); i++) {
+        record_calibration_buf[i] = i * 2654435761u >> 24;
+    }
+
+    uint32_t max_us = 0;
+    int64_t start_ms = k_uptime_get();
+    for (uint32_t written = 0; written < size;
+         written += RECORD_CALIBRATION_CHUNK_SIZE) {
+        uint32_t write_start = k_cycle_get_32();
+        ret = fs_write(&fp, record_calibration_buf,
+                       RECORD_CALIBRATION_CHUNK_SIZE);
+        max_us = MAX(max_us,
+                     k_cyc_to_us_floor32(k_cycle_get_32() - write_start));
+        if (ret < 0) break;
+    }
+    if (ret >= 0) {
+        // Include the time for the data to actually reach the card
+        uint32_t sync_start = k_cycle_get_32();
+        ret = fs_sync(&fp);
+        max_us = MAX(max_us,
+                     k_cyc_to_us_floor32(k_cycle_get_32() - sync_start));
+    }
+    int64_t elapsed_ms = MAX(k_uptime_get() - start_ms, 1);
+
+    int ret_close = fs_close(&fp);
+    if (ret >= 0) ret = ret_close;
+    int ret_unlink = fs_unlink(RECORD_CALIBRATION_FILE);
+    if (ret >= 0) ret = ret_unlink;
+    if (ret < 0) return ret;
+
+    *throughput = (uint64_t)size * MSEC_PER_SEC / elapsed_ms;
+    *max_latency_us = max_us;
+    return 0;
+}
+
+/// Calibrate the inserted card on the file thread, and choose the write-behind
+/// burst size to match.
+static void record_file_op_calibrate(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    uint32_t throughput;
+    uint32_t max_latency_us;
+    int ret = record_calibrate_measure(&throughput, &max_latency_us);
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    data->calibrating = false;
+    if (ret < 0) {
+        // Record anyway with the default configuration
+        LOG_WRN("card calibration failed (err %d)", ret);
+        return;
+    }
+
+    struct record_calibration *cal = &data->calibration;
+    cal->throughput = throughput;
+    cal->max_latency_us = max_latency_us;
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    uint32_t burst = (uint64_t)cal->throughput * RECORD_CALIBRATION_BURST_MS /
+                     MSEC_PER_SEC;
+    burst = ROUND_UP(MAX(burst, RECORD_CALIBRATION_BURST_MIN), 4096);
+    burst = MIN(burst, data->ring.size / 4);
+    // A larger burst could leave no room for the pre-roll, which was checked
+    // against the current burst size
+    if (record_check_preroll(data->preroll_ms, burst) == 0) {
+        data->burst_size = burst;
+    } else {
+        LOG_WRN("keeping burst size to make room for pre-roll");
+    }
+    cal->burst_size = data->burst_size;
+#endif
+    cal->valid = true;
+
+    LOG_INF("card calibration: %" PRIu32 " KiB/s, worst write %" PRIu32
+            " us, burst %" PRIu32 " KiB",
+            cal->throughput / 1024, cal->max_latency_us,
+            cal->burst_size / 1024);
+}
+
+/// Ask the file thread to calibrate the inserted card. Recording can't start
+/// until it has finished, so that the scratch file doesn't compete with it.
+static void record_request_calibration(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    if (data->calibrating) return;
+    data->calibration.valid = false;
+
+    int err = k_msgq_put(config->file_queue,
+                         &(struct record_file_op){
+                             .type = RECORD_FILE_CALIBRATE,
+                         },
+                         K_NO_WAIT);
+    if (err < 0) {
+        LOG_WRN("failed to request card calibration (err %d)", err);
+        return;
+    }
+    data->calibrating = true;
+}
+
+/// Check that the card can keep up with the current format, based on the
+/// calibration. Return -EIO if it is too slow, or -ENOBUFS if stalls would
+/// overflow the buffer.
+static int record_check_card(void) {
+    struct record_data *data = &record_data;
+    const struct record_calibration *cal = &data->calibration;
+    int ret;
+
+    if (!cal->valid) return 0;
+
+    struct audio_format format;
+    ret = audio_get_format(&format);
+    if (ret) return ret;
+    uint32_t rate =
+        format.sample_rate * format.channels * format.bits_per_sample / 8;
+
+    if ((uint64_t)rate * 100 >
+        (uint64_t)cal->throughput * RECORD_CALIBRATION_MAX_LOAD_PCT) {
+        LOG_ERR("SD card too slow for %u channels at %" PRIu32
+                " Hz: needs %" PRIu32 " KiB/s, measured %" PRIu32 " KiB/s",
+                format.channels, format.sample_rate, rate / 1024,
+                cal->throughput / 1024);
+        return -EIO;
+    }
+
+    uint64_t stall_bytes = (uint64_t)rate * cal->max_latency_us *
+                           RECORD_CALIBRATION_STALL_FACTOR / USEC_PER_SEC;
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    uint64_t preroll_bytes;
+    ret = record_preroll_bytes(data->preroll_ms, &preroll_bytes);
+    if (ret) return ret;
+    uint64_t reserved = preroll_bytes + data->burst_size;
+    if (reserved >= data->ring.size) {
+        LOG_ERR("pre-roll leaves no room in the recording buffer");
+        return -ENOBUFS;
+    }
+    uint64_t available = data->ring.size - reserved;
+#else
+    struct audio_block_config block_config;
+    ret = audio_get_block_config(&block_config);
+    if (ret) return ret;
+    uint64_t available = (uint64_t)rate * block_config.count *
+                         block_config.duration_ms / MSEC_PER_SEC;
+#endif
+    if (stall_bytes > available) {
+        LOG_ERR("recording buffer too small for SD card stalls of %" PRIu32
+                " ms at %" PRIu32 " KiB/s",
+                cal->max_latency_us / USEC_PER_MSEC, rate / 1024);
+        return -ENOBUFS;
+    }
+
+    return 0;
+}
+#endif
+
+/// Prepare a newly mounted card for recording.
+static int record_load_card(void) {
+    struct record_data *data = &record_data;
+    int ret;
+
+    ret = record_find_next_file_index();
+    if (ret < 0) {
+        LOG_WRN("failed to find next file index (err %d)", ret);
+        return ret;
+    }
+
+    // Only the last session can contain a file that was not closed, because
+    // the card is checked every time it is mounted. Files recorded before
+    // session directories existed are in the root, which is also checked.
+    // Failures don't prevent recording, so continue anyway.
+    ret = record_recover_files(RECORD_FILE_DIR);
+    if (ret < 0) {
+        LOG_WRN("failed to recover files in root (err %d)", ret);
+    }
+    if (data->has_session) {
+        char path[RECORD_SESSION_DIR_LEN];
+        ret = record_session_dir(path, sizeof(path), data->session_index);
+        if (ret == 0) ret = record_recover_files(path);
+        if (ret < 0) {
+            LOG_WRN("failed to recover files in session (err %d)", ret);
         }
     }
 
-    ret = 0;
-
-exit:
-    fs_closedir(&dir);
-    return ret;
-}
-
-static void record_close_file(void) {
-    const struct record_config *config = &record_config;
-    struct record_data *data = &record_data;
-    int err = k_msgq_put(config->close_queue, &data->file, K_FOREVER);
-    if (err < 0) {
-        LOG_WRN("Could not close file in background (err %d)", err);
-        // Just close synchronously without updating size
-        wav_close_no_update(&data->file);
+#if IS_ENABLED(CONFIG_RECORD_CALIBRATION)
+    // Never write to the card while a recording might be using it
+    if (data->state == RECORD_STOPPED) {
+        record_request_calibration();
     }
+#endif
+
+    return 0;
 }
 
 /// Callback for settings_load_subtree_direct() to apply recording settings.
@@ -178,6 +1452,23 @@ static int record_settings_load_cb(const char *key, size_t len,
         file_name_prefix[ret] = '\0';
         memcpy(data->file_name_prefix, file_name_prefix,
                sizeof(file_name_prefix));
+    } else if (0 == strcmp(key, "index")) {
+        ret = read_cb(cb_arg, &data->saved_index, sizeof(data->saved_index));
+        if (ret != sizeof(data->saved_index)) {
+            LOG_WRN("failed to read setting: %s (read %d)", key, ret);
+            return 0;
+        }
+        data->saved_index_valid = true;
+    } else if (0 == strcmp(key, "preroll")) {
+        uint32_t preroll_ms;
+        ret = read_cb(cb_arg, &preroll_ms, sizeof(preroll_ms));
+        if (ret != sizeof(preroll_ms)) {
+            LOG_WRN("failed to read setting: %s (read %d)", key, ret);
+            return 0;
+        }
+        if (IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)) {
+            data->preroll_ms = preroll_ms;
+        }
     } else {
         LOG_WRN("unknown record setting: %s", key);
         return 0;
@@ -199,22 +1490,104 @@ int record_init(void) {
         LOG_WRN("failed to load settings (err %d)", ret);
     }
 
-    k_thread_create(&data->close_thread, record_close_thread_stack,
-                    K_THREAD_STACK_SIZEOF(record_close_thread_stack),
-                    record_close_thread_run, NULL, NULL, NULL,
-                    K_PRIO_PREEMPT(2), 0, K_NO_WAIT);
-    k_thread_name_set(&data->close_thread, "record_close");
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    block_ring_init(&data->ring, record_buffer_mem, sizeof(record_buffer_mem));
+    data->burst_size = CONFIG_RECORD_WRITE_BEHIND_BURST_SIZE;
+#endif
 
-    ret = record_find_next_file_index();
-    if (ret < 0) {
-        // Continue anyway, probably means no SD card
-        LOG_WRN("failed to find next file index (err %d)", ret);
+    k_work_init_delayable(&data->prewarm_work, record_prewarm_work_handler);
+    if (IS_ENABLED(CONFIG_RECORD_HASH)) {
+        crc32c_init();
     }
 
+    ret = audio_add_consumer(&record_consumer);
+    if (ret) return ret;
+
+    k_thread_create(&data->write_thread, record_write_thread_stack,
+                    K_THREAD_STACK_SIZEOF(record_write_thread_stack),
+                    record_write_thread_run, NULL, NULL, NULL,
+                    K_PRIO_PREEMPT(1), 0, K_NO_WAIT);
+    k_thread_name_set(&data->write_thread, "record_write");
+
+    k_thread_create(&data->file_thread, record_file_thread_stack,
+                    K_THREAD_STACK_SIZEOF(record_file_thread_stack),
+                    record_file_thread_run, NULL, NULL, NULL,
+                    K_PRIO_PREEMPT(2), 0, K_NO_WAIT);
+    k_thread_name_set(&data->file_thread, "record_file");
+
+    // Continue anyway if this fails, probably means no SD card
+    (void)record_load_card();
+
     data->init = true;
     return 0;
 }
 
+/// While stopped, keep the ADC powered if pre-roll is enabled so that the
+/// write-behind buffer always holds recent audio. Otherwise, power it off.
+static void record_update_idle_power(void) {
+    struct record_data *data = &record_data;
+
+    if (!data->audio_ready) return;
+    if (data->preroll_ms > 0) {
+        audio_start();
+    } else if (data->state == RECORD_STOPPED) {
+        audio_stop();
+    }
+}
+
+int record_audio_ready(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    data->audio_ready = true;
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    // The saved pre-roll was loaded before the audio format was known
+    if (record_check_preroll(data->preroll_ms, data->burst_size)) {
+        LOG_WRN("pre-roll of %" PRIu32 " ms does not fit in buffer, disabling",
+                data->preroll_ms);
+        data->preroll_ms = 0;
+    }
+#endif
+    record_update_idle_power();
+    return 0;
+}
+
+int record_get_preroll(uint32_t *preroll_ms) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    *preroll_ms = data->preroll_ms;
+    return 0;
+}
+
+int record_set_preroll(uint32_t preroll_ms) {
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+    int ret;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    ret = record_check_preroll(preroll_ms, data->burst_size);
+    if (ret) return ret;
+
+    data->preroll_ms = preroll_ms;
+    record_update_idle_power();
+
+    return settings_save_one("rec/preroll", &preroll_ms, sizeof(preroll_ms));
+#else
+    // Pre-roll needs a buffer much larger than the I2S memory pool
+    return -ENOTSUP;
+#endif
+}
+
 int record_get_file_name_prefix(char *prefix, size_t len) {
     const struct record_config *config = &record_config;
     struct record_data *data = &record_data;
@@ -238,6 +1611,9 @@ int record_set_file_name_prefix(const char *prefix) {
 
     K_MUTEX_AUTO_LOCK(config->mutex);
     if (!data->init) return -EINVAL;
+    // The prefix names the session directory and the next file index is
+    // rescanned, so it can't change while a session is using them
+    if (data->state != RECORD_STOPPED) return -EBUSY;
 
     size_t len = strlen(prefix);
     if (len >= sizeof(data->file_name_prefix)) {
@@ -248,6 +1624,13 @@ int record_set_file_name_prefix(const char *prefix) {
     ret = settings_save_one("rec/prefix", prefix, len);
     if (ret) return ret;
 
+    // The saved index belongs to the old prefix
+    data->saved_index_valid = false;
+    ret = settings_delete("rec/index");
+    if (ret) {
+        LOG_WRN("failed to delete saved file index (err %d)", ret);
+    }
+
     ret = record_find_next_file_index();
     if (ret) {
         // Okay, SD card might not be inserted
@@ -260,14 +1643,50 @@ int record_set_file_name_prefix(const char *prefix) {
 int record_card_inserted(void) {
     const struct record_config *config = &record_config;
     struct record_data *data = &record_data;
-    int ret;
 
     K_MUTEX_AUTO_LOCK(config->mutex);
     if (!data->init) return -EINVAL;
 
-    ret = record_find_next_file_index();
-    if (ret < 0) {
-        LOG_WRN("failed to find next file index (err %d)", ret);
+    return record_load_card();
+}
+
+static void record_prewarm_work_handler(struct k_work *work) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+    int ret;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (data->state == RECORD_STOPPED) return;
+
+    LOG_INF("powering on ADC");
+    ret = audio_start();
+    if (ret && ret != -EALREADY) {
+        LOG_ERR("failed to power on ADC (err %d)", ret);
+    }
+}
+
+/// Power on the ADC CONFIG_RECORD_PREWARM_MS before the start time, so that it
+/// has settled by the first recorded sample. The ADC is left off until then to
+/// save power.
+static int record_schedule_prewarm(uint32_t time) {
+    struct record_data *data = &record_data;
+    int ret;
+
+    uint32_t now = qu32_32_whole(sync_timer_get_central_time());
+    int32_t lead = (int32_t)(time - now) -
+                   (int32_t)((uint64_t)CONFIG_RECORD_PREWARM_MS *
+                             ZEUS_TIME_NOMINAL_FREQ / MSEC_PER_SEC);
+    int64_t delay_us = (int64_t)lead * USEC_PER_SEC / ZEUS_TIME_NOMINAL_FREQ;
+
+    if (delay_us > 0 && delay_us <= RECORD_PREWARM_MAX_DELAY_MS * 1000LL) {
+        LOG_INF("powering on ADC in %" PRId64 " ms", delay_us / 1000);
+        k_work_reschedule(&data->prewarm_work, K_USEC(delay_us));
+        return 0;
+    }
+
+    k_work_cancel_delayable(&data->prewarm_work);
+    ret = audio_start();
+    if (ret && ret != -EALREADY) {
         return ret;
     }
     return 0;
@@ -281,10 +1700,17 @@ int record_start(uint32_t time) {
     K_MUTEX_AUTO_LOCK(config->mutex);
     if (!data->init) return -EINVAL;
 
-    ret = audio_start();
-    if (ret && ret != -EALREADY) {
-        return ret;
+#if IS_ENABLED(CONFIG_RECORD_CALIBRATION)
+    if (data->calibrating) {
+        LOG_WRN("cannot start while calibrating card");
+        return -EBUSY;
     }
+    ret = record_check_card();
+    if (ret) return ret;
+#endif
+
+    ret = record_schedule_prewarm(time);
+    if (ret) return ret;
 
     switch (data->state) {
         case RECORD_STOPPED:
@@ -293,10 +1719,16 @@ int record_start(uint32_t time) {
             break;
         case RECORD_WAITING_NEW_FILE:
         case RECORD_RUNNING:
+        case RECORD_STOPPING:
             data->state = RECORD_WAITING_NEW_FILE;
             break;
+        case RECORD_WAITING_STOP:
+            data->start_pending = true;
+            break;
     }
     data->start_time = time;
+    // Start time might already be covered by the pre-roll
+    record_write_kick();
 
     led_record_waiting();
     LOG_INF("start");
@@ -304,7 +1736,82 @@ int record_start(uint32_t time) {
     return 0;
 }
 
-int record_buffer(const struct audio_block *block) {
+/// Byte offset of the frame in a block closest to the given number of ticks
+/// after its start.
+static size_t record_block_offset(const struct audio_block *block,
+                                  uint32_t time) {
+    uint32_t block_frames = block->len / block->bytes_per_frame;
+    uint32_t frame =
+        DIV_ROUND_CLOSEST((uint64_t)time * block_frames, block->duration);
+    return frame * block->bytes_per_frame;
+}
+
+/// Check for audio lost between the previous block and this one, either by I2S
+/// or because the block queue or write-behind buffer was full. Return the
+/// number of bytes of silence needed to keep the file in time.
+static size_t record_gap_len(const struct audio_block *block) {
+    struct record_data *data = &record_data;
+
+    if (!data->next_block_time_valid) return 0;
+
+    int32_t gap = (int32_t)(block->start_time - data->next_block_time);
+    // Block durations are rounded to whole ticks, so consecutive blocks can be
+    // off by a fraction of a frame.
+    size_t gap_len = record_block_offset(block, abs(gap));
+    if (gap_len == 0) return 0;
+
+    if (gap < 0) {
+        LOG_WRN("blocks overlap by %" PRIu32, -gap);
+        return 0;
+    } else if (gap > (uint64_t)RECORD_GAP_MAX_MS * ZEUS_TIME_NOMINAL_FREQ /
+                         MSEC_PER_SEC) {
+        LOG_ERR("gap too long: %" PRIu32, gap);
+        return 0;
+    }
+
+    LOG_WRN("gap of %u frames", gap_len / block->bytes_per_frame);
+    return gap_len;
+}
+
+/// Write to the current file, recording the latency of the write.
+static int record_wav_write(const void *buf, size_t len) {
+    struct record_data *data = &record_data;
+
+    uint32_t start = k_cycle_get_32();
+    int ret = wav_write(&data->file->wav, buf, len);
+    latency_hist_add(&data->write_latency,
+                     k_cyc_to_us_floor32(k_cycle_get_32() - start),
+                     MAX(ret, 0));
+    return ret;
+}
+
+/// Write silence to the current file. Like wav_write(), return the number of
+/// bytes written, which is less than len if the file is full.
+static int record_write_silence(size_t len) {
+    size_t written = 0;
+    int ret;
+
+    while (written < len) {
+        size_t chunk = MIN(len - written, sizeof(record_silence));
+        ret = record_wav_write(record_silence, chunk);
+        if (ret < 0) return ret;
+        written += ret;
+        if (ret != chunk) break;
+    }
+
+    return written;
+}
+
+/// Write part of a block to the current file. Blocks captured before the ADC
+/// settled are written as silence rather than the power up transient, so that
+/// the file still starts at the exact start time.
+static int record_write_block(const struct audio_block *block, size_t offset,
+                              size_t len) {
+    if (block->settling) return record_write_silence(len);
+    return record_wav_write(block->buf + offset, len);
+}
+
+static int record_buffer(const struct audio_block *block) {
     const struct record_config *config = &record_config;
     struct record_data *data = &record_data;
     int ret;
@@ -317,7 +1824,16 @@ int record_buffer(const struct audio_block *block) {
 
     bool old_file = false;
     bool new_file;
+    // The current file is full and the recording continues in the next one
+    bool rollover = false;
+    bool stop = false;
     size_t split_offset;
+    // End of the audio in the block that belongs to the recording
+    size_t end_offset = block->len;
+    size_t gap_len = record_gap_len(block);
+    uint32_t gap_start = data->next_block_time;
+    data->next_block_time = block->start_time + block->duration;
+    data->next_block_time_valid = true;
 
     switch (data->state) {
         default:
@@ -338,11 +1854,7 @@ int record_buffer(const struct audio_block *block) {
             }
             if (wait_time <= block->duration) {
                 new_file = true;
-                uint32_t block_frames = block->len / block->bytes_per_frame;
-                uint32_t split_frame = DIV_ROUND_CLOSEST(
-                    wait_time * block_frames, block->duration);
-                // Byte index, rounded to a frame boundary
-                split_offset = split_frame * block->bytes_per_frame;
+                split_offset = record_block_offset(block, wait_time);
                 led_record_started();
             } else {
                 new_file = false;
@@ -354,12 +1866,53 @@ int record_buffer(const struct audio_block *block) {
             new_file = false;
             split_offset = block->len;
         } break;
+        case RECORD_WAITING_STOP:
+        case RECORD_STOPPING: {
+            old_file = true;
+            new_file = false;
+            int32_t wait_time = (int32_t)(data->stop_time - block->start_time);
+            if (wait_time < 0) {
+                // Stop time might be in the gap before this block
+                int32_t gap_wait = (int32_t)(data->stop_time - gap_start);
+                gap_len = MIN(gap_len,
+                              record_block_offset(block, MAX(gap_wait, 0)));
+                LOG_WRN("missed stop time by %" PRIu32, -wait_time);
+                wait_time = 0;
+            }
+            if (wait_time < block->duration) {
+                stop = true;
+                split_offset = record_block_offset(block, wait_time);
+                end_offset = split_offset;
+            } else {
+                split_offset = block->len;
+            }
+        } break;
     }
 
-    led_record_sync(block->start_time);
+    if (block->settling && (old_file || new_file)) {
+        if (data->settling_blocks++ == 0) {
+            LOG_WRN("ADC not settled, recording silence");
+        }
+    }
 
     if (old_file) {
-        ret = wav_write(&data->file, block->buf, split_offset);
+        if (gap_len > 0) {
+            // Only gaps in an open file are counted, since audio lost before
+            // the start or while stopped doesn't matter.
+            data->gaps++;
+            // If the file fills up, the block write below starts a new one and
+            // the rest of the silence is lost.
+            ret = record_write_silence(gap_len);
+            if (ret < 0) {
+                LOG_ERR("WAV write failed (err %d)", ret);
+                goto file_error;
+            }
+            data->gap_frames += ret / block->bytes_per_frame;
+            // Lost silence still takes up time on the timeline
+            data->session_frames += (gap_len - ret) / block->bytes_per_frame;
+        }
+
+        ret = record_write_block(block, 0, split_offset);
         if (ret < 0) {
             LOG_ERR("WAV write failed (err %d)", ret);
             goto file_error;
@@ -370,13 +1923,18 @@ int record_buffer(const struct audio_block *block) {
             // need to split the buffer across three files to provide completely
             // correct behavior.
             new_file = true;
+            rollover = true;
             split_offset = ret;
         }
 
         int64_t uptime_ms = k_uptime_get();
         if (uptime_ms - data->last_sync_time_ms >= RECORD_SYNC_INTERVAL_MS) {
             // LOG_INF("sync");
-            ret = fs_sync(&data->file.fp);
+            uint32_t sync_start = k_cycle_get_32();
+            ret = wav_sync(&data->file->wav);
+            latency_hist_add(&data->sync_latency,
+                             k_cyc_to_us_floor32(k_cycle_get_32() - sync_start),
+                             0);
             if (ret) {
                 LOG_ERR("WAV file sync failed (err %d)", ret);
                 goto file_error;
@@ -384,65 +1942,179 @@ int record_buffer(const struct audio_block *block) {
 
             data->last_sync_time_ms = uptime_ms;
         }
+
+        if (!new_file && !stop && data->state != RECORD_STOPPING) {
+            record_request_next_file(block);
+        }
     }
     if (new_file) {
         LOG_INF("new file, len: %u, split: %u", block->len, split_offset);
+        uint32_t rollover_start = k_cycle_get_32();
         if (old_file) {
             record_close_file();
         }
         data->last_sync_time_ms = k_uptime_get();
 
-        char file_name[(sizeof(RECORD_FILE_DIR) - 1) + 1 /* / */ +
-                       (sizeof(data->file_name_prefix) - 1) + 1 /* _ */ +
-                       10 /* max digits */
-                       + 4 /* .wav */ + 1 /* terminator */];
-        ret = snprintf(file_name, sizeof(file_name),
-                       RECORD_FILE_DIR "/%s_%04" PRIu32 ".wav",
-                       data->file_name_prefix, data->file_index);
-        if (ret < 0) {
-            goto error;
-        } else if (ret >= sizeof(file_name)) {
-            ret = -EOVERFLOW;
-            goto error;
+        struct record_file *next = NULL;
+        if (rollover) {
+            data->rollovers++;
+            next = atomic_ptr_clear(&data->next_file);
         }
+        if (next) {
+            LOG_INF("continuing in file: %s", next->name);
+            data->file = next;
+            data->next_file_requested = false;
+            // The file was opened before any silence filling a gap was cut
+            // off by the split
+            uint64_t time_reference =
+                data->session_time_reference + data->session_frames;
+            if (next->format.time_reference != time_reference) {
+                ret = wav_set_time_reference(&next->wav, time_reference);
+                if (ret) {
+                    LOG_WRN("failed to update time reference (err %d)", ret);
+                }
+            }
+            record_stream_hint();
+        } else {
+            if (rollover) {
+                LOG_WRN("next file not ready");
+                data->rollover_sync_opens++;
+            }
+            // A file opened in advance either isn't ready or belongs to the
+            // previous session.
+            record_discard_next_file();
 
-        LOG_INF("creating new file: %s", file_name);
-
-        // TODO: don't hardcode format
-        ret = wav_open(&data->file, file_name,
-                       &(struct wav_format){
-                           .channels = 2,
-                           .sample_rate = 48000,
-                           .bits_per_sample = 16,
-                           .max_file_size = RECORD_FILE_MAX_SIZE,
-                       });
-        if (ret) {
-            LOG_ERR("failed to create file: %s (err %d)", file_name, ret);
-            goto file_error;
+            // Files split because of the size limit stay in the same session
+            ret = record_open_file(block, split_offset, !rollover);
+            if (ret) goto error;
         }
-        data->file_index++;
 
-        size_t write_len = block->len - split_offset;
-        ret = wav_write(&data->file, block->buf + split_offset, write_len);
+        record_file_started(block, split_offset);
+
+        size_t write_len = end_offset - split_offset;
+        ret = record_write_block(block, split_offset, write_len);
         if (ret != write_len) {
             LOG_ERR("WAV write failed (err %d)", ret);
             goto file_error;
         }
 
+        if (rollover) {
+            uint32_t rollover_us =
+                k_cyc_to_us_floor32(k_cycle_get_32() - rollover_start);
+            data->rollover_max_us = MAX(data->rollover_max_us, rollover_us);
+        }
+
         data->state = RECORD_RUNNING;
     }
 
+    if (stop) {
+        LOG_INF("stopped, len: %u, split: %u", block->len, end_offset);
+        bool stopping = data->state == RECORD_STOPPING;
+        record_close_file();
+        record_discard_next_file();
+        record_write_session_summary();
+        if (stopping) {
+            // Blocks captured after the stop stay in the buffer as pre-roll
+            record_set_stopped();
+            record_update_idle_power();
+            k_sem_give(config->stopped_sem);
+        } else if (data->start_pending) {
+            // If the start time falls in the rest of this block it is missed
+            // and the next file starts with the following block, similar to
+            // the FIXME above.
+            data->start_pending = false;
+            data->state = RECORD_WAITING_START;
+            led_record_waiting();
+        } else {
+            record_set_stopped();
+            record_update_idle_power();
+            led_record_stopped();
+        }
+    }
+
     return 0;
 
 file_error:
     record_close_file();
 
 error:
-    data->state = RECORD_STOPPED;
+    record_discard_next_file();
+    // Most useful when the card is too slow or failing
+    record_write_session_summary();
+    record_set_stopped();
 
     return ret;
 }
 
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+/// Copy a block into the write-behind buffer and release the original.
+static int record_submit_buffer(const struct audio_block *block) {
+    struct record_data *data = &record_data;
+
+    struct audio_block *queued =
+        block_ring_reserve(&data->ring, sizeof(*queued) + block->len);
+    if (!queued) {
+        atomic_inc(&data->queue_overruns);
+        LOG_ERR("write-behind buffer overrun");
+        audio_block_free(block);
+        return -ENOBUFS;
+    }
+
+    *queued = *block;
+    queued->buf = (uint8_t *)(queued + 1);
+    memcpy(queued->buf, block->buf, block->len);
+    audio_block_free(block);
+    atomic_set(&data->newest_block_end, block->start_time + block->duration);
+    block_ring_commit(&data->ring);
+
+    if (block_ring_used(&data->ring) >= data->burst_size) {
+        record_write_kick();
+    }
+
+    return 0;
+}
+#else
+/// Pass ownership of a block to the writer thread through the block queue.
+static int record_submit_queue(const struct audio_block *block) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+    int ret;
+
+    ret = k_msgq_put(config->block_queue, block, K_NO_WAIT);
+    if (ret < 0) {
+        atomic_inc(&data->queue_overruns);
+        LOG_ERR("block queue overrun (err %d)", ret);
+        audio_block_free(block);
+        return -ENOBUFS;
+    }
+
+    atomic_set(&data->newest_block_end, block->start_time + block->duration);
+
+    atomic_val_t used = k_msgq_num_used_get(config->block_queue);
+    if (used > atomic_get(&data->queue_high_water)) {
+        atomic_set(&data->queue_high_water, used);
+    }
+
+    return 0;
+}
+#endif
+
+/// Queue an audio block to be written by the record writer thread. The
+/// recording module releases its reference with audio_block_free() once the
+/// block has been written (or immediately, if it cannot be queued).
+static int record_submit(const struct audio_block *block) {
+    // Called from the audio thread, so this must never block. The LED is
+    // updated here rather than in the writer thread so that it stays in time
+    // with the audio even when the writer falls behind.
+    led_record_sync(block->start_time);
+
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    return record_submit_buffer(block);
+#else
+    return record_submit_queue(block);
+#endif
+}
+
 static int record_stop_unlocked(void) {
     struct record_data *data = &record_data;
 
@@ -450,19 +2122,36 @@ static int record_stop_unlocked(void) {
         return -EINVAL;
     }
 
+    data->start_pending = false;
     switch (data->state) {
         case RECORD_STOPPED:
         case RECORD_WAITING_START:
+            record_set_stopped();
             break;
         case RECORD_WAITING_NEW_FILE:
         case RECORD_RUNNING:
-            record_close_file();
+        case RECORD_WAITING_STOP: {
+            // Audio captured before the stop may still be waiting to be
+            // written. The writer thread closes the file once it catches up,
+            // at the end of the newest block captured so far. With pre-roll,
+            // the ADC keeps running and later blocks must not be recorded.
+            uint32_t newest_end = atomic_get(&data->newest_block_end);
+            if (data->state != RECORD_WAITING_STOP ||
+                (int32_t)(newest_end - data->stop_time) < 0) {
+                data->stop_time = newest_end;
+            }
+            data->state = RECORD_STOPPING;
+            record_write_kick();
+        } break;
+        case RECORD_STOPPING:
             break;
     }
 
-    audio_stop();
+    k_work_cancel_delayable(&data->prewarm_work);
+    if (data->preroll_ms == 0) {
+        audio_stop();
+    }
     led_record_stopped();
-    data->state = RECORD_STOPPED;
     return 0;
 }
 
@@ -473,19 +2162,148 @@ int record_stop(void) {
     return record_stop_unlocked();
 }
 
-int record_shutdown(void) {
+int record_stop_wait(k_timeout_t timeout) {
     const struct record_config *config = &record_config;
     struct record_data *data = &record_data;
     int ret;
 
+    k_mutex_lock(config->mutex, K_FOREVER);
+    k_sem_reset(config->stopped_sem);
+    ret = record_stop_unlocked();
+    bool stopping = data->state == RECORD_STOPPING;
+    k_mutex_unlock(config->mutex);
+    if (ret < 0 || !stopping) return ret;
+
+    return k_sem_take(config->stopped_sem, timeout);
+}
+
+int record_stop_at(uint32_t time) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    if (!data->init) return -EINVAL;
+
+    switch (data->state) {
+        case RECORD_STOPPED:
+        case RECORD_WAITING_START:
+        case RECORD_WAITING_NEW_FILE:
+        case RECORD_STOPPING:
+            // Nothing is being recorded that could be stopped at the exact
+            // time, so behave like an immediate stop.
+            return record_stop_unlocked();
+        case RECORD_RUNNING:
+        case RECORD_WAITING_STOP:
+            break;
+    }
+
+    data->state = RECORD_WAITING_STOP;
+    data->stop_time = time;
+    data->start_pending = false;
+    // Stop time might already be buffered
+    record_write_kick();
+
+    LOG_INF("stop");
+
+    return 0;
+}
+
+int record_get_stats(struct record_stats *stats) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    // The writer thread updates the counters and histograms with the mutex held
     K_MUTEX_AUTO_LOCK(config->mutex);
+    *stats = (struct record_stats){
+        .queue_used = k_msgq_num_used_get(config->block_queue),
+        .queue_high_water = atomic_get(&data->queue_high_water),
+        .queue_overruns = atomic_get(&data->queue_overruns),
+        .settling_blocks = data->settling_blocks,
+        .gaps = data->gaps,
+        .gap_frames = data->gap_frames,
+        .rollovers = data->rollovers,
+        .rollover_sync_opens = data->rollover_sync_opens,
+        .rollover_max_us = data->rollover_max_us,
+        .file_ops_pending = k_msgq_num_used_get(config->file_queue),
+        .write_latency = data->write_latency,
+        .sync_latency = data->sync_latency,
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+        .buffer_size = data->ring.size,
+        .buffer_used = block_ring_used(&data->ring),
+        .buffer_max_used = block_ring_max_used(&data->ring),
+#endif
+    };
+    return 0;
+}
+
+int record_get_calibration(struct record_calibration *calibration) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    *calibration = data->calibration;
+    return 0;
+}
+
+int record_reset_high_water(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
+    atomic_set(&data->queue_high_water, 0);
+    data->rollover_max_us = 0;
+#if IS_ENABLED(CONFIG_RECORD_WRITE_BEHIND)
+    block_ring_reset_max_used(&data->ring);
+#endif
+    return 0;
+}
+
+int record_shutdown(void) {
+    const struct record_config *config = &record_config;
+    struct record_data *data = &record_data;
+    int ret;
+
+    k_mutex_lock(config->mutex, K_FOREVER);
     if (!data->init) {
+        k_mutex_unlock(config->mutex);
         return -EALREADY;
     }
 
+    k_sem_reset(config->stopped_sem);
     ret = record_stop_unlocked();
+    // Pre-roll may have left the ADC running
+    audio_stop();
+    bool stopping = data->state == RECORD_STOPPING;
+    k_mutex_unlock(config->mutex);
     if (ret < 0) return ret;
 
+    // Give the writer thread a chance to finish writing buffered audio before
+    // the power is cut.
+    if (stopping) {
+        ret = k_sem_take(config->stopped_sem,
+                         K_MSEC(RECORD_SHUTDOWN_TIMEOUT_MS));
+        if (ret) {
+            LOG_WRN("timed out writing buffered audio (err %d)", ret);
+        }
+    }
+
+    // Files are closed in the background, and their headers aren't final
+    // until the file thread has handled every request queued before this one
+    k_sem_reset(config->file_flushed_sem);
+    ret = k_msgq_put(config->file_queue,
+                     &(struct record_file_op){
+                         .type = RECORD_FILE_FLUSH,
+                     },
+                     K_MSEC(RECORD_SHUTDOWN_TIMEOUT_MS));
+    if (ret == 0) {
+        ret = k_sem_take(config->file_flushed_sem,
+                         K_MSEC(RECORD_SHUTDOWN_TIMEOUT_MS));
+    }
+    if (ret) {
+        LOG_WRN("timed out closing files (err %d)", ret);
+    }
+
+    K_MUTEX_AUTO_LOCK(config->mutex);
     // Clear init to prevent any other recordings from being started
     data->init = false;
     return 0;
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <zephyr/kernel.h>
 
 #include "audio.h"
+#include "latency.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -10,20 +12,114 @@ extern "C" {
 
 #define RECORD_FILE_NAME_PREFIX_LEN 32
 
+struct record_stats {
+    /// Number of blocks currently waiting to be written
+    uint32_t queue_used;
+    /// Maximum number of blocks that have been waiting to be written at once
+    uint32_t queue_high_water;
+    /// Number of blocks dropped because the block queue or write-behind buffer
+    /// was full
+    uint32_t queue_overruns;
+    /// Number of recorded blocks replaced with silence because the ADC had not
+    /// settled
+    uint32_t settling_blocks;
+    /// Number of gaps detected in the block timestamps
+    uint32_t gaps;
+    /// Number of frames of silence written to fill gaps
+    uint32_t gap_frames;
+    /// Number of times the file size limit was reached and the recording
+    /// continued in a new file
+    uint32_t rollovers;
+    /// Number of rollovers where the next file had not been opened in advance,
+    /// so it was opened synchronously
+    uint32_t rollover_sync_opens;
+    /// Longest time taken to switch files at the size limit (us)
+    uint32_t rollover_max_us;
+    /// Number of file open and close requests waiting for the file thread
+    uint32_t file_ops_pending;
+    /// Latency of audio writes in the current or last session
+    struct latency_hist write_latency;
+    /// Latency of periodic file syncs in the current or last session
+    struct latency_hist sync_latency;
+    /// Size of the write-behind buffer in bytes, or zero if it is disabled
+    uint32_t buffer_size;
+    /// Number of bytes currently in the write-behind buffer
+    uint32_t buffer_used;
+    /// Maximum number of bytes that have been in the write-behind buffer at
+    /// once
+    uint32_t buffer_max_used;
+};
+
+/// Result of the card speed calibration at mount
+struct record_calibration {
+    /// A calibration has been run on the inserted card
+    bool valid;
+    /// Sequential write throughput (bytes/s)
+    uint32_t throughput;
+    /// Worst case latency of a single write or sync (us)
+    uint32_t max_latency_us;
+    /// Write-behind burst size chosen for the card, or zero if the
+    /// write-behind buffer is disabled
+    uint32_t burst_size;
+};
+
 int record_init(void);
 
+/// Called once the audio module has been initialized, to power on the ADC for
+/// pre-roll if it is enabled.
+int record_audio_ready(void);
+
 int record_get_file_name_prefix(char *prefix, size_t len);
 
+/// Set and save the file name prefix, which also names the session
+/// directories. Return -EBUSY unless recording is stopped.
 int record_set_file_name_prefix(const char *prefix);
 
 int record_card_inserted(void);
 
-int record_start(uint32_t time);
+/// Get the pre-roll duration in ms.
+int record_get_preroll(uint32_t *preroll_ms);
+
+/// Set and save the pre-roll duration in ms. While stopped, the ADC keeps
+/// running and the last preroll_ms of audio is kept in the write-behind buffer,
+/// so a start time in the past begins at the exact requested sample. Zero
+/// disables pre-roll and allows the ADC to power off while stopped. The audio
+/// format and block duration can't be changed while the ADC is running, so
+/// pre-roll must be disabled first. Return -ENOTSUP if the write-behind buffer
+/// is disabled, or -ENOMEM if the pre-roll does not fit in it.
+int record_set_preroll(uint32_t preroll_ms);
 
-int record_buffer(const struct audio_block *block);
+/// Start recording at the specified central time. Return -EBUSY while the
+/// card is being calibrated after it was inserted. If the card was calibrated,
+/// return -EIO if it is too slow for the current format, or -ENOBUFS if the
+/// buffer could not absorb its stalls.
+int record_start(uint32_t time);
 
+/// Stop recording. The file ends with the newest audio captured before the
+/// stop, and is closed once the audio still buffered has been written.
 int record_stop(void);
 
+/// Stop recording and wait until the audio captured before the stop has been
+/// written and the file closed. Return -EAGAIN if that takes longer than the
+/// timeout.
+int record_stop_wait(k_timeout_t timeout);
+
+/// Stop recording at the specified central time. The file ends at the frame
+/// closest to the stop time, so recordings from all nodes have the same length.
+/// If no file has been started yet, this behaves like record_stop().
+int record_stop_at(uint32_t time);
+
+/// Get statistics about buffering between the audio and writer threads.
+int record_get_stats(struct record_stats *stats);
+
+/// Get the result of the card speed calibration. The calibration is not valid
+/// if CONFIG_RECORD_CALIBRATION is disabled or it failed.
+int record_get_calibration(struct record_calibration *calibration);
+
+/// Reset the block queue high water mark, the maximum write-behind buffer usage
+/// and the longest rollover time, e.g. before a benchmark.
+int record_reset_high_water(void);
+
 /// Stop any in-progress recording and prevent new recordings from startings.
 int record_shutdown(void);
 
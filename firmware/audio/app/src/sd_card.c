@@ -5,6 +5,7 @@
 #include <zephyr/fs/fs.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/storage/disk_access.h>
+#include <zeus/drivers/disk.h>
 
 #include "record.h"
 
@@ -80,6 +81,51 @@ static int sd_card_print_info(const char* disk_pdrv) {
     return 0;
 }
 
+int sd_card_get_volume_id(uint32_t* id) {
+#if FF_USE_LABEL
+    struct sd_card_data* data = &sd_card;
+
+    if (!data->mounted) return -ENODEV;
+
+    DWORD vsn;
+    // FatFs drive names don't have the leading slash
+    FRESULT res = f_getlabel(&data->mount.mnt_point[1], NULL, &vsn);
+    if (res != FR_OK) return -EIO;
+
+    *id = vsn;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+int sd_card_shutdown(void) {
+    const struct sd_card_config* config = &sd_card_config;
+    struct sd_card_data* data = &sd_card;
+
+    if (!data->disk_init) return 0;
+
+    int ret = disk_access_ioctl(config->name, DISK_IOCTL_CTRL_SYNC, NULL);
+    if (ret < 0) {
+        LOG_ERR("failed to sync SD card: (err %d)", ret);
+        return ret;
+    }
+    return 0;
+}
+
+int sd_card_stream_hint(uint32_t start_sector, uint32_t num_sector) {
+    const struct sd_card_config* config = &sd_card_config;
+    struct sd_card_data* data = &sd_card;
+
+    if (!data->disk_init) return -ENODEV;
+
+    struct disk_stream_hint hint = {
+        .start_sector = start_sector,
+        .num_sector = num_sector,
+    };
+    return disk_access_ioctl(config->name, DISK_IOCTL_STREAM_HINT, &hint);
+}
+
 static int sd_card_inserted(void) {
     const struct sd_card_config* config = &sd_card_config;
     struct sd_card_data* data = &sd_card;
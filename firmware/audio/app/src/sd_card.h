@@ -1,3 +1,19 @@
 #pragma once
 
-int sd_card_init(void);
\ No newline at end of file
+#include <stdint.h>
+
+int sd_card_init(void);
+
+/// Write any sectors still held in the disk cache to the card before the power
+/// is cut. Files must already be closed or synced.
+int sd_card_shutdown(void);
+
+/// Tell the disk that a region of sectors is about to be written sequentially,
+/// or end the current stream if num_sector is zero. The hint is only advisory,
+/// and -ENOTSUP is returned if the disk can't use it.
+int sd_card_stream_hint(uint32_t start_sector, uint32_t num_sector);
+
+/// Get the serial number of the mounted FAT volume, which changes whenever the
+/// card is formatted. Return -ENODEV if no card is mounted, or -ENOTSUP if
+/// FatFs was built without volume label support.
+int sd_card_get_volume_id(uint32_t* id);
\ No newline at end of file
@@ -1,10 +1,17 @@
 #include <math.h>
 #include <stdlib.h>
 #include <zephyr/shell/shell.h>
+#include <zephyr/timing/timing.h>
 
 #include "audio.h"
+#include "fixed.h"
+#include "latency.h"
 #include "mgr.h"
+#include "pcm.h"
 #include "record.h"
+#include "sync_timer.h"
+#include "wav.h"
+#include "zeus/protocol.h"
 
 static int parse_uint32(const char *str, uint32_t *u) {
     BUILD_ASSERT(sizeof(unsigned long) == sizeof(uint32_t),
@@ -52,7 +59,10 @@ SHELL_SUBCMD_ADD((zeus), pair, NULL, "Pair with a central node", cmd_pair, 1,
 
 static int cmd_prefix(const struct shell *sh, size_t argc, char **argv) {
     int ret = record_set_file_name_prefix(argv[1]);
-    if (ret) {
+    if (ret == -EBUSY) {
+        shell_error(sh, "cannot change prefix while recording");
+        return ret;
+    } else if (ret) {
         shell_error(sh, "failed to set prefix (err %d)", ret);
         return ret;
     }
@@ -168,6 +178,140 @@ static int cmd_impedance(const struct shell *sh, size_t argc, char **argv) {
 SHELL_SUBCMD_ADD((zeus), impedance, NULL, "Adjust channel input impedance",
                  cmd_impedance, 3, 0);
 
+/// Explain why the audio format can't be changed. Pre-roll keeps the ADC
+/// running even while stopped, so it has to be disabled first.
+static void audio_busy_error(const struct shell *sh, const char *what) {
+    uint32_t preroll_ms;
+    if (record_get_preroll(&preroll_ms) == 0 && preroll_ms > 0) {
+        shell_error(sh,
+                    "cannot change %s while pre-roll keeps the ADC running; "
+                    "disable it with \"zeus preroll 0\" first",
+                    what);
+    } else {
+        shell_error(sh, "cannot change %s while the ADC is running", what);
+    }
+}
+
+static int cmd_bits(const struct shell *sh, size_t argc, char **argv) {
+    int ret;
+
+    const char *bits_str = argv[1];
+    uint32_t bits;
+    ret = parse_uint32(bits_str, &bits);
+    if (ret || (bits != 16 && bits != 24)) {
+        shell_error(sh,
+                    "unsupported bits per sample; supported values: 16, 24");
+        return -EINVAL;
+    }
+
+    ret = audio_set_bits_per_sample(bits);
+    if (ret == -EBUSY) {
+        audio_busy_error(sh, "format");
+        return ret;
+    } else if (ret) {
+        shell_error(sh, "failed to set bits per sample (err %d)", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), bits, NULL, "Set recording bits per sample", cmd_bits,
+                 2, 0);
+
+static int cmd_rate(const struct shell *sh, size_t argc, char **argv) {
+    int ret;
+
+    const char *rate_str = argv[1];
+    uint32_t rate;
+    ret = parse_uint32(rate_str, &rate);
+    if (ret) {
+        shell_error(sh, "invalid sample rate: %s", rate_str);
+        return ret;
+    }
+
+    ret = audio_set_sample_rate(rate);
+    if (ret == -EINVAL) {
+        shell_error(sh, "unsupported sample rate: %" PRIu32 " Hz", rate);
+        return ret;
+    } else if (ret == -EBUSY) {
+        audio_busy_error(sh, "format");
+        return ret;
+    } else if (ret) {
+        shell_error(sh, "failed to set sample rate (err %d)", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), rate, NULL, "Set recording sample rate (Hz)", cmd_rate,
+                 2, 0);
+
+static int cmd_block(const struct shell *sh, size_t argc, char **argv) {
+    int ret;
+
+    const char *block_ms_str = argv[1];
+    uint32_t block_ms;
+    ret = parse_uint32(block_ms_str, &block_ms);
+    if (ret || block_ms > UINT16_MAX) {
+        shell_error(sh, "invalid block duration: %s", block_ms_str);
+        return -EINVAL;
+    }
+
+    ret = audio_set_block_duration(block_ms);
+    if (ret == -EINVAL) {
+        shell_error(sh, "unsupported block duration: %" PRIu32 " ms", block_ms);
+        return ret;
+    } else if (ret == -ENOMEM) {
+        shell_error(sh, "not enough memory for %" PRIu32 " ms blocks",
+                    block_ms);
+        return ret;
+    } else if (ret == -EBUSY) {
+        audio_busy_error(sh, "block duration");
+        return ret;
+    } else if (ret) {
+        shell_error(sh, "failed to set block duration (err %d)", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), block, NULL,
+                 "Set audio block duration (ms); 1-2 ms for low latency",
+                 cmd_block, 2, 0);
+
+static int cmd_preroll(const struct shell *sh, size_t argc, char **argv) {
+    int ret;
+
+    const char *preroll_str = argv[1];
+    uint32_t preroll_ms;
+    ret = parse_uint32(preroll_str, &preroll_ms);
+    if (ret) {
+        shell_error(sh, "invalid pre-roll: %s", preroll_str);
+        return ret;
+    }
+
+    ret = record_set_preroll(preroll_ms);
+    if (ret == -ENOTSUP) {
+        shell_error(sh, "pre-roll requires the write-behind buffer");
+        return ret;
+    } else if (ret == -ENOMEM) {
+        shell_error(sh, "pre-roll does not fit in the write-behind buffer");
+        return ret;
+    } else if (ret) {
+        shell_error(sh, "failed to set pre-roll (err %d)", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), preroll, NULL,
+                 "Set pre-roll duration (ms); keeps the ADC running",
+                 cmd_preroll, 2, 0);
+
 static int channel_status(const struct shell *sh, audio_channel_t channel) {
     int32_t gain;
     uint32_t impedance;
@@ -196,6 +340,35 @@ static int cmd_status(const struct shell *sh, size_t argc, char **argv) {
     }
     shell_print(sh, "File Prefix: %s", prefix);
 
+    struct audio_format format;
+    ret = audio_get_format(&format);
+    if (ret) return ret;
+    shell_print(sh, "Format: %" PRIu32 " Hz, %u channels, %u-bit",
+                format.sample_rate, format.channels, format.bits_per_sample);
+
+    struct audio_block_config block_config;
+    ret = audio_get_block_config(&block_config);
+    if (ret) return ret;
+    shell_print(sh, "Blocks: %u ms, %" PRIu32 " x %" PRIu32 " bytes",
+                block_config.duration_ms, block_config.count,
+                block_config.size);
+
+    uint32_t preroll_ms;
+    ret = record_get_preroll(&preroll_ms);
+    if (ret) return ret;
+    shell_print(sh, "Pre-roll: %" PRIu32 " ms", preroll_ms);
+
+    struct record_calibration calibration;
+    ret = record_get_calibration(&calibration);
+    if (ret) return ret;
+    if (calibration.valid) {
+        shell_print(sh,
+                    "Card: %" PRIu32 " KiB/s, worst write %" PRIu32
+                    " us, burst %" PRIu32 " KiB",
+                    calibration.throughput / 1024, calibration.max_latency_us,
+                    calibration.burst_size / 1024);
+    }
+
     shell_print(sh, "Left");
     ret = channel_status(sh, AUDIO_CHANNEL_FRONT_LEFT);
     if (ret) return ret;
@@ -209,3 +382,358 @@ static int cmd_status(const struct shell *sh, size_t argc, char **argv) {
 
 SHELL_SUBCMD_ADD((zeus), status, NULL, "Get ADC/recording status", cmd_status,
                  1, 0);
+
+static void latency_print(const struct shell *sh, const char *name,
+                          const struct latency_hist *h) {
+    char hist[160];
+
+    shell_print(sh,
+                "%14s: %" PRIu32 " ops, avg %" PRIu64 " us, %" PRIu32
+                " KiB/s",
+                name, h->count, h->count ? h->total_us / h->count : 0,
+                latency_hist_kib_per_s(h));
+    shell_print(sh, "         Worst: %" PRIu32 " us at %" PRId64 " ms",
+                h->max_us, h->max_uptime_ms);
+    latency_hist_format(h, hist, sizeof(hist));
+    shell_print(sh, "     Histogram: %s", hist);
+}
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv) {
+    struct record_stats stats;
+    int ret;
+
+    ret = record_get_stats(&stats);
+    if (ret) {
+        shell_error(sh, "failed to get recording stats (err %d)", ret);
+        return ret;
+    }
+
+    if (stats.buffer_size) {
+        shell_print(sh, "Write-behind buffer");
+        shell_print(sh, "          Size: %" PRIu32 " KiB",
+                    stats.buffer_size / 1024);
+        shell_print(sh, "          Used: %" PRIu32 " KiB (%" PRIu32 "%%)",
+                    stats.buffer_used / 1024,
+                    (uint32_t)((uint64_t)stats.buffer_used * 100 /
+                               stats.buffer_size));
+        shell_print(sh, "      Max used: %" PRIu32 " KiB (%" PRIu32 "%%)",
+                    stats.buffer_max_used / 1024,
+                    (uint32_t)((uint64_t)stats.buffer_max_used * 100 /
+                               stats.buffer_size));
+    } else {
+        shell_print(sh, "Block queue");
+        shell_print(sh, "          Used: %" PRIu32, stats.queue_used);
+        shell_print(sh, "    High water: %" PRIu32, stats.queue_high_water);
+    }
+    shell_print(sh, "      Overruns: %" PRIu32, stats.queue_overruns);
+
+    struct audio_stats audio_stats;
+    ret = audio_get_stats(&audio_stats);
+    if (ret) {
+        shell_error(sh, "failed to get audio stats (err %d)", ret);
+        return ret;
+    }
+
+    shell_print(sh, "Audio");
+    shell_print(sh, "  I2S overruns: %" PRIu32, audio_stats.i2s_overruns);
+    shell_print(sh, "    Timestamps: %" PRIu32 " errors",
+                audio_stats.timestamp_errors);
+    shell_print(sh, "          Sync: %" PRIu32 " outliers, %" PRIu32 " resets",
+                audio_stats.sync_outliers, audio_stats.sync_resets);
+    shell_print(sh, "          Gaps: %" PRIu32 " (%" PRIu32 " frames filled)",
+                stats.gaps, stats.gap_frames);
+    shell_print(sh, "      Settling: %" PRIu32 " blocks",
+                stats.settling_blocks);
+
+    shell_print(sh, "Files");
+    shell_print(sh, "     Rollovers: %" PRIu32 " (%" PRIu32 " not ready)",
+                stats.rollovers, stats.rollover_sync_opens);
+    shell_print(sh, "  Max rollover: %" PRIu32 " us", stats.rollover_max_us);
+    shell_print(sh, "       Pending: %" PRIu32 " opens/closes",
+                stats.file_ops_pending);
+
+    shell_print(sh, "Storage (current or last session)");
+    latency_print(sh, "Writes", &stats.write_latency);
+    latency_print(sh, "Syncs", &stats.sync_latency);
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), stats, NULL, "Get recording pipeline statistics",
+                 cmd_stats, 1, 0);
+
+#if IS_ENABLED(CONFIG_PCM_BENCHMARK)
+/// One I2S block of 32-bit stereo samples at 48 kHz (37.5 ms)
+#define BENCH_PACK_LEN 14400
+#define BENCH_PACK_BLOCK_NS 37500000
+#define BENCH_PACK_ITERATIONS 16
+
+static uint32_t bench_pack_buf[BENCH_PACK_LEN / 4];
+
+/// Original byte-at-a-time implementation, for comparison
+static size_t bench_pack_32_to_24_bytewise(uint8_t *buf, size_t len) {
+    size_t i, j;
+    for (i = 1, j = 0; i < len; i += 4, j += 3) {
+        memmove(buf + j, buf + i, 3);
+    }
+    return len / 4 * 3;
+}
+
+static uint64_t bench_pack_run(size_t (*pack)(uint8_t *, size_t)) {
+    uint64_t total_cycles = 0;
+
+    for (int i = 0; i < BENCH_PACK_ITERATIONS; i++) {
+        // Packing is in place, so refill the buffer outside the timed region
+        for (size_t j = 0; j < ARRAY_SIZE(bench_pack_buf); j++) {
+            bench_pack_buf[j] = j * 2654435761u;
+        }
+
+        timing_t start = timing_counter_get();
+        pack((uint8_t *)bench_pack_buf, BENCH_PACK_LEN);
+        timing_t end = timing_counter_get();
+        total_cycles += timing_cycles_get(&start, &end);
+    }
+
+    return total_cycles / BENCH_PACK_ITERATIONS;
+}
+
+static void bench_pack_print(const struct shell *sh, const char *name,
+                             uint64_t cycles) {
+    uint64_t ns = timing_cycles_to_ns(cycles);
+    shell_print(sh, "%10s: %7" PRIu64 " cycles/block, %5" PRIu64
+                    " us/block, %.2f cycles/sample, %.3f%% CPU",
+                name, cycles, ns / 1000, (double)cycles / (BENCH_PACK_LEN / 4),
+                ns * 100. / BENCH_PACK_BLOCK_NS);
+}
+
+static int cmd_bench_pack(const struct shell *sh, size_t argc, char **argv) {
+    timing_init();
+    timing_start();
+
+    uint64_t bytewise = bench_pack_run(bench_pack_32_to_24_bytewise);
+    uint64_t packed = bench_pack_run(pcm_pack_32_to_24);
+
+    timing_stop();
+
+    shell_print(sh, "32 to 24-bit packing, 48 kHz stereo block");
+    bench_pack_print(sh, "bytewise", bytewise);
+    bench_pack_print(sh, "word", packed);
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), bench_pack, NULL,
+                 "Benchmark 32 to 24-bit sample packing", cmd_bench_pack, 1,
+                 0);
+#endif
+
+#if IS_ENABLED(CONFIG_WAV_BENCHMARK)
+/// One I2S block of 24-bit stereo samples at 48 kHz (50 ms), which doesn't
+/// divide evenly into sectors
+#define BENCH_WRITE_BLOCK_LEN 14400
+#define BENCH_WRITE_DEFAULT_SIZE (4 * 1024 * 1024)
+#define BENCH_WRITE_FILE "/SD:/bench.wav"
+/// Size of the header before the data was padded to a sector boundary
+#define BENCH_WRITE_UNALIGNED_HEADER_SIZE 44
+
+static uint8_t bench_write_buf[BENCH_WRITE_BLOCK_LEN];
+
+/// Write blocks directly after a 44 byte header, like the original WAV
+/// implementation, so that no write starts or ends on a sector boundary.
+static int bench_write_unaligned(uint32_t size) {
+    struct fs_file_t fp;
+    fs_file_t_init(&fp);
+    int ret = fs_open(&fp, BENCH_WRITE_FILE,
+                      FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+    if (ret < 0) return ret;
+
+    ret = fs_write(&fp, bench_write_buf, BENCH_WRITE_UNALIGNED_HEADER_SIZE);
+    for (uint32_t written = 0; ret >= 0 && written < size;
+         written += BENCH_WRITE_BLOCK_LEN) {
+        ret = fs_write(&fp, bench_write_buf, BENCH_WRITE_BLOCK_LEN);
+    }
+
+    int ret_close = fs_close(&fp);
+    if (ret >= 0) ret = ret_close;
+    return ret;
+}
+
+static int bench_write_wav(uint32_t size, uint32_t prealloc_size) {
+    static struct wav w;
+    const struct wav_format fmt = {
+        .channels = 2,
+        .sample_rate = 48000,
+        .bits_per_sample = 24,
+        .max_file_size = UINT32_MAX,
+        .prealloc_size = prealloc_size,
+    };
+    int ret = wav_open(&w, BENCH_WRITE_FILE, &fmt);
+    if (ret < 0) return ret;
+
+    for (uint32_t written = 0; ret >= 0 && written < size;
+         written += BENCH_WRITE_BLOCK_LEN) {
+        ret = wav_write(&w, bench_write_buf, BENCH_WRITE_BLOCK_LEN);
+    }
+
+    int ret_close = wav_close(&w);
+    if (ret >= 0) ret = ret_close;
+    return ret;
+}
+
+static void bench_write_print(const struct shell *sh, const char *name,
+                              uint32_t size, int64_t ms, int ret) {
+    if (ret < 0) {
+        shell_error(sh, "%12s: failed (err %d)", name, ret);
+        return;
+    }
+    shell_print(sh, "%12s: %6" PRId64 " ms, %6" PRIu64 " KiB/s", name, ms,
+                ms > 0 ? (uint64_t)size * 1000 / 1024 / ms : 0);
+}
+
+static int cmd_bench_write(const struct shell *sh, size_t argc, char **argv) {
+    uint32_t size = BENCH_WRITE_DEFAULT_SIZE;
+    if (argc >= 2) {
+        int ret = parse_uint32(argv[1], &size);
+        if (ret < 0) {
+            shell_error(sh, "Invalid size: %s", argv[1]);
+            return ret;
+        }
+    }
+    size = ROUND_UP(size, BENCH_WRITE_BLOCK_LEN);
+
+    for (size_t i = 0; i < sizeof(bench_write_buf); i++) {
+        bench_write_buf[i] = i * 2654435761u >> 24;
+    }
+
+    shell_print(sh, "Writing %" PRIu32 " KiB in %d byte blocks", size / 1024,
+                BENCH_WRITE_BLOCK_LEN);
+
+    int64_t start = k_uptime_get();
+    int ret = bench_write_unaligned(size);
+    bench_write_print(sh, "unaligned", size, k_uptime_delta(&start), ret);
+
+    start = k_uptime_get();
+    ret = bench_write_wav(size, 0);
+    bench_write_print(sh, "aligned", size, k_uptime_delta(&start), ret);
+
+    start = k_uptime_get();
+    ret = bench_write_wav(size, size + WAV_DATA_OFFSET);
+    bench_write_print(sh, "preallocated", size, k_uptime_delta(&start), ret);
+
+    fs_unlink(BENCH_WRITE_FILE);
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), bench_write, NULL,
+                 "Benchmark WAV file write throughput (don't use while "
+                 "recording) [bytes]",
+                 cmd_bench_write, 1, 1);
+#endif
+
+#if IS_ENABLED(CONFIG_RECORD_BENCHMARK)
+#define BENCH_RECORD_DEFAULT_S 60
+/// Lead time before the start, so that the ADC can power on
+#define BENCH_RECORD_START_DELAY_MS 500
+#define BENCH_RECORD_STOP_TIMEOUT_MS 10000
+
+static int cmd_bench_record(const struct shell *sh, size_t argc, char **argv) {
+    uint32_t duration_s = BENCH_RECORD_DEFAULT_S;
+    int ret;
+
+    if (argc >= 2) {
+        ret = parse_uint32(argv[1], &duration_s);
+        if (ret < 0) {
+            shell_error(sh, "Invalid duration: %s", argv[1]);
+            return ret;
+        }
+    }
+
+    struct audio_format format;
+    ret = audio_get_format(&format);
+    if (ret) return ret;
+    uint32_t bytes_per_s =
+        format.sample_rate * format.channels * format.bits_per_sample / 8;
+
+    struct record_stats before;
+    struct audio_stats audio_before;
+    ret = record_reset_high_water();
+    if (ret) return ret;
+    ret = record_get_stats(&before);
+    if (ret) return ret;
+    ret = audio_get_stats(&audio_before);
+    if (ret) return ret;
+
+    shell_print(sh, "Recording for %" PRIu32 " s at %" PRIu32 " KiB/s",
+                duration_s, bytes_per_s / 1024);
+    uint32_t now = qu32_32_whole(sync_timer_get_central_time());
+    ret = record_start(now + (uint64_t)BENCH_RECORD_START_DELAY_MS *
+                                 ZEUS_TIME_NOMINAL_FREQ / MSEC_PER_SEC);
+    if (ret) {
+        shell_error(sh, "failed to start recording (err %d)", ret);
+        return ret;
+    }
+    k_sleep(K_MSEC(BENCH_RECORD_START_DELAY_MS + duration_s * MSEC_PER_SEC));
+    // Wait for buffered audio to be written, so that it is included
+    ret = record_stop_wait(K_MSEC(BENCH_RECORD_STOP_TIMEOUT_MS));
+    if (ret == -EAGAIN) {
+        shell_warn(sh, "timed out writing buffered audio");
+    } else if (ret) {
+        shell_error(sh, "failed to stop recording (err %d)", ret);
+        return ret;
+    }
+
+    struct record_stats after;
+    ret = record_get_stats(&after);
+    if (ret) return ret;
+
+    struct audio_stats audio_after;
+    ret = audio_get_stats(&audio_after);
+    if (ret) return ret;
+
+    latency_print(sh, "Writes", &after.write_latency);
+    latency_print(sh, "Syncs", &after.sync_latency);
+    shell_print(sh, "      Overruns: %" PRIu32 " buffer, %" PRIu32 " I2S",
+                after.queue_overruns - before.queue_overruns,
+                audio_after.i2s_overruns - audio_before.i2s_overruns);
+
+    // Margin is how much longer the worst stall could have been before audio
+    // was dropped
+    if (after.buffer_size) {
+        // The pre-roll was already buffered when the benchmark started, so it
+        // isn't caused by stalls
+        uint32_t preroll_ms;
+        ret = record_get_preroll(&preroll_ms);
+        if (ret) return ret;
+        uint64_t preroll_bytes = (uint64_t)preroll_ms * bytes_per_s /
+                                 MSEC_PER_SEC;
+        uint32_t max_used = after.buffer_max_used -
+                            MIN(preroll_bytes, after.buffer_max_used);
+        uint32_t margin = after.buffer_size - max_used;
+        shell_print(sh,
+                    "        Buffer: %" PRIu32 "/%" PRIu32
+                    " KiB max used, excluding %" PRIu64 " KiB pre-roll",
+                    max_used / 1024, after.buffer_size / 1024,
+                    preroll_bytes / 1024);
+        shell_print(sh, "        Margin: %" PRIu64 " ms",
+                    (uint64_t)margin * MSEC_PER_SEC / bytes_per_s);
+    } else {
+        struct audio_block_config block_config;
+        ret = audio_get_block_config(&block_config);
+        if (ret) return ret;
+        uint32_t margin = block_config.count - after.queue_high_water;
+        shell_print(sh,
+                    "         Queue: %" PRIu32 "/%" PRIu32 " blocks max used",
+                    after.queue_high_water, block_config.count);
+        shell_print(sh, "        Margin: %" PRIu32 " ms",
+                    margin * block_config.duration_ms);
+    }
+
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((zeus), bench_record, NULL,
+                 "Record and report storage latency and the margin to "
+                 "overrun [seconds]",
+                 cmd_bench_record, 1, 1);
+#endif
@@ -1,13 +1,72 @@
 #include "wav.h"
 
 #include <errno.h>
+#include <ff.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 #include <zephyr/fs/fs.h>
 #include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/util.h>
 
-#define WAV_HEADER_SIZE (44)
-#define WAV_CHUNK_SIZE_OFFSET (4)
-#define WAV_SUBCHUNK_2_SIZE_OFFSET (40)
+#include "crc32c.h"
+
+// Some things aren't exposed by Zephyr, so FatFs is used directly
+#define WAV_FATFS_NATIVE                      \
+    (IS_ENABLED(CONFIG_FAT_FILESYSTEM_ELM) && \
+     IS_ENABLED(CONFIG_FS_FATFS_EXTRA_NATIVE_API))
+
+#define WAV_CHUNK_HEADER_SIZE (8)
+// Space for a ds64 chunk is always reserved right after the RIFF header, as a
+// JUNK chunk while the file is small enough to be plain RIFF.
+#define WAV_DS64_OFFSET (12)
+#define WAV_DS64_SIZE (28)
+// RIFF header and ds64 chunk, which hold all the sizes except the data chunk
+// size
+#define WAV_SIZES_LEN (WAV_DS64_OFFSET + WAV_CHUNK_HEADER_SIZE + WAV_DS64_SIZE)
+// Offset of the data chunk size, just before the data itself
+#define WAV_DATA_SIZE_OFFSET (WAV_DATA_OFFSET - 4)
+
+#define WAV_FMT_SIZE 16
+// Broadcast Wave (EBU Tech 3285) bext chunk, version 1 without any coding
+// history
+#define WAV_BEXT_OFFSET (WAV_SIZES_LEN + WAV_CHUNK_HEADER_SIZE + WAV_FMT_SIZE)
+#define WAV_BEXT_SIZE 602
+#define WAV_BEXT_VERSION 1
+// Description, originator, originator reference, origination date and time,
+// which are left empty because the recorder doesn't know the date
+#define WAV_BEXT_TEXT_SIZE (256 + 32 + 32 + 10 + 8)
+#define WAV_TIME_REFERENCE_OFFSET \
+    (WAV_BEXT_OFFSET + WAV_CHUNK_HEADER_SIZE + WAV_BEXT_TEXT_SIZE)
+// iXML chunk, which takes the rest of the header up to the data chunk
+#define WAV_IXML_OFFSET \
+    (WAV_BEXT_OFFSET + WAV_CHUNK_HEADER_SIZE + WAV_BEXT_SIZE)
+#define WAV_IXML_SIZE \
+    (WAV_DATA_OFFSET - WAV_CHUNK_HEADER_SIZE - WAV_IXML_OFFSET - \
+     WAV_CHUNK_HEADER_SIZE)
+
+// 2 GiB, because some programs use a signed 32-bit integer. Larger files are
+// written as RF64.
+#define WAV_RIFF_MAX_SIZE INT32_MAX
+// Chunk size meaning that the real size is in the ds64 chunk
+#define WAV_RF64_SIZE UINT32_MAX
+
+// Don't bother preallocating less than this
+#define WAV_PREALLOC_MIN_SIZE (1024 * 1024)
+
+BUILD_ASSERT(WAV_DATA_OFFSET % WAV_SECTOR_SIZE == 0,
+             "Data must start on a sector boundary");
+BUILD_ASSERT(WAV_IXML_SIZE % 2 == 0, "Chunks must have an even size");
+
+/// Writes the header through the sector buffer one sector at a time, so that
+/// it can be larger than the buffer. Errors are kept until the end.
+struct wav_header_writer {
+    struct wav* w;
+    /// Offset in the file of the next byte
+    uint32_t pos;
+    int err;
+};
 
 static int wav_write_all(struct fs_file_t* fp, const void* buf, size_t len) {
     int ret = fs_write(fp, buf, len);
@@ -27,10 +86,12 @@ static int wav_write_all(struct fs_file_t* fp, const void* buf, size_t len) {
     }
 }
 
-static int wav_write_u16(struct fs_file_t* fp, uint16_t val) {
-    uint8_t buf[sizeof(val)];
-    sys_put_le16(val, buf);
-    return wav_write_all(fp, buf, sizeof(buf));
+static int wav_read_all(struct fs_file_t* fp, void* buf, size_t len) {
+    ssize_t ret = fs_read(fp, buf, len);
+    if (ret < 0) return ret;
+    // End of file
+    if (ret != len) return -EINVAL;
+    return 0;
 }
 
 static int wav_write_u32(struct fs_file_t* fp, uint32_t val) {
@@ -39,9 +100,252 @@ static int wav_write_u32(struct fs_file_t* fp, uint32_t val) {
     return wav_write_all(fp, buf, sizeof(buf));
 }
 
-static int wav_write_header(struct wav* w, const struct wav_format* fmt) {
-    int ret;
+/// Seek to an absolute position, which may be beyond the range of off_t in
+/// files larger than 2 GiB.
+static int wav_seek(struct fs_file_t* fp, uint64_t pos) {
+    if (pos <= INT32_MAX) return fs_seek(fp, pos, FS_SEEK_SET);
+#if WAV_FATFS_NATIVE
+    FRESULT res = f_lseek(fp->filep, pos);
+    return res == FR_OK ? 0 : -EIO;
+#else
+    return -EFBIG;
+#endif
+}
+
+static int wav_file_size(struct fs_file_t* fp, uint64_t* size) {
+#if WAV_FATFS_NATIVE
+    *size = f_size((FIL*)fp->filep);
+    return 0;
+#else
+    int ret = fs_seek(fp, 0, FS_SEEK_END);
+    if (ret < 0) return ret;
+    off_t pos = fs_tell(fp);
+    if (pos < 0) return pos;
+    *size = pos;
+    return 0;
+#endif
+}
+
+/// Check whether the file is on exFAT, which is the only filesystem that
+/// supports files larger than 4 GiB.
+static bool wav_is_exfat(struct fs_file_t* fp) {
+#if WAV_FATFS_NATIVE && FF_FS_EXFAT
+    FIL* fil = fp->filep;
+    return fil->obj.fs->fs_type == FS_EXFAT;
+#else
+    return false;
+#endif
+}
+
+static uint8_t* wav_put_id(uint8_t* p, const char id[4]) {
+    memcpy(p, id, 4);
+    return p + 4;
+}
+
+static uint8_t* wav_put_u16(uint8_t* p, uint16_t val) {
+    sys_put_le16(val, p);
+    return p + sizeof(val);
+}
+
+static uint8_t* wav_put_u32(uint8_t* p, uint32_t val) {
+    sys_put_le32(val, p);
+    return p + sizeof(val);
+}
+
+static uint8_t* wav_put_u64(uint8_t* p, uint64_t val) {
+    sys_put_le64(val, p);
+    return p + sizeof(val);
+}
+
+static uint8_t* wav_put_chunk_header(uint8_t* p, const char id[4],
+                                     uint32_t size) {
+    p = wav_put_id(p, id);
+    return wav_put_u32(p, size);
+}
+
+/// Append data to the header, or fill bytes if data is NULL.
+static void wav_header_put(struct wav_header_writer* hw, const void* data,
+                           uint8_t fill, size_t len) {
+    struct wav* w = hw->w;
+
+    while (len > 0 && hw->err == 0) {
+        if (hw->pos >= WAV_DATA_OFFSET) {
+            hw->err = -EOVERFLOW;
+            return;
+        }
+        size_t offset = hw->pos % sizeof(w->buf);
+        size_t n = MIN(len, sizeof(w->buf) - offset);
+        if (data) {
+            memcpy(w->buf + offset, data, n);
+            data = (const uint8_t*)data + n;
+        } else {
+            memset(w->buf + offset, fill, n);
+        }
+        hw->pos += n;
+        len -= n;
+
+        if (offset + n == sizeof(w->buf)) {
+            hw->err = wav_write_all(&w->fp, w->buf, sizeof(w->buf));
+        }
+    }
+}
+
+static void wav_header_put_str(struct wav_header_writer* hw, const char* str) {
+    wav_header_put(hw, str, 0, strlen(str));
+}
+
+static void wav_header_printf(struct wav_header_writer* hw, const char* fmt,
+                              ...) {
+    char buf[96];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len < 0 || len >= sizeof(buf)) {
+        if (hw->err == 0) hw->err = -EOVERFLOW;
+        return;
+    }
+    wav_header_put(hw, buf, 0, len);
+}
+
+static void wav_header_put_chunk_header(struct wav_header_writer* hw,
+                                        const char id[4], uint32_t size) {
+    uint8_t buf[WAV_CHUNK_HEADER_SIZE];
+    wav_put_chunk_header(buf, id, size);
+    wav_header_put(hw, buf, 0, sizeof(buf));
+}
+
+/// Format the iXML timestamp. The numbers have a fixed width, so that it can
+/// be replaced in place.
+static int wav_format_ixml_timestamp(char* buf, size_t len,
+                                     uint64_t time_reference) {
+    int ret = snprintf(buf, len,
+                       "<TIMESTAMP_SAMPLES_SINCE_MIDNIGHT_HI>%010" PRIu32
+                       "</TIMESTAMP_SAMPLES_SINCE_MIDNIGHT_HI>\n"
+                       "<TIMESTAMP_SAMPLES_SINCE_MIDNIGHT_LO>%010" PRIu32
+                       "</TIMESTAMP_SAMPLES_SINCE_MIDNIGHT_LO>\n",
+                       (uint32_t)(time_reference >> 32),
+                       (uint32_t)time_reference);
+    if (ret < 0) return ret;
+    if (ret >= len) return -EOVERFLOW;
+    return ret;
+}
+
+#define WAV_IXML_TIMESTAMP_MAX_LEN 192
+
+/// Write the bext chunk, which DAWs use to place the file on the timeline.
+static void wav_header_put_bext(struct wav_header_writer* hw,
+                                const struct wav_format* fmt) {
+    uint8_t buf[sizeof(uint64_t)];
+
+    wav_header_put_chunk_header(hw, "bext", WAV_BEXT_SIZE);
+    wav_header_put(hw, NULL, 0, WAV_BEXT_TEXT_SIZE);
+    wav_put_u64(buf, fmt->time_reference);
+    wav_header_put(hw, buf, 0, sizeof(uint64_t));
+    wav_put_u16(buf, WAV_BEXT_VERSION);
+    wav_header_put(hw, buf, 0, sizeof(uint16_t));
+    // UMID and reserved
+    wav_header_put(hw, NULL, 0,
+                   WAV_BEXT_SIZE - WAV_BEXT_TEXT_SIZE - sizeof(uint64_t) -
+                       sizeof(uint16_t));
+}
+
+/// Write the iXML chunk, padded with whitespace after the root element to fill
+/// the rest of the header.
+static void wav_header_put_ixml(struct wav_header_writer* hw,
+                                const struct wav_format* fmt) {
+    wav_header_put_chunk_header(hw, "iXML", WAV_IXML_SIZE);
+    wav_header_put_str(hw,
+                       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       "<BWFXML>\n"
+                       "<IXML_VERSION>1.61</IXML_VERSION>\n");
+    if (fmt->tape[0]) {
+        wav_header_printf(hw, "<TAPE>%.*s</TAPE>\n", WAV_TAPE_LEN - 1,
+                          fmt->tape);
+    }
+    wav_header_printf(hw,
+                      "<SPEED>\n"
+                      "<FILE_SAMPLE_RATE>%" PRIu32 "</FILE_SAMPLE_RATE>\n",
+                      fmt->sample_rate);
+    wav_header_printf(hw, "<AUDIO_BIT_DEPTH>%" PRIu16 "</AUDIO_BIT_DEPTH>\n",
+                      fmt->bits_per_sample);
+    wav_header_printf(
+        hw, "<TIMESTAMP_SAMPLE_RATE>%" PRIu32 "</TIMESTAMP_SAMPLE_RATE>\n",
+        fmt->sample_rate);
+
+    char timestamp[WAV_IXML_TIMESTAMP_MAX_LEN];
+    int len = wav_format_ixml_timestamp(timestamp, sizeof(timestamp),
+                                        fmt->time_reference);
+    if (len < 0) {
+        if (hw->err == 0) hw->err = len;
+        return;
+    }
+    hw->w->ixml_timestamp_offset = hw->pos;
+    wav_header_put(hw, timestamp, 0, len);
+
+    wav_header_printf(hw,
+                      "</SPEED>\n"
+                      "<TRACK_LIST>\n"
+                      "<TRACK_COUNT>%" PRIu16 "</TRACK_COUNT>\n",
+                      fmt->channels);
+    for (uint16_t i = 1; i <= fmt->channels; ++i) {
+        wav_header_printf(hw,
+                          "<TRACK><CHANNEL_INDEX>%" PRIu16
+                          "</CHANNEL_INDEX><INTERLEAVE_INDEX>%" PRIu16
+                          "</INTERLEAVE_INDEX></TRACK>\n",
+                          i, i);
+    }
+    wav_header_put_str(hw,
+                       "</TRACK_LIST>\n"
+                       "</BWFXML>\n");
+
+    uint32_t end = WAV_IXML_OFFSET + WAV_CHUNK_HEADER_SIZE + WAV_IXML_SIZE;
+    if (hw->pos > end) {
+        if (hw->err == 0) hw->err = -EOVERFLOW;
+        return;
+    }
+    wav_header_put(hw, NULL, ' ', end - hw->pos);
+}
+
+static bool wav_is_rf64(uint64_t data_offset, uint64_t data_size) {
+    return data_offset + data_size > WAV_RIFF_MAX_SIZE;
+}
+
+/// Value of the data chunk size field
+static uint32_t wav_data_chunk_size(uint64_t data_offset, uint64_t data_size) {
+    return wav_is_rf64(data_offset, data_size) ? WAV_RF64_SIZE : data_size;
+}
+
+/// Fill in the RIFF header and the ds64 chunk. Files that are too large for
+/// RIFF are written as RF64, with the sizes in the ds64 chunk. Otherwise, the
+/// ds64 chunk is replaced by a JUNK chunk of the same size, so a file can
+/// switch between the two by rewriting just this part of the header.
+static void wav_put_sizes(uint8_t buf[WAV_SIZES_LEN], uint64_t data_offset,
+                          uint64_t data_size, uint16_t bytes_per_frame) {
+    uint64_t riff_size = data_offset + data_size - 8;
+    uint8_t* p = buf;
+
+    if (wav_is_rf64(data_offset, data_size)) {
+        p = wav_put_chunk_header(p, "RF64", WAV_RF64_SIZE);
+        p = wav_put_id(p, "WAVE");
+        p = wav_put_chunk_header(p, "ds64", WAV_DS64_SIZE);
+        p = wav_put_u64(p, riff_size);
+        p = wav_put_u64(p, data_size);
+        p = wav_put_u64(p, data_size / bytes_per_frame /* sample count */);
+        wav_put_u32(p, 0 /* table length */);
+    } else {
+        p = wav_put_chunk_header(p, "RIFF", riff_size);
+        p = wav_put_id(p, "WAVE");
+        p = wav_put_chunk_header(p, "JUNK", WAV_DS64_SIZE);
+        memset(p, 0, WAV_DS64_SIZE);
+    }
+}
 
+/// Build the header in the sector buffer and write it a sector at a time. The
+/// iXML chunk is padded so that the data starts on a sector boundary, which
+/// keeps every later write sector aligned.
+static int wav_write_header(struct wav* w, const struct wav_format* fmt,
+                            uint64_t max_file_size) {
     uint16_t bytes_per_sample = DIV_ROUND_UP(fmt->bits_per_sample, 8);
     uint16_t bytes_per_frame = fmt->channels * bytes_per_sample;
     uint32_t byte_rate = fmt->sample_rate * bytes_per_frame;
@@ -49,72 +353,128 @@ static int wav_write_header(struct wav* w, const struct wav_format* fmt) {
     w->bytes_per_frame = bytes_per_frame;
     // Limit of data chunk size; make sure it doesn't split a frame
     w->max_data_size =
-        ROUND_DOWN(fmt->max_file_size - WAV_HEADER_SIZE, bytes_per_frame);
+        ROUND_DOWN(max_file_size - WAV_DATA_OFFSET, bytes_per_frame);
     w->data_size = 0;
 
-    // Chunk ID
-    ret = wav_write_all(&w->fp, "RIFF", 4);
-    if (ret < 0) return ret;
-    // Chunk Size, initially set to maximum allowed file size. The size is
-    // updated to the correct value when the file is closed, but doing it
-    // regularly as the file is written is too slow because seeking on FatFs
-    // becomes slower as the file gets longer. Setting the maximum length should
-    // at least allow the file to be played even if it doesn't get closed
-    // cleanly.
-    ret = wav_write_u32(&w->fp, w->max_data_size + WAV_HEADER_SIZE - 8);
-    if (ret < 0) return ret;
-    // Format
-    ret = wav_write_all(&w->fp, "WAVE", 4);
-    if (ret < 0) return ret;
+    // Sizes, initially set to maximum allowed file size. The sizes are updated
+    // to the correct value when the file is closed, but doing it regularly as
+    // the file is written is usually too slow because seeking on FatFs becomes
+    // slower as the file gets longer (see wav_sync() for the exception).
+    // Setting the maximum length should at least allow the file to be played
+    // even if it doesn't get closed cleanly.
+    wav_put_sizes(w->buf, WAV_DATA_OFFSET, w->max_data_size, bytes_per_frame);
+    uint8_t* p = w->buf + WAV_SIZES_LEN;
 
-    // Subchunk 1 ID
-    ret = wav_write_all(&w->fp, "fmt ", 4);
-    if (ret < 0) return ret;
-    // Subchunk 1 Size
-    ret = wav_write_u32(&w->fp, 16);
-    if (ret < 0) return ret;
-    // Audio Format
-    ret = wav_write_u16(&w->fp, 1 /* PCM */);
-    if (ret < 0) return ret;
-    // Num Channels
-    ret = wav_write_u16(&w->fp, fmt->channels);
-    if (ret < 0) return ret;
-    // Sample Rate
-    ret = wav_write_u32(&w->fp, fmt->sample_rate);
-    if (ret < 0) return ret;
-    // Byte Rate
-    ret = wav_write_u32(&w->fp, byte_rate);
-    if (ret < 0) return ret;
-    // Block Align
-    ret = wav_write_u16(&w->fp, bytes_per_frame);
-    if (ret < 0) return ret;
-    // Bits per Sample
-    ret = wav_write_u16(&w->fp, fmt->bits_per_sample);
-    if (ret < 0) return ret;
+    p = wav_put_chunk_header(p, "fmt ", WAV_FMT_SIZE);
+    p = wav_put_u16(p, 1 /* PCM */);
+    p = wav_put_u16(p, fmt->channels);
+    p = wav_put_u32(p, fmt->sample_rate);
+    p = wav_put_u32(p, byte_rate);
+    p = wav_put_u16(p, bytes_per_frame /* block align */);
+    p = wav_put_u16(p, fmt->bits_per_sample);
 
-    // Subchunk 2 ID
-    ret = wav_write_all(&w->fp, "data", 4);
-    if (ret < 0) return ret;
-    // Subchunk 2 Size, initially set the maximum allowed size. See the comment
-    // about chunk size above.
-    ret = wav_write_u32(&w->fp, w->max_data_size);
-    if (ret < 0) return ret;
+    struct wav_header_writer hw = {.w = w, .pos = p - w->buf};
+    wav_header_put_bext(&hw, fmt);
+    wav_header_put_ixml(&hw, fmt);
 
-    return 0;
+    // Data size, initially set the maximum allowed size. See the comment about
+    // sizes above.
+    uint32_t data_chunk_size =
+        wav_data_chunk_size(WAV_DATA_OFFSET, w->max_data_size);
+    wav_header_put_chunk_header(&hw, "data", data_chunk_size);
+    __ASSERT_NO_MSG(hw.err || hw.pos == WAV_DATA_OFFSET);
+
+    return hw.err;
+}
+
+/// Allocate a contiguous area for the file, so that writing it only touches
+/// data sectors and never has to update the FAT until the area is full. If
+/// there is not enough contiguous free space, try progressively smaller sizes.
+/// This must be done before anything is written.
+static int wav_preallocate(struct wav* w, uint32_t size) {
+#if WAV_FATFS_NATIVE
+    // Zephyr doesn't expose preallocation, so use FatFs directly
+    FIL* fil = w->fp.filep;
+
+    for (; size >= WAV_PREALLOC_MIN_SIZE; size /= 2) {
+        FRESULT res = f_expand(fil, size, 1);
+        if (res == FR_OK) {
+            // exFAT files without a FAT chain must have a size that covers
+            // all of their clusters
+            if (!wav_is_exfat(&w->fp)) {
+                // Keep the size at the amount actually written, so that the
+                // directory entry is accurate after each sync and a file that
+                // was never closed can be recovered. Writes still follow the
+                // allocated cluster chain.
+                fil->obj.objsize = 0;
+            }
+            w->prealloc_size = size;
+            return 0;
+        } else if (res != FR_DENIED) {
+            return -EIO;
+        }
+    }
+    return -ENOSPC;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+/// Set the file size, and free any clusters allocated past the end of the file,
+/// even if they were never part of the file size.
+static int wav_release_slack(struct fs_file_t* fp, uint64_t size) {
+#if WAV_FATFS_NATIVE
+    FIL* fil = fp->filep;
+    // FatFs only frees the rest of the cluster chain when a file shrinks. On
+    // exFAT the size always covers the allocation.
+    if (!wav_is_exfat(fp) && fil->obj.objsize <= size) {
+        fil->obj.objsize = size + 1;
+    }
+    // fs_truncate() can't handle files larger than 2 GiB
+    FRESULT res = f_lseek(fil, size);
+    if (res == FR_OK) res = f_truncate(fil);
+    return res == FR_OK ? 0 : -EIO;
+#else
+    return fs_truncate(fp, size);
+#endif
+}
+
+static int wav_truncate(struct wav* w) {
+    if (w->prealloc_size == 0) return 0;
+    return wav_release_slack(&w->fp, WAV_DATA_OFFSET + w->data_size);
 }
 
 int wav_open(struct wav* w, const char* name, const struct wav_format* fmt) {
     if (fmt->channels == 0) return -EINVAL;
     if (fmt->sample_rate == 0) return -EINVAL;
     if (fmt->bits_per_sample == 0) return -EINVAL;
-    if (fmt->max_file_size < WAV_HEADER_SIZE) return -EINVAL;
+    if (fmt->max_file_size < WAV_DATA_OFFSET) return -EINVAL;
 
     *w = (struct wav){.data_size = 0};
     fs_file_t_init(&w->fp);
     int ret = fs_open(&w->fp, name, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
     if (ret < 0) return ret;
 
-    ret = wav_write_header(w, fmt);
+    uint64_t max_file_size = fmt->max_file_size;
+    bool exfat = wav_is_exfat(&w->fp);
+    if (!exfat) {
+        max_file_size = MIN(max_file_size, WAV_RIFF_MAX_SIZE);
+    }
+
+    if (fmt->prealloc_size > 0) {
+        // Not fatal, the file just grows as it is written instead
+        (void)wav_preallocate(w, MIN(fmt->prealloc_size, max_file_size));
+    }
+
+    // The file size on exFAT includes preallocated space, so it can't be used
+    // to recover a file that was never closed. Seeking in a contiguous exFAT
+    // file doesn't need to follow a cluster chain, so the header can be kept
+    // up to date instead, until the file outgrows the preallocated area (see
+    // wav_sync()).
+    w->sync_header = exfat && w->prealloc_size > 0;
+    w->compute_crc = fmt->crc;
+
+    ret = wav_write_header(w, fmt, max_file_size);
     if (ret < 0) {
         fs_close(&w->fp);
         return ret;
@@ -123,57 +483,309 @@ int wav_open(struct wav* w, const char* name, const struct wav_format* fmt) {
     return 0;
 }
 
+int wav_set_time_reference(struct wav* w, uint64_t time_reference) {
+    char timestamp[WAV_IXML_TIMESTAMP_MAX_LEN];
+    int len = wav_format_ixml_timestamp(timestamp, sizeof(timestamp),
+                                        time_reference);
+    if (len < 0) return len;
+
+    uint8_t buf[sizeof(uint64_t)];
+    wav_put_u64(buf, time_reference);
+    int ret = wav_seek(&w->fp, WAV_TIME_REFERENCE_OFFSET);
+    if (ret < 0) return ret;
+    ret = wav_write_all(&w->fp, buf, sizeof(buf));
+    if (ret < 0) return ret;
+
+    ret = wav_seek(&w->fp, w->ixml_timestamp_offset);
+    if (ret < 0) return ret;
+    ret = wav_write_all(&w->fp, timestamp, len);
+    if (ret < 0) return ret;
+
+    // Seek back to the end of the data written so far
+    return wav_seek(&w->fp, WAV_DATA_OFFSET + w->data_size - w->buf_used);
+}
+
+int wav_get_data_sectors(struct wav* w, uint32_t* start_sector,
+                         uint32_t* num_sector) {
+#if WAV_FATFS_NATIVE
+    if (w->prealloc_size == 0) return -ENOTSUP;
+
+    FIL* fil = w->fp.filep;
+    FATFS* fs = fil->obj.fs;
+#if FF_MAX_SS == FF_MIN_SS
+    uint32_t sector_size = FF_MAX_SS;
+#else
+    uint32_t sector_size = fs->ssize;
+#endif
+    // The preallocated area is contiguous, starting at the first cluster
+    LBA_t file_sector =
+        fs->database + (LBA_t)fs->csize * (fil->obj.sclust - 2);
+    uint32_t header_sectors = DIV_ROUND_UP(WAV_DATA_OFFSET, sector_size);
+    *start_sector = file_sector + header_sectors;
+    *num_sector = w->prealloc_size / sector_size - header_sectors;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 int wav_write(struct wav* w, const uint8_t buf[], uint32_t len) {
+    int ret;
+
     if (w->data_size + len > w->max_data_size) {
         len = w->max_data_size - w->data_size;
     }
-    int ret = fs_write(&w->fp, buf, len);
-    if (ret < 0) {
-        return ret;
-    } else if (ret != len) {
-        // Zephyr never does partial writes except on failure, normally out
-        // of space.
-        w->data_size += ret;
-        int write_errno = errno;
-        // Sometimes errno is zero, unclear why. Assume no space.
-        if (write_errno == 0) {
-            write_errno = ENOSPC;
+
+    uint32_t written = 0;
+    if (w->buf_used > 0) {
+        // Complete the partial sector left over from the last write
+        size_t n = MIN(len, sizeof(w->buf) - w->buf_used);
+        memcpy(w->buf + w->buf_used, buf, n);
+        w->buf_used += n;
+        written += n;
+
+        if (w->buf_used == sizeof(w->buf)) {
+            ret = wav_write_all(&w->fp, w->buf, sizeof(w->buf));
+            if (ret < 0) return ret;
+            w->buf_used = 0;
         }
-        return -write_errno;
-    } else {
-        w->data_size += len;
-        return len;
     }
+
+    if (w->buf_used == 0) {
+        // Whole sectors go straight to the disk without being copied, and the
+        // rest is kept until the next write completes the sector.
+        size_t direct = ROUND_DOWN(len - written, WAV_SECTOR_SIZE);
+        if (direct > 0) {
+            ret = wav_write_all(&w->fp, buf + written, direct);
+            if (ret < 0) return ret;
+            written += direct;
+        }
+
+        w->buf_used = len - written;
+        memcpy(w->buf, buf + written, w->buf_used);
+        written = len;
+    }
+
+    if (w->compute_crc) {
+        w->crc = crc32c_update(w->crc, buf, written);
+    }
+    w->data_size += written;
+    return written;
 }
 
-int wav_update_size(struct wav* w) {
-    // If we ran out of space or the user provided a partial frame in a buffer,
-    // we could have a data size that is not a multiple of the frame size. Round
-    // it down when writing the header, but don't truncate the file in case the
-    // user provides the rest of the frame later.
-    uint32_t data_size = ROUND_DOWN(w->data_size, w->bytes_per_frame);
+/// Write any partial sector left in the sector buffer.
+static int wav_flush(struct wav* w) {
+    if (w->buf_used == 0) return 0;
+
+    int ret = wav_write_all(&w->fp, w->buf, w->buf_used);
+    if (ret < 0) return ret;
+    w->buf_used = 0;
+    return 0;
+}
 
-    int ret = fs_seek(&w->fp, WAV_CHUNK_SIZE_OFFSET, FS_SEEK_SET);
+/// Write the sizes in the header for the given data size, then seek back to
+/// the end of the data written so far.
+static int wav_write_sizes(struct wav* w, uint64_t data_size) {
+    uint8_t buf[WAV_SIZES_LEN];
+    wav_put_sizes(buf, WAV_DATA_OFFSET, data_size, w->bytes_per_frame);
+    int ret = wav_seek(&w->fp, 0);
     if (ret < 0) return ret;
-    ret = wav_write_u32(&w->fp, data_size + WAV_HEADER_SIZE - 8);
+    ret = wav_write_all(&w->fp, buf, sizeof(buf));
     if (ret < 0) return ret;
 
-    ret = fs_seek(&w->fp, WAV_SUBCHUNK_2_SIZE_OFFSET, FS_SEEK_SET);
+    ret = wav_seek(&w->fp, WAV_DATA_SIZE_OFFSET);
     if (ret < 0) return ret;
-    ret = wav_write_u32(&w->fp, data_size);
+    ret = wav_write_u32(&w->fp,
+                        wav_data_chunk_size(WAV_DATA_OFFSET, data_size));
     if (ret < 0) return ret;
 
-    ret = fs_seek(&w->fp, 0, FS_SEEK_END);
+    // Seek back to the end of the data written so far. Data still in the
+    // sector buffer hasn't been written yet.
+    ret = wav_seek(&w->fp, WAV_DATA_OFFSET + w->data_size - w->buf_used);
     if (ret < 0) return ret;
 
     return 0;
 }
 
+int wav_update_size(struct wav* w) {
+    uint64_t written = w->data_size - w->buf_used;
+    // If we ran out of space or the user provided a partial frame in a buffer,
+    // we could have a data size that is not a multiple of the frame size. Round
+    // it down when writing the header, but don't truncate the file in case the
+    // user provides the rest of the frame later.
+    return wav_write_sizes(w, ROUND_DOWN(written, w->bytes_per_frame));
+}
+
+int wav_sync(struct wav* w) {
+    if (w->sync_header &&
+        WAV_DATA_OFFSET + w->data_size - w->buf_used >= w->prealloc_size) {
+        // The file has filled its contiguous area and continues in a FAT
+        // chain, which seeking to the header would have to follow. The file
+        // size now only covers the data written, so put back the maximum
+        // sizes and let wav_recover() use the file size instead.
+        w->sync_header = false;
+        int ret = wav_write_sizes(w, w->max_data_size);
+        if (ret < 0) return ret;
+    }
+    if (w->sync_header) {
+        int ret = wav_update_size(w);
+        if (ret < 0) return ret;
+    }
+    return fs_sync(&w->fp);
+}
+
 int wav_close(struct wav* w) {
-    int ret = wav_update_size(w);
+    int ret = wav_flush(w);
+    int ret_update = wav_update_size(w);
+    if (ret == 0) ret = ret_update;
+    int ret_truncate = wav_truncate(w);
+    if (ret == 0) ret = ret_truncate;
+    int ret_close = fs_close(&w->fp);
+    if (ret == 0) ret = ret_close;
+    return ret;
+}
+
+int wav_close_no_update(struct wav* w) {
+    int ret = wav_flush(w);
+    int ret_truncate = wav_truncate(w);
+    if (ret == 0) ret = ret_truncate;
     int ret_close = fs_close(&w->fp);
     if (ret == 0) ret = ret_close;
     return ret;
 }
 
-int wav_close_no_update(struct wav* w) { return fs_close(&w->fp); }
+int wav_recover(const char* name, bool* recovered) {
+    struct fs_file_t fp;
+    uint8_t buf[WAV_SIZES_LEN];
+    int ret, ret_close;
+
+    *recovered = false;
+
+    fs_file_t_init(&fp);
+    ret = fs_open(&fp, name, FS_O_RDWR);
+    if (ret < 0) return ret;
+
+    uint64_t file_size;
+    ret = wav_file_size(&fp, &file_size);
+    if (ret < 0) goto exit;
+
+    ret = wav_seek(&fp, 0);
+    if (ret < 0) goto exit;
+    ret = wav_read_all(&fp, buf, 12);
+    if (ret < 0) goto exit;
+    if ((memcmp(buf, "RIFF", 4) != 0 && memcmp(buf, "RF64", 4) != 0) ||
+        memcmp(buf + 8, "WAVE", 4) != 0) {
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    // Walk the chunk headers until the data chunk, skipping over their
+    // contents. Only the header is read, never the audio data.
+    uint64_t pos = 12;
+    uint64_t data_size;
+    uint64_t ds64_data_size = 0;
+    bool has_ds64 = false;
+    // Space for the ds64 chunk is reserved, so the sizes can be rewritten as
+    // either RIFF or RF64. Not the case for files from older versions.
+    bool has_ds64_space = false;
+    uint16_t block_align = 0;
+    while (true) {
+        ret = wav_seek(&fp, pos);
+        if (ret < 0) goto exit;
+        ret = wav_read_all(&fp, buf, WAV_CHUNK_HEADER_SIZE);
+        if (ret < 0) goto exit;
+        pos += WAV_CHUNK_HEADER_SIZE;
+
+        uint32_t chunk_size = sys_get_le32(buf + 4);
+        if (memcmp(buf, "data", 4) == 0) {
+            data_size = has_ds64 && chunk_size == WAV_RF64_SIZE
+                            ? ds64_data_size
+                            : chunk_size;
+            break;
+        }
+        if (memcmp(buf, "fmt ", 4) == 0 && chunk_size >= 16) {
+            ret = wav_read_all(&fp, buf, 16);
+            if (ret < 0) goto exit;
+            block_align = sys_get_le16(buf + 12);
+        } else if (pos == WAV_DS64_OFFSET + WAV_CHUNK_HEADER_SIZE &&
+                   chunk_size == WAV_DS64_SIZE) {
+            if (memcmp(buf, "ds64", 4) == 0) {
+                ret = wav_read_all(&fp, buf, WAV_DS64_SIZE);
+                if (ret < 0) goto exit;
+                ds64_data_size = sys_get_le64(buf + 8);
+                has_ds64 = true;
+                has_ds64_space = true;
+            } else if (memcmp(buf, "JUNK", 4) == 0) {
+                has_ds64_space = true;
+            }
+        }
+
+        // Chunks are padded to an even size
+        chunk_size += chunk_size & 1;
+        if (chunk_size > file_size - pos) {
+            ret = -EINVAL;
+            goto exit;
+        }
+        pos += chunk_size;
+    }
+    if (block_align == 0) {
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    // A file that was closed normally has exactly as much data as the header
+    // says.
+    uint64_t available = file_size - pos;
+    if (data_size == available) {
+        ret = 0;
+        goto exit;
+    }
+    if (data_size > available) {
+        // The header still has the maximum size written by wav_write_header(),
+        // and the file size is the data that was written before the last sync.
+        data_size = ROUND_DOWN(available, block_align);
+    } else if (!has_ds64_space || !wav_is_exfat(&fp)) {
+        // Only our files on exFAT have their header kept up to date by
+        // wav_sync() with preallocated space after the data. Anything else
+        // is a finished file with more chunks after the data, so leave it
+        // alone.
+        ret = 0;
+        goto exit;
+    }
+    // Otherwise, the header was kept up to date by wav_sync() and the rest of
+    // the file is preallocated space.
+
+    if (has_ds64_space) {
+        wav_put_sizes(buf, pos, data_size, block_align);
+        ret = wav_seek(&fp, 0);
+        if (ret < 0) goto exit;
+        ret = wav_write_all(&fp, buf, WAV_SIZES_LEN);
+        if (ret < 0) goto exit;
+    } else {
+        if (wav_is_rf64(pos, data_size)) {
+            ret = -EFBIG;
+            goto exit;
+        }
+        ret = wav_seek(&fp, 4);
+        if (ret < 0) goto exit;
+        ret = wav_write_u32(&fp, pos + data_size - 8);
+        if (ret < 0) goto exit;
+    }
+
+    ret = wav_seek(&fp, pos - 4);
+    if (ret < 0) goto exit;
+    ret = wav_write_u32(&fp, wav_data_chunk_size(pos, data_size));
+    if (ret < 0) goto exit;
+
+    // Drop any partial frame, along with preallocated space that was never
+    // written
+    ret = wav_release_slack(&fp, pos + data_size);
+    if (ret < 0) goto exit;
+
+    *recovered = true;
+
+exit:
+    ret_close = fs_close(&fp);
+    if (ret == 0) ret = ret_close;
+    return ret;
+}
@@ -1,20 +1,59 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <zephyr/fs/fs.h>
+#include <zephyr/toolchain.h>
+
+#define WAV_SECTOR_SIZE 512
+/// Offset of the audio data in the file. The header is padded so that the data
+/// starts on a sector boundary, with room for the bext and iXML chunks.
+#define WAV_DATA_OFFSET (4 * WAV_SECTOR_SIZE)
+/// Maximum length of the iXML tape name, including the terminator
+#define WAV_TAPE_LEN 32
 
 struct wav_format {
     uint16_t channels;
     uint32_t sample_rate;
     uint16_t bits_per_sample;
-    uint32_t max_file_size;
+    /// Maximum file size. Files larger than 2 GiB are written as RF64, but
+    /// this is limited to 2 GiB unless the filesystem is exFAT.
+    uint64_t max_file_size;
+    /// Size to preallocate as a contiguous area when the file is opened, or
+    /// zero to let the file grow as it is written.
+    uint32_t prealloc_size;
+    /// Compute a CRC-32C of the audio data as it is written. crc32c_init()
+    /// must have been called.
+    bool crc;
+    /// Position of the first sample on the shared timeline, in samples. Stored
+    /// as the bext TimeReference and the iXML timestamp, so that DAWs can
+    /// place files from different recorders without aligning them by hand.
+    uint64_t time_reference;
+    /// Name of the recording session, stored as the iXML tape so that files
+    /// from one session can be grouped. May be empty.
+    char tape[WAV_TAPE_LEN];
 };
 
 struct wav {
     struct fs_file_t fp;
     uint16_t bytes_per_frame;
-    uint32_t max_data_size;
-    uint32_t data_size;
+    uint64_t max_data_size;
+    uint64_t data_size;
+    /// Size of the contiguous area preallocated for the file, or zero if it
+    /// wasn't preallocated. The slack must be truncated when closing.
+    uint32_t prealloc_size;
+    /// Update the header sizes every time the file is synced
+    bool sync_header;
+    bool compute_crc;
+    /// CRC-32C of the data chunk contents written so far, if enabled
+    uint32_t crc;
+    /// Offset of the timestamp in the iXML chunk, so it can be rewritten
+    uint16_t ixml_timestamp_offset;
+    /// Data that doesn't fill a whole sector yet, so that every write reaching
+    /// the filesystem is a whole number of sectors. Also used to build the
+    /// header.
+    uint8_t buf[WAV_SECTOR_SIZE] __aligned(4);
+    uint16_t buf_used;
 };
 
 /// Open a new WAV file for writing. File will be truncated if it already
@@ -23,15 +62,39 @@ int wav_open(struct wav* w, const char* name, const struct wav_format* fmt);
 
 /// Write data to a WAV file. Must have been initialized with wav_init(). The
 /// file length in the header is not updated, and wav_update_size() must be
-/// called periodically to keep it up to date.
+/// called periodically to keep it up to date. Data is written to the file in
+/// whole sectors, and any partial sector at the end is buffered until the next
+/// write or until the file is closed.
 int wav_write(struct wav* w, const uint8_t buf[], uint32_t len);
 
 /// Update the file size fields in the WAV header.
 int wav_update_size(struct wav* w);
 
-/// Update the file size and then close the file. The file is still closed even
-/// if the size update fails.
+/// Change the position of the first sample on the shared timeline, for files
+/// that were opened before it was known. Can be called at any time.
+int wav_set_time_reference(struct wav* w, uint64_t time_reference);
+
+/// Get the disk sectors that the audio data will be written to, so that the
+/// disk can prepare for a sequential write. Return -ENOTSUP if the file was not
+/// preallocated, because the data may then be fragmented.
+int wav_get_data_sectors(struct wav* w, uint32_t* start_sector,
+                         uint32_t* num_sector);
+
+/// Flush written data to the disk, so that it survives a power loss. Where it
+/// is cheap (preallocated files on exFAT), the header sizes are also updated.
+/// Otherwise, wav_recover() can find the size from the file size.
+int wav_sync(struct wav* w);
+
+/// Update the file size, release any preallocated space that was not used and
+/// then close the file. The file is still closed even if the size update fails.
 int wav_close(struct wav* w);
 
-/// Close file updating header.
+/// Close file without updating header. Preallocated space is still released.
 int wav_close_no_update(struct wav* w);
+
+/// Repair a WAV file that was never closed (e.g. due to power loss), whose
+/// header still contains the maximum size. The sizes are set from the last
+/// complete frame within the file size, which covers all the data written
+/// before the last sync. Only the header is read. recovered is set if the file
+/// needed to be repaired. Return -EINVAL if the file is not a valid WAV file.
+int wav_recover(const char* name, bool* recovered);
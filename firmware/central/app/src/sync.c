@@ -13,11 +13,11 @@
 
 LOG_MODULE_REGISTER(sync);
 
-/// Delay from start command to start of recording. Must be long enough for
-/// audio nodes to reliably receive command.
-#define SYNC_START_DELAY_SEC 2
-/// Start delay in timer units
-#define SYNC_START_DELAY (SYNC_START_DELAY_SEC * ZEUS_TIME_NOMINAL_FREQ)
+/// Delay from start/stop command to start/stop of recording. Must be long
+/// enough for audio nodes to reliably receive command.
+#define SYNC_CMD_DELAY_SEC 2
+/// Command delay in timer units
+#define SYNC_CMD_DELAY (SYNC_CMD_DELAY_SEC * ZEUS_TIME_NOMINAL_FREQ)
 
 static void sync_adv_update_handler(struct k_work *work);
 static K_WORK_DEFINE(sync_update_work, sync_adv_update_handler);
@@ -77,15 +77,26 @@ static int sync_adv_update_data(void) {
             }
             // Clear out old start command once twice the start delay has
             // passed.
-            if (waiting_time < -SYNC_START_DELAY) {
+            if (waiting_time < -SYNC_CMD_DELAY) {
+                data->adv_data.cmd =
+                    (struct zeus_adv_cmd){.id = ZEUS_ADV_CMD_NONE};
+                new_cmd = true;
+            }
+        } break;
+        case ZEUS_ADV_CMD_STOP: {
+            int32_t waiting_time =
+                sync_time_diff(data->adv_data.cmd.stop.time,
+                               data->adv_data.hdr.sync.prev_time);
+            // Keep showing recording until the stop time
+            if (waiting_time <= 0) {
+                led_record_stopped();
+            }
+            if (waiting_time < -SYNC_CMD_DELAY) {
                 data->adv_data.cmd =
                     (struct zeus_adv_cmd){.id = ZEUS_ADV_CMD_NONE};
                 new_cmd = true;
             }
         } break;
-        case ZEUS_ADV_CMD_STOP:
-            led_record_stopped();
-            break;
         default:
             break;
     }
@@ -100,7 +111,7 @@ static int sync_adv_update_data(void) {
             cmd_len = sizeof(struct zeus_adv_cmd_start);
             break;
         case ZEUS_ADV_CMD_STOP:
-            cmd_len = 0;
+            cmd_len = sizeof(struct zeus_adv_cmd_stop);
             break;
         default:
         case ZEUS_ADV_CMD_NONE:
@@ -238,7 +249,7 @@ int sync_cmd_start(void) {
     const struct sync_config *config = &sync_config;
     struct sync_data *data = &sync_data;
 
-    uint32_t start_time = atomic_get(&data->last_pkt_time) + SYNC_START_DELAY;
+    uint32_t start_time = atomic_get(&data->last_pkt_time) + SYNC_CMD_DELAY;
 
     return k_msgq_put(config->cmd_queue,
                       &(struct zeus_adv_cmd){
@@ -250,10 +261,14 @@ int sync_cmd_start(void) {
 
 int sync_cmd_stop(void) {
     const struct sync_config *config = &sync_config;
+    struct sync_data *data = &sync_data;
+
+    uint32_t stop_time = atomic_get(&data->last_pkt_time) + SYNC_CMD_DELAY;
 
     return k_msgq_put(config->cmd_queue,
                       &(struct zeus_adv_cmd){
                           .id = ZEUS_ADV_CMD_STOP,
+                          .stop.time = stop_time,
                       },
                       K_NO_WAIT);
 }
\ No newline at end of file
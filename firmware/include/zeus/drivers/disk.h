@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2024 Ben Wolsieffer
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdint.h>
+
+#ifndef ZEPHYR_INCLUDE_DRIVERS_ZEUS_DISK_H_
+#define ZEPHYR_INCLUDE_DRIVERS_ZEUS_DISK_H_
+
+/// Declare that a region of sectors is about to be written sequentially, with a struct
+/// disk_stream_hint argument. Disks can use open-ended multi-block writes or erase the region in
+/// advance. The hint is only advisory: writes outside the region still work, and disks that can't
+/// use it return -ENOTSUP. Numbered well above the Zephyr disk_access commands.
+#define DISK_IOCTL_STREAM_HINT 0x80
+
+struct disk_stream_hint {
+	uint32_t start_sector;
+	/// Number of sectors in the region, or 0 to end the current stream
+	uint32_t num_sector;
+};
+
+#endif /* ZEPHYR_INCLUDE_DRIVERS_ZEUS_DISK_H_ */
@@ -10,6 +10,7 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/net/socket.h>
 
+#include "private/lftpd_hash.h"
 #include "private/lftpd_inet.h"
 #include "private/lftpd_path.h"
 #include "private/lftpd_status.h"
@@ -23,6 +24,7 @@ LOG_MODULE_REGISTER(lftpd, CONFIG_LFTPD_LOG_LEVEL);
 // https://tools.ietf.org/html/rfc5797
 // https://tools.ietf.org/html/rfc2428#section-3 EPSV
 // https://en.wikipedia.org/wiki/List_of_FTP_commands
+// https://datatracker.ietf.org/doc/html/draft-bryan-ftpext-hash-02 HASH
 
 typedef struct {
 	char* command;
@@ -33,6 +35,7 @@ static int cmd_cwd(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
 static int cmd_dele(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
 static int cmd_epsv(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
 static int cmd_feat(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
+static int cmd_hash(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
 static int cmd_list(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
 static int cmd_mkd(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
 static int cmd_nlst(struct lftpd_conn* conn, char* arg, size_t arg_buf_len);
@@ -56,6 +59,7 @@ static const command_t commands[] = {
 	{ "DELE", cmd_dele },  //
 	{ "EPSV", cmd_epsv },  //
 	{ "FEAT", cmd_feat },  //
+	{ "HASH", cmd_hash },  //
 	{ "LIST", cmd_list },  //
 	{ "MKD", cmd_mkd },	   //
 	{ "NLST", cmd_nlst },  //
@@ -386,6 +390,7 @@ static int cmd_epsv(struct lftpd_conn* conn, char* arg, size_t arg_buf_len) {
 static int cmd_feat(struct lftpd_conn* conn, char* arg, size_t arg_buf_len) {
 	send_multiline_response_begin(conn, 211, STATUS_211);
 	send_multiline_response_line(conn, " EPSV");
+	send_multiline_response_line(conn, " HASH CRC32C*");
 	send_multiline_response_line(conn, " PASV");
 	send_multiline_response_line(conn, " SIZE");
 	send_multiline_response_line(conn, " NLST");
@@ -394,6 +399,30 @@ static int cmd_feat(struct lftpd_conn* conn, char* arg, size_t arg_buf_len) {
 	return 0;
 }
 
+/// Reply with the hash stored in the file's sidecar (see lftpd_hash_read()), or
+/// 550 if there is none. The range in the reply is whatever the sidecar
+/// covers, not necessarily the whole file. Recordings hash only their data
+/// chunk, from byte 2048 to the end, because the header is rewritten on close.
+static int cmd_hash(struct lftpd_conn* conn, char* arg, size_t arg_buf_len) {
+	if (!arg) {
+		return send_simple_response(conn, 501, STATUS_501);
+	}
+
+	int ret = lftpd_path_resolve(conn->base_dir, conn->cwd, arg, arg_buf_len);
+	if (ret < 0) {
+		return send_simple_response(conn, 500, STATUS_500);
+	}
+
+	// Not read into conn->buf, which holds the response
+	char hash[96];
+	ret = lftpd_hash_read(arg, arg_buf_len, hash, sizeof(hash));
+	if (ret < 0) {
+		return send_simple_response(conn, 550, STATUS_550);
+	}
+
+	return send_simple_response(conn, 213, "%s %s", hash, arg);
+}
+
 static int cmd_list(struct lftpd_conn* conn, char* arg, size_t arg_buf_len) {
 	int data_socket = accept_data_connection(conn);
 	if (data_socket < 0) {
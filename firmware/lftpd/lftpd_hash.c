@@ -0,0 +1,35 @@
+#include "private/lftpd_hash.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/fs/fs.h>
+
+/// Hashes are not computed by the server, which would mean reading the whole
+/// file. Whoever writes a file can store its hash in a sidecar with this
+/// suffix.
+#define HASH_SIDECAR_SUFFIX ".hash"
+
+int lftpd_hash_read(char* path, size_t path_buf_len, char* hash,
+					size_t hash_len) {
+	if (!path || !hash || hash_len == 0) return -EINVAL;
+
+	size_t path_len = strlen(path);
+	if (path_len + sizeof(HASH_SIDECAR_SUFFIX) > path_buf_len) {
+		return -ENAMETOOLONG;
+	}
+	strcpy(path + path_len, HASH_SIDECAR_SUFFIX);
+
+	struct fs_file_t file;
+	fs_file_t_init(&file);
+	int ret = fs_open(&file, path, FS_O_READ);
+	path[path_len] = '\0';
+	if (ret < 0) return ret;
+
+	ssize_t read_len = fs_read(&file, hash, hash_len - 1);
+	fs_close(&file);
+	if (read_len < 0) return read_len;
+	if (read_len == 0) return -ENODATA;
+	hash[read_len] = '\0';
+	hash[strcspn(hash, "\r\n")] = '\0';
+	return 0;
+}
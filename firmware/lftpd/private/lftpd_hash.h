@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+
+/// Read the stored hash of a file from its sidecar, a file with ".hash"
+/// appended to the name. The sidecar holds a line of the form
+/// "<algorithm> <start>-<end> <hash>", where the inclusive byte range is the
+/// part of the file that was hashed, which need not be the whole file. The
+/// line is returned without its line ending. path is used as scratch space to
+/// build the sidecar name, and is restored before returning. Return
+/// -ENAMETOOLONG if the sidecar name doesn't fit in path, -ENODATA if the
+/// sidecar is empty, or the error from opening or reading the sidecar.
+int lftpd_hash_read(char* path, size_t path_buf_len, char* hash,
+					size_t hash_len);
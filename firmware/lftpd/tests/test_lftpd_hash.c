@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <ff.h>
+#include <string.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/ztest.h>
+
+#include "lftpd_hash.h"
+
+#define zassert_equal_string(a, b, ...) \
+	zassert(strcmp(a, b) == 0, #a " not equal to " #b, ##__VA_ARGS__)
+
+#define MOUNT_POINT "/RAM:"
+
+static FATFS fat_fs;
+static struct fs_mount_t mount = {
+	.type = FS_FATFS,
+	.fs_data = &fat_fs,
+	.mnt_point = MOUNT_POINT,
+};
+
+static void write_file(const char* path, const char* contents) {
+	struct fs_file_t file;
+	fs_file_t_init(&file);
+	zassert_ok(fs_open(&file, path, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC));
+	zassert_equal(fs_write(&file, contents, strlen(contents)),
+				  strlen(contents));
+	zassert_ok(fs_close(&file));
+}
+
+static void* lftpd_hash_setup(void) {
+	// The RAM disk is formatted when it is mounted for the first time
+	zassert_ok(fs_mount(&mount));
+	return NULL;
+}
+
+static void lftpd_hash_after(void* fixture) {
+	(void)fs_unlink(MOUNT_POINT "/rec.wav.hash");
+}
+
+ZTEST_SUITE(lftpd_hash, NULL, lftpd_hash_setup, NULL, lftpd_hash_after,
+			NULL);
+
+ZTEST(lftpd_hash, test_lftpd_hash_read) {
+	write_file(MOUNT_POINT "/rec.wav.hash", "CRC32C 2048-4095 0123abcd\n");
+
+	char path[32] = MOUNT_POINT "/rec.wav";
+	char hash[64];
+	zassert_ok(lftpd_hash_read(path, sizeof(path), hash, sizeof(hash)));
+	zassert_equal_string(hash, "CRC32C 2048-4095 0123abcd");
+	zassert_equal_string(path, MOUNT_POINT "/rec.wav");
+}
+
+ZTEST(lftpd_hash, test_lftpd_hash_read_missing) {
+	char path[32] = MOUNT_POINT "/rec.wav";
+	char hash[64];
+	zassert_equal(lftpd_hash_read(path, sizeof(path), hash, sizeof(hash)),
+				  -ENOENT);
+	zassert_equal_string(path, MOUNT_POINT "/rec.wav");
+}
+
+ZTEST(lftpd_hash, test_lftpd_hash_read_empty) {
+	write_file(MOUNT_POINT "/rec.wav.hash", "");
+
+	char path[32] = MOUNT_POINT "/rec.wav";
+	char hash[64];
+	zassert_equal(lftpd_hash_read(path, sizeof(path), hash, sizeof(hash)),
+				  -ENODATA);
+}
+
+ZTEST(lftpd_hash, test_lftpd_hash_read_too_long) {
+	// No room for the suffix
+	char path[16] = MOUNT_POINT "/rec.wav";
+	char hash[64];
+	zassert_equal(lftpd_hash_read(path, sizeof(path), hash, sizeof(hash)),
+				  -ENAMETOOLONG);
+	zassert_equal_string(path, MOUNT_POINT "/rec.wav");
+}
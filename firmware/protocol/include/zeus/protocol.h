@@ -36,10 +36,15 @@ struct zeus_adv_cmd_start {
     uint32_t time;
 } __packed;
 
+struct zeus_adv_cmd_stop {
+    uint32_t time;
+} __packed;
+
 struct zeus_adv_cmd {
     enum zeus_adv_cmd_id id;
     union {
         struct zeus_adv_cmd_start start;
+        struct zeus_adv_cmd_stop stop;
     };
 } __packed;
 